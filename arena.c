@@ -0,0 +1,109 @@
+/** @file arena.c
+ *  @brief Bump-pointer allocator for memory that dies together
+ *         A request puts its method, uri, headers and response in its
+ *         arena and the whole lot is released by one arena_reset()
+ *         when the response has been sent. Chunks of ARENA_CHUNK_SIZE
+ *         come from a slab pool shared by all arenas and go back to it
+ *         on reset, so an idle connection holds none and a request that
+ *         fits in one chunk does not touch the heap. Allocations too big
+ *         for a chunk get one of their own from malloc.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "slab.h"
+
+
+static SlabPool chunks = SLAB_POOL(ARENA_CHUNK_SIZE);
+static size_t big_bytes = 0;    /* held in chunks from malloc */
+
+
+/** @brief Allocate from an arena
+ *  @param a the arena
+ *  @param n bytes wanted
+ *  @return the memory, aligned to ARENA_ALIGN, NULL if out of memory
+ */
+void *arena_alloc(Arena *a, size_t n) {
+    ArenaChunk *c;
+    size_t room = ARENA_CHUNK_SIZE - sizeof(ArenaChunk);
+    void *ret;
+
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (a->head == NULL || (size_t)(a->end - a->cur) < n) {
+        if (n > room) {
+            if ((c = (ArenaChunk *)malloc(sizeof(ArenaChunk) + n)) == NULL)
+                return NULL;
+            c->size = n;
+            big_bytes += n;
+        } else {
+            if ((c = (ArenaChunk *)slab_get(&chunks)) == NULL)
+                return NULL;
+            c->size = room;
+        }
+        /* a big one-off goes behind head so the rest of head stays usable */
+        if (a->head && n > room) {
+            c->next = a->head->next;
+            a->head->next = c;
+            return c->data;
+        }
+        c->next = a->head;
+        a->head = c;
+        a->cur = c->data;
+        a->end = c->data + c->size;
+    }
+    ret = a->cur;
+    a->cur += n;
+    return ret;
+}
+
+/** @brief Copy a string into an arena
+ *  @param a the arena
+ *  @param s the string
+ *  @return the copy, NULL if out of memory
+ */
+char *arena_strdup(Arena *a, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *ret = (char *)arena_alloc(a, len);
+
+    if (ret)
+        memcpy(ret, s, len);
+    return ret;
+}
+
+/** @brief Release everything allocated, the chunks go back to the pool
+ *  @param a the arena
+ *  @return Void
+ */
+void arena_reset(Arena *a) {
+    ArenaChunk *c, *next;
+
+    for (c = a->head; c; c = next) {
+        next = c->next;
+        if (c->size == ARENA_CHUNK_SIZE - sizeof(ArenaChunk)) {
+            slab_put(&chunks, c);
+        } else {
+            big_bytes -= c->size;
+            free(c);
+        }
+    }
+    a->head = NULL;
+    a->cur = a->end = NULL;
+}
+
+/** @brief Release an arena
+ *         The same as arena_reset(), an arena keeps nothing once reset
+ *  @param a the arena
+ *  @return Void
+ */
+void arena_free(Arena *a) {
+    arena_reset(a);
+}
+
+/** @brief Memory held by all arenas
+ *  @return bytes in chunks that are in use
+ */
+size_t arena_bytes() {
+    return chunks.in_use * ARENA_CHUNK_SIZE + big_bytes;
+}
@@ -0,0 +1,36 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+
+#define ARENA_CHUNK_SIZE   4096  /* from the shared pool, enough for most requests */
+#define ARENA_ALIGN        16
+
+/** @brief A block of arena memory, allocations are carved from data
+ *
+ */
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;          /* bytes in data */
+    char data[];
+} ArenaChunk;
+
+/** @brief Bump-pointer allocator, everything in it is freed at once
+ *
+ */
+typedef struct arena {
+    ArenaChunk *head;     /* chunk allocations come from, newest first */
+    char *cur;            /* next free byte of head */
+    char *end;
+} Arena;
+
+
+/* Arena package */
+void *arena_alloc(Arena *a, size_t n);
+char *arena_strdup(Arena *a, const char *s);
+void arena_reset(Arena *a);
+void arena_free(Arena *a);
+size_t arena_bytes(void);
+
+#endif
@@ -0,0 +1,369 @@
+/** @file cache.c
+ *  @brief Response cache for idempotent cgi requests
+ *         The output of cgi GETs is kept in memory, keyed on the uri and
+ *         the configured vary headers, and served to GET and HEAD while
+ *         fresh. A stale response may be served a while longer as long
+ *         as the caller refreshes it in the background. Memory is bounded
+ *         by conf.cache_size, least recently used entries go first.
+ */
+
+#define _GNU_SOURCE  /* memmem(), strptime(), timegm() */
+
+#include <strings.h>
+
+#include "cache.h"
+#include "conf.h"
+#include "route.h"
+#include "probe.h"
+
+
+/**************** BEGIN CONSTANTS ***************/
+#define REVALIDATE_WAIT  30  /* Seconds before a lost refresh is retried */
+#define VALUE_SIZE       512
+
+/**************** END CONSTANTS ***************/
+
+static CacheEntry *buckets[CACHE_BUCKETS];
+static CacheEntry *lru_head = NULL;  /* most recently used */
+static CacheEntry *lru_tail = NULL;  /* next to be evicted */
+static long cache_bytes = 0;
+
+static unsigned int cache_hash(char *key);
+static CacheEntry *cache_find(char *key, unsigned int hash);
+static void cache_remove(CacheEntry *e);
+static void cache_touch(CacheEntry *e);
+static int cache_freshness(char *data, int hdr_len, char *key, time_t now,
+                           time_t *fresh_until, time_t *stale_until);
+static int find_header(char *data, int hdr_len, char *name, char *value);
+static char *req_header(Headers *hdr, char *key);
+
+
+/** @brief Build the cache key of a request
+ *         The key also identifies requests that may share one cgi run
+ *  @param req the request
+ *  @return malloced key, NULL if the request can not use the cache
+ */
+char *cache_key(Requests *req) {
+    char key[CACHE_KEY_SIZE];
+    char *value;
+    int i, len;
+
+    if (conf.cache_size <= 0)
+        return NULL;
+    if (strcasecmp(req->method, "GET") && strcasecmp(req->method, "HEAD"))
+        return NULL;
+    if (req_header(req->header, "Authorization"))
+        return NULL;
+    /* a cookie may personalize the output, unless the key varies on it */
+    if (req_header(req->header, "Cookie")) {
+        for (i = 0; i < conf.n_cache_vary; i++)
+            if (!strcasecmp(conf.cache_vary[i], "Cookie"))
+                break;
+        if (i == conf.n_cache_vary)
+            return NULL;
+    }
+
+    len = snprintf(key, CACHE_KEY_SIZE, "%s", req->uri);
+    for (i = 0; i < conf.n_cache_vary && len < CACHE_KEY_SIZE; i++) {
+        value = req_header(req->header, conf.cache_vary[i]);
+        len += snprintf(key + len, CACHE_KEY_SIZE - len, "\n%s",
+                        value ? value : "");
+    }
+    if (len >= CACHE_KEY_SIZE)
+        return NULL;
+    return strdup(key);
+}
+
+/** @brief Answer a request from the cache
+ *  @param key the cache key of the request
+ *  @param req the request, its response is set on a hit
+ *  @return CACHE_MISS if nothing usable is cached
+ *  @return CACHE_HIT if the response was set
+ *  @return CACHE_REVALIDATE if a stale response was set
+ *          and the caller should refresh the entry
+ */
+int cache_lookup(char *key, Requests *req) {
+    CacheEntry *e;
+    time_t now = time(NULL);
+    char age[64];
+    char *eol;
+    int len, line_len, age_len, ret = CACHE_HIT;
+
+    if ((e = cache_find(key, cache_hash(key))) == NULL)
+        return CACHE_MISS;
+    if (now > e->stale_until) {
+        cache_remove(e);
+        return CACHE_MISS;
+    }
+    if (now > e->fresh_until &&
+        (!e->revalidating || now - e->revalidating > REVALIDATE_WAIT)) {
+        e->revalidating = now;
+        ret = CACHE_REVALIDATE;
+    }
+
+    /* copy the status line, add Age, then the rest */
+    len = strcasecmp(req->method, "HEAD") ? e->len : e->hdr_len;
+    eol = memmem(e->data, e->hdr_len, "\r\n", 2);
+    line_len = eol - e->data + 2;
+    age_len = sprintf(age, "Age: %ld\r\n", (long)(now - e->stored_at));
+
+    req->response = (char *)arena_alloc(&req->arena, len + age_len + 1);
+    memcpy(req->response, e->data, line_len);
+    memcpy(req->response + line_len, age, age_len);
+    memcpy(req->response + line_len + age_len, e->data + line_len,
+           len - line_len);
+    req->response[len + age_len] = '\0';
+    req->response_len = len + age_len;
+    req->body = NULL;
+
+    cache_touch(e);
+    PROBE(PR_CGI, cache_hit, "%s %s", ret == CACHE_HIT ? "fresh" : "stale",
+          key);
+    return ret;
+}
+
+/** @brief Store a cgi response if it may be cached
+ *  @param key the cache key of the request that produced it
+ *  @param data the full cgi output
+ *  @param len length of data
+ *  @return Void
+ */
+void cache_store(char *key, char *data, int len) {
+    CacheEntry *e;
+    char *hdr_end;
+    unsigned int hash;
+    int status = 0;
+    long size;
+    time_t now = time(NULL), fresh_until, stale_until;
+
+    size = sizeof(CacheEntry) + strlen(key) + 1 + len;
+    if (size > conf.cache_size || len > CACHE_MAX_ENTRY)
+        return;
+    if ((hdr_end = memmem(data, len, "\r\n\r\n", 4)) == NULL)
+        return;
+    if (sscanf(data, "HTTP/%*d.%*d %d", &status) != 1 || status != 200)
+        return;
+    if (!cache_freshness(data, hdr_end - data + 4, key, now,
+                         &fresh_until, &stale_until))
+        return;
+
+    hash = cache_hash(key);
+    if ((e = cache_find(key, hash)) != NULL)
+        cache_remove(e);
+    while (lru_tail && cache_bytes + size > conf.cache_size)
+        cache_remove(lru_tail);
+
+    e = (CacheEntry *)malloc(sizeof(CacheEntry));
+    e->key = strdup(key);
+    e->hash = hash;
+    e->data = (char *)malloc(len);
+    memcpy(e->data, data, len);
+    e->len = len;
+    e->hdr_len = hdr_end - data + 4;
+    e->stored_at = now;
+    e->fresh_until = fresh_until;
+    e->stale_until = stale_until;
+    e->revalidating = 0;
+
+    e->hnext = buckets[hash % CACHE_BUCKETS];
+    buckets[hash % CACHE_BUCKETS] = e;
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head)
+        lru_head->prev = e;
+    lru_head = e;
+    if (lru_tail == NULL)
+        lru_tail = e;
+    cache_bytes += size;
+
+    PROBE(PR_CGI, cache_store, "%s, %d bytes, fresh %lds", key, len,
+          (long)(fresh_until - now));
+}
+
+/** @brief Work out how long a response may be served
+ *         Cache-Control and Expires from the script win,
+ *         otherwise the ttl of the route of the uri applies
+ *  @param data the cgi output
+ *  @param hdr_len length of its header part
+ *  @param key the cache key, it starts with the uri
+ *  @param now current time
+ *  @param fresh_until pointer to store the end of freshness
+ *  @param stale_until pointer to store the end of stale serving
+ *  @return 1 if the response may be cached 0 if not
+ */
+static int cache_freshness(char *data, int hdr_len, char *key, time_t now,
+                           time_t *fresh_until, time_t *stale_until) {
+    char value[VALUE_SIZE];
+    char *tok, *save;
+    int j, max_age = -1, s_maxage = -1, swr = -1;
+    Route *route;
+    struct tm tm;
+
+    if (find_header(data, hdr_len, "Set-Cookie", value))
+        return 0;
+
+    if (find_header(data, hdr_len, "Cache-Control", value)) {
+        for (tok = strtok_r(value, ", ", &save); tok;
+             tok = strtok_r(NULL, ", ", &save)) {
+            if (!strcasecmp(tok, "no-store") ||
+                !strcasecmp(tok, "no-cache") ||
+                !strcasecmp(tok, "private"))
+                return 0;
+            else if (!strncasecmp(tok, "max-age=", 8))
+                max_age = atoi(tok + 8);
+            else if (!strncasecmp(tok, "s-maxage=", 9))
+                s_maxage = atoi(tok + 9);
+            else if (!strncasecmp(tok, "stale-while-revalidate=", 23))
+                swr = atoi(tok + 23);
+        }
+    }
+    if (s_maxage >= 0)
+        max_age = s_maxage;
+
+    /* a script varying on something we do not key on can't be shared */
+    if (find_header(data, hdr_len, "Vary", value)) {
+        for (tok = strtok_r(value, ", ", &save); tok;
+             tok = strtok_r(NULL, ", ", &save)) {
+            for (j = 0; j < conf.n_cache_vary; j++)
+                if (!strcasecmp(tok, conf.cache_vary[j]))
+                    break;
+            if (j == conf.n_cache_vary)
+                return 0;
+        }
+    }
+
+    if (max_age < 0 && find_header(data, hdr_len, "Expires", value)) {
+        memset(&tm, 0, sizeof(tm));
+        if (strptime(value, "%a, %d %b %Y %H:%M:%S", &tm) == NULL)
+            return 0;
+        max_age = timegm(&tm) - now;
+        if (max_age < 0)
+            max_age = 0;
+    }
+
+    route = route_match(key);
+    if (max_age < 0 && route->ttl >= 0)
+        max_age = route->ttl;
+    if (swr < 0)
+        swr = route->ttl >= 0 ? route->stale : 0;
+
+    if (max_age <= 0)
+        return 0;
+    *fresh_until = now + max_age;
+    *stale_until = *fresh_until + swr;
+    return 1;
+}
+
+/** @brief Find a header in raw cgi output
+ *  @param data the cgi output
+ *  @param hdr_len length of its header part
+ *  @param name the header name
+ *  @param value buf of VALUE_SIZE to store the value
+ *  @return 1 if found 0 if not
+ */
+static int find_header(char *data, int hdr_len, char *name, char *value) {
+    char *line = data, *end = data + hdr_len, *eol;
+    int nlen = strlen(name), vlen;
+
+    while ((eol = memmem(line, end - line, "\r\n", 2)) != NULL) {
+        if (eol - line > nlen && line[nlen] == ':' &&
+            !strncasecmp(line, name, nlen)) {
+            line += nlen + 1;
+            while (line < eol && (*line == ' ' || *line == '\t'))
+                line++;
+            vlen = eol - line < VALUE_SIZE ? eol - line : VALUE_SIZE - 1;
+            memcpy(value, line, vlen);
+            value[vlen] = '\0';
+            return 1;
+        }
+        line = eol + 2;
+    }
+    return 0;
+}
+
+/** @brief Get request header value by key, case insensitive
+ *  @param hdr the pointer to the header to look up
+ *  @param key the pointer to the key to look up
+ *  @return the string of value, NULL if missing
+ */
+static char *req_header(Headers *hdr, char *key) {
+    while (hdr) {
+        if (!strcasecmp(hdr->key, key))
+            return hdr->value;
+        hdr = hdr->next;
+    }
+    return NULL;
+}
+
+/** @brief FNV-1a hash of a key
+ *  @param key the key
+ *  @return the hash
+ */
+static unsigned int cache_hash(char *key) {
+    unsigned int hash = 2166136261u;
+
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/** @brief Find an entry
+ *  @param key the key
+ *  @param hash hash of the key
+ *  @return the entry, NULL if missing
+ */
+static CacheEntry *cache_find(char *key, unsigned int hash) {
+    CacheEntry *e;
+
+    for (e = buckets[hash % CACHE_BUCKETS]; e; e = e->hnext)
+        if (e->hash == hash && !strcmp(e->key, key))
+            return e;
+    return NULL;
+}
+
+/** @brief Move an entry to the front of the lru list
+ *  @param e the entry
+ *  @return Void
+ */
+static void cache_touch(CacheEntry *e) {
+    if (e == lru_head)
+        return;
+    e->prev->next = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        lru_tail = e->prev;
+    e->prev = NULL;
+    e->next = lru_head;
+    lru_head->prev = e;
+    lru_head = e;
+}
+
+/** @brief Unlink an entry and free it
+ *  @param e the entry
+ *  @return Void
+ */
+static void cache_remove(CacheEntry *e) {
+    CacheEntry **pp;
+
+    for (pp = &buckets[e->hash % CACHE_BUCKETS]; *pp; pp = &(*pp)->hnext)
+        if (*pp == e) {
+            *pp = e->hnext;
+            break;
+        }
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        lru_head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        lru_tail = e->prev;
+
+    cache_bytes -= sizeof(CacheEntry) + strlen(e->key) + 1 + e->len;
+    free(e->key);
+    free(e->data);
+    free(e);
+}
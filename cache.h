@@ -0,0 +1,45 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mio.h"
+
+
+#define CACHE_BUCKETS        4096       /* Hash buckets of the cache */
+#define CACHE_MAX_ENTRY      (1 << 20)  /* Largest response kept */
+#define CACHE_KEY_SIZE       8192       /* Max length of a cache key */
+
+/* cache_lookup() return values */
+#define CACHE_MISS           0
+#define CACHE_HIT            1  /* served from the cache */
+#define CACHE_REVALIDATE     2  /* served stale, caller should refresh it */
+
+/** @brief A cached cgi response
+ *
+ */
+typedef struct cache_entry {
+    char *key;         /* uri, then the values of the vary headers */
+    unsigned int hash;
+    char *data;        /* full cgi output, status line included */
+    int len;
+    int hdr_len;       /* length of the header part, for HEAD */
+    time_t stored_at;
+    time_t fresh_until;
+    time_t stale_until;  /* may be served stale while revalidating */
+    time_t revalidating; /* when a refresh was started, 0 if none */
+    struct cache_entry *hnext;  /* hash chain */
+    struct cache_entry *prev;   /* lru list, most recent first */
+    struct cache_entry *next;
+} CacheEntry;
+
+
+/* Cache package */
+char *cache_key(Requests *req);
+int cache_lookup(char *key, Requests *req);
+void cache_store(char *key, char *data, int len);
+
+#endif
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+# coding=utf-8
+
+# A HEAD on a stale cache entry must not refresh it with the output of
+# a HEAD. Starts lisod from this folder with a script caching for 1s and
+# served stale for 60s, then checks a GET after the HEAD gets the body.
+#
+#     make && python3 cache_revalidate.py
+
+import os
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+HTTP_PORT, HTTPS_PORT = 18580, 18581
+BODY = b'fresh body from the script'
+
+SCRIPT = '''#!/bin/sh
+printf 'HTTP/1.1 200 OK\\r\\nContent-Type: text/plain\\r\\n'
+if [ "$REQUEST_METHOD" = HEAD ]; then
+    printf 'Content-Length: %d\\r\\n\\r\\n' ''' + str(len(BODY)) + '''
+else
+    printf 'Content-Length: %d\\r\\n\\r\\n%s' ''' + str(len(BODY)) + \
+    ''' "''' + BODY.decode() + '''"
+fi
+'''
+
+
+def request(method):
+    s = socket.create_connection(('127.0.0.1', HTTP_PORT))
+    s.sendall(('%s /cgi/page HTTP/1.1\r\nHost: x\r\n'
+               'Connection: close\r\n\r\n' % method).encode())
+    data = b''
+    while True:
+        chunk = s.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+    s.close()
+    return data.split(b'\r\n\r\n', 1)[1]
+
+
+def main():
+    tmp = tempfile.mkdtemp()
+    script = os.path.join(tmp, 'page.sh')
+    conf = os.path.join(tmp, 'lisod.conf')
+    lock = os.path.join(tmp, 'lock')
+    with open(script, 'w') as f:
+        f.write(SCRIPT)
+    os.chmod(script, 0o755)
+    with open(conf, 'w') as f:
+        f.write('cache_ttl /cgi/ 1 60\n')
+
+    key = os.path.join(tmp, 'key.pem')
+    cert = os.path.join(tmp, 'cert.pem')
+    subprocess.check_call(['openssl', 'req', '-x509', '-newkey', 'rsa:2048',
+                           '-nodes', '-subj', '/CN=localhost', '-days', '1',
+                           '-keyout', key, '-out', cert],
+                          stderr=subprocess.DEVNULL)
+
+    here = os.path.dirname(os.path.abspath(__file__))
+    subprocess.check_call([os.path.join(here, 'lisod'), str(HTTP_PORT),
+                           str(HTTPS_PORT), os.path.join(tmp, 'log'), lock,
+                           os.path.join(here, 'static'), script,
+                           key, cert, conf])
+    time.sleep(0.3)
+    try:
+        assert request('GET') == BODY        # stored
+        time.sleep(2)                        # stale, still servable
+        assert request('HEAD') == b''        # stale hit, no refresh
+        time.sleep(0.5)
+        assert request('GET') == BODY        # stale hit, GET refresh
+        time.sleep(0.5)
+        assert request('GET') == BODY        # the refreshed entry
+    finally:
+        with open(lock) as f:
+            os.kill(int(f.read()), signal.SIGTERM)
+    print('ok')
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -6,13 +6,24 @@
 
 
 
+#define _GNU_SOURCE  /* pipe2() */
+
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
 #include "cgi.h"
+#include "cache.h"
+#include "metrics.h"
+#include "reqtrace.h"
+#include "probe.h"
+#include "conntab.h"
+#include "route.h"
 
 
 /**************** BEGIN CONSTANTS ***************/
 #define BUF_SIZE    4096
 #define ENVP_SIZE   30
-#define VERBOSE     0
 
 /**************** END CONSTANTS ***************/
 
@@ -101,43 +112,241 @@ processes.\n");
 }
 /**************** END UTILITY FUNCTIONS ***************/
 
+static CgiJob *jobs = NULL;  /* queued and running jobs, oldest first */
+static int sig_fd = -1;      /* signalfd that delivers SIGCHLD */
+static int running = 0;      /* # of children forked and not yet reaped */
+static int queued = 0;       /* # of jobs waiting for a free child */
+static double avg_runtime = 1; /* moving average of child runtime, seconds */
+
+static CgiJob *cgi_new_job(Buff *b, char *filename, char *cgiquery);
+static int cgi_spawn(Pool *p, CgiJob *job);
+static void cgi_dispatch(Pool *p);
+static void cgi_deliver(Pool *p, CgiJob *job);
+static void cgi_error(Pool *p, CgiJob *job, char *errnum,
+                      char *shortmsg, char *longmsg);
+static void cgi_attach(Pool *p, CgiJob *job, Buff *b, Requests *req);
+static CgiJob *cgi_in_flight(char *key);
+static void cgi_feed(Pool *p, CgiJob *job);
+static void cgi_close_pipe(Pool *p, CgiJob *job);
+static int env_put(Arena *a, char **envp, int i, const char *key,
+                   const char *value, int len);
+static void cgi_close_stdin(Pool *p, CgiJob *job);
+static void cgi_free(CgiJob *job);
+static void cgi_count(char *addr, int *nrunning, int *nqueued);
+
+
+/** @brief Set up child reaping for the cgi package
+ *         SIGCHLD is blocked and delivered through a signalfd
+ *         that is selected on together with the client sockets
+ *  @param p Pool struct of the server
+ *  @return EXIT_FAILURE on fail
+ *  @return EXIT_SUCCESS on success
+ */
+int cgi_init(Pool *p) {
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    if ((sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "Error creating signalfd for SIGCHLD.\n");
+        return EXIT_FAILURE;
+    }
+    FD_SET(sig_fd, &p->read_set);
+    if (sig_fd > p->maxfd)
+        p->maxfd = sig_fd;
+    return EXIT_SUCCESS;
+}
+
 /** @brief Serve a dynamic request
+ *         GET and HEAD are answered from the cache when possible, or
+ *         attach to a job already running for an identical GET.
+ *         Otherwise the request is turned into a job which runs at once
+ *         if a child slot is free for its client, or waits in the queue
  *  @param p Pool struct of the server
  *  @param b Buff struct representing a connection
  *  @param filename name of file to get dynamic content from
  *  @param cgiquery string of query
- *  @return EXIT_FAILURE on fail
+ *  @return CGI_BUSY if the queue is full
  *  @retuen EXIT_SUCCESS on success
  */
 int serve_dynamic(Pool *p, Buff *b, char *filename, char *cgiquery) {
-    /*************** BEGIN VARIABLE DECLARATIONS **************/
     Requests *req = b->cur_request;
+    CgiJob *job;
+    char *key;
+    int hit;
+
+    if ((key = cache_key(req)) != NULL) {
+        if ((hit = cache_lookup(key, req)) != CACHE_MISS) {
+            if (hit == CACHE_HIT)
+                METRIC_INC(cache_hits);
+            else
+                METRIC_INC(cache_stale);
+            req->valid = REQ_VALID;
+            FD_SET(b->fd, &p->write_set);
+            /* refresh a stale entry with a job nobody waits on; the
+               key has no method, and only a GET gets a body to store */
+            if (hit == CACHE_REVALIDATE && !strcasecmp(req->method, "GET") &&
+                (job = cgi_new_job(b, filename, cgiquery)) != NULL) {
+                job->cache_key = key;
+                cgi_dispatch(p);
+            } else
+                free(key);
+            return EXIT_SUCCESS;
+        }
+        METRIC_INC(cache_misses);
+        /* collapse onto the job of an identical request */
+        if ((job = cgi_in_flight(key)) != NULL) {
+            PROBE(PR_CGI, collapse, "%s", key);
+            free(key);
+            cgi_attach(p, job, b, req);
+            return EXIT_SUCCESS;
+        }
+        /* only the output of a GET is a complete response to store */
+        if (strcasecmp(req->method, "GET")) {
+            free(key);
+            key = NULL;
+        }
+    }
+
+    if ((job = cgi_new_job(b, filename, cgiquery)) == NULL) {
+        free(key);
+        PROBE(PR_CGI, reject, "queue full, %s", b->cold->addr);
+        return CGI_BUSY;
+    }
+    job->cache_key = key;
+    if (!strcmp(req->method, "POST") && req->post_body != NULL) {
+        job->in = (char *)malloc(req->post_body_length);
+        memcpy(job->in, req->post_body, req->post_body_length);
+        job->in_len = req->post_body_length;
+    }
+    cgi_attach(p, job, b, req);
+
+    cgi_dispatch(p);
+    return EXIT_SUCCESS;
+}
+
+/** @brief Make a request wait for the output of a job
+ *  @param p Pool struct of the server
+ *  @param job the job
+ *  @param b Buff struct representing the connection of the request
+ *  @param req the request
+ *  @return Void
+ */
+static void cgi_attach(Pool *p, CgiJob *job, Buff *b, Requests *req) {
+    CgiWaiter *w = (CgiWaiter *)malloc(sizeof(CgiWaiter));
+
+    w->conn = conntab_id(&p->conns, b);
+    w->req = req;
+    w->next = job->waiters;
+    job->waiters = w;
+    req->job = job;
+    req->valid = REQ_PIPE;
+}
+
+/** @brief Find the job already producing the output for a key
+ *  @param key the cache key
+ *  @return the job, NULL if none
+ */
+static CgiJob *cgi_in_flight(char *key) {
+    CgiJob *job;
+
+    for (job = jobs; job; job = job->next)
+        if (job->cache_key && !job->timed_out &&
+            (job->pipefd >= 0 || job->state == JOB_QUEUED) &&
+            !strcmp(job->cache_key, key))
+            return job;
+    return NULL;
+}
+
+/** @brief Queue a new job for the current request of a connection
+ *         The job is not attached to the request yet
+ *  @param b Buff struct representing a connection
+ *  @param filename name of file to get dynamic content from
+ *  @param cgiquery string of query
+ *  @return the job, NULL if the queue is full
+ */
+static CgiJob *cgi_new_job(Buff *b, char *filename, char *cgiquery) {
+    CgiJob *job, **tail;
+    int nrunning, nqueued;
+
+    cgi_count(b->cold->addr, &nrunning, &nqueued);
+    if ((running >= CGI_MAX_CHILDREN || nrunning >= CGI_MAX_PER_CLIENT) &&
+        (queued >= CGI_QUEUE_SIZE || nqueued >= CGI_QUEUE_PER_CLIENT))
+        return NULL;
+
+    job = (CgiJob *)malloc(sizeof(CgiJob));
+    strcpy(job->addr, b->cold->addr);
+    job->waiters = NULL;
+    memset(&job->arena, 0, sizeof(job->arena));
+    job->filename = arena_strdup(&job->arena, filename);
+    job->envp = (char **)arena_alloc(&job->arena, ENVP_SIZE * sizeof(char *));
+    build_envp(&job->arena, job->envp, b, cgiquery);
+    job->state = JOB_QUEUED;
+    job->pid = -1;
+    job->pipefd = -1;
+    job->stdin_fd = -1;
+    job->in = NULL;
+    job->in_len = 0;
+    job->in_off = 0;
+    job->out = NULL;
+    job->out_len = 0;
+    job->out_size = 0;
+    job->timed_out = 0;
+    job->cache_key = NULL;
+    job->queued_at = time(NULL);
+    job->started_at = 0;
+    job->next = NULL;
+
+    for (tail = &jobs; *tail; tail = &(*tail)->next)
+        ;
+    *tail = job;
+    queued++;
+    return job;
+}
+
+/** @brief Fork and exec the script of a queued job
+ *  @param p Pool struct of the server
+ *  @param job the job to run
+ *  @return EXIT_FAILURE on fail, the job has been answered and freed
+ *  @retuen EXIT_SUCCESS on success
+ */
+static int cgi_spawn(Pool *p, CgiJob *job) {
+    /*************** BEGIN VARIABLE DECLARATIONS **************/
     pid_t pid;
-    int readret;
     int stdin_pipe[2];
     int stdout_pipe[2];
-    char *envp[ENVP_SIZE];
+    sigset_t mask;
     char* argv[] = {
-        filename,
+        job->filename,
         NULL
     };
 
     /*************** END VARIABLE DECLARATIONS **************/
 
-
-    build_envp(envp, b, cgiquery);
+    job->state = JOB_RUNNING;
+    queued--;
 
     /*************** BEGIN PIPE **************/
     /* 0 can be read from, 1 can be written to */
-    if (pipe(stdin_pipe) < 0)
+    if (pipe2(stdin_pipe, O_CLOEXEC) < 0)
     {
         fprintf(stderr, "Error piping for stdin.\n");
+        cgi_error(p, job, "500", "Internal Server Error",
+                  "Liso failed to start the CGI script");
+        cgi_free(job);
         return EXIT_FAILURE;
     }
 
-    if (pipe(stdout_pipe) < 0)
+    if (pipe2(stdout_pipe, O_CLOEXEC) < 0)
     {
         fprintf(stderr, "Error piping for stdout.\n");
+        close(stdin_pipe[0]);
+        close(stdin_pipe[1]);
+        cgi_error(p, job, "500", "Internal Server Error",
+                  "Liso failed to start the CGI script");
+        cgi_free(job);
         return EXIT_FAILURE;
     }
     /*************** END PIPE **************/
@@ -148,6 +357,13 @@ int serve_dynamic(Pool *p, Buff *b, char *filename, char *cgiquery) {
     if (pid < 0)
     {
         fprintf(stderr, "Something really bad happened when fork()ing.\n");
+        close(stdin_pipe[0]);
+        close(stdin_pipe[1]);
+        close(stdout_pipe[0]);
+        close(stdout_pipe[1]);
+        cgi_error(p, job, "500", "Internal Server Error",
+                  "Liso failed to start the CGI script");
+        cgi_free(job);
         return EXIT_FAILURE;
     }
 
@@ -155,163 +371,526 @@ int serve_dynamic(Pool *p, Buff *b, char *filename, char *cgiquery) {
     if (pid == 0)
     {
         /*************** BEGIN EXECVE ****************/
-        close(stdout_pipe[0]);
-        close(stdin_pipe[1]);
+        /* the server blocks SIGCHLD, SIGPIPE and SIGTERM, the script
+           should not */
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        /* own process group, so a kill also reaches what the script forks */
+        setpgid(0, 0);
         dup2(stdout_pipe[1], fileno(stdout));
         dup2(stdin_pipe[0], fileno(stdin));
         dup2(stdout_pipe[1], fileno(stderr));
-        /* you should probably do something with stderr */
 
         /* pretty much no matter what, if it returns bad things happened... */
-        if (execve(filename, argv, envp))
+        if (execve(job->filename, argv, job->envp))
         {
             execve_error_handler();
             fprintf(stderr, "Error executing execve syscall.\n");
-            return EXIT_FAILURE;
         }
+        _exit(EXIT_FAILURE);
         /*************** END EXECVE ****************/
-        //free_envp(envp);
     }
 
-    if (pid > 0)
-    {
-        free_envp(envp);
-        if (VERBOSE)
-            fprintf(stdout, "Parent: Heading to select() loop.\n");
-        close(stdout_pipe[1]);
-        close(stdin_pipe[0]);
-        if (!strcmp(req->method, "POST")) {
-            if ((readret = write(stdin_pipe[1],
-                                 req->post_body,
-                                 strlen(req->post_body))) < 0)
-            {
-                fprintf(stderr, "Error writing to spawned CGI program.\n");
-                return EXIT_FAILURE;
+    /* parent */
+    METRIC_INC(cgi_spawns);
+    PROBE(PR_CGI, spawn, "pid %d", (int)pid);
+    setpgid(pid, pid); /* also here, in case we kill before the child ran */
+    close(stdout_pipe[1]);
+    close(stdin_pipe[0]);
+    running++;
+    job->pid = pid;
+    job->started_at = time(NULL);
+
+    /* the output is collected by cgi_poll() as select() reports it */
+    fcntl(stdout_pipe[0], F_SETFL, O_NONBLOCK);
+    job->pipefd = stdout_pipe[0];
+    FD_SET(job->pipefd, &p->read_set);
+    if (job->pipefd > p->maxfd)
+        p->maxfd = job->pipefd;
+    p->cur_conn += 1;
+
+    /* the post body is fed as the pipe drains, a slow script
+       must not block the server */
+    fcntl(stdin_pipe[1], F_SETFL, O_NONBLOCK);
+    job->stdin_fd = stdin_pipe[1];
+    if (job->stdin_fd > p->maxfd)
+        p->maxfd = job->stdin_fd;
+    cgi_feed(p, job);
+
+    return EXIT_SUCCESS;
+    /*************** END FORK **************/
+}
+
+/** @brief Start queued jobs while child slots are free
+ *         Each free slot goes to the oldest job of the client
+ *         that currently has the fewest children running
+ *  @param p Pool struct of the server
+ *  @return Void
+ */
+static void cgi_dispatch(Pool *p) {
+    CgiJob *job, *best;
+    int nrunning, nqueued, best_running = 0;
+
+    while (running < CGI_MAX_CHILDREN && queued > 0) {
+        best = NULL;
+        for (job = jobs; job; job = job->next) {
+            if (job->state != JOB_QUEUED)
+                continue;
+            cgi_count(job->addr, &nrunning, &nqueued);
+            if (nrunning >= CGI_MAX_PER_CLIENT)
+                continue;
+            if (best == NULL || nrunning < best_running) {
+                best = job;
+                best_running = nrunning;
             }
-            if (VERBOSE)
-                printf("Write post %d bytes body:%s\n",
-                        readret, req->post_body);
         }
+        if (best == NULL)
+            break;
+        cgi_spawn(p, best);
+    }
+}
 
-        close(stdin_pipe[1]); /* finished writing to spawn */
+/** @brief Reap exited children and hand their slots to queued jobs
+ *  @param p Pool struct of the server
+ *  @return Void
+ */
+void cgi_reap(Pool *p) {
+    struct signalfd_siginfo si;
+    CgiJob *job;
+    pid_t pid;
+    int status;
 
-        /* you want to be looping with select() telling you when to read */
-        // while((readret = read(stdout_pipe[0], buf, BUF_SIZE-1)) > 0)
-        // {
-        //     buf[readret] = '\0'; /* nul-terminate string */
-        //     fprintf(stdout, "Got from CGI: %s\n", buf);
-        // }
-        req->valid = REQ_PIPE;
-        req->pipefd = stdout_pipe[0];
+    if (sig_fd < 0 || !FD_ISSET(sig_fd, &p->ready_read))
+        return;
+    p->nready--;
 
-        FD_SET(req->pipefd, &p->read_set);
-        if (req->pipefd > p->maxfd)
-            p->maxfd = req->pipefd;
-        p->cur_conn += 1;
+    /* signals coalesce, so drain the fd and then wait for every child */
+    while (read(sig_fd, &si, sizeof(si)) == sizeof(si))
+        ;
 
-        return EXIT_SUCCESS;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (job = jobs; job; job = job->next)
+            if (job->pid == pid)
+                break;
+        if (job == NULL)
+            continue;
+        running--;
+        PROBE(PR_CGI, reap, "pid %d, status %d", (int)pid, status);
+        avg_runtime = (avg_runtime * 7 + (time(NULL) - job->started_at)) / 8;
+        job->pid = 0;
+        cgi_close_stdin(p, job);
+        if (job->pipefd < 0)
+            cgi_free(job);
     }
-    /*************** END FORK **************/
 
-    fprintf(stderr, "Process exiting, badly...how did we get here!?\n");
-    return EXIT_FAILURE;
+    cgi_dispatch(p);
 }
 
+/** @brief Write as much of the post body as the stdin pipe takes
+ *         and close stdin once it is all written
+ *  @param p Pool struct of the server
+ *  @param job the running job
+ *  @return Void
+ */
+static void cgi_feed(Pool *p, CgiJob *job) {
+    ssize_t writeret;
 
+    while (job->in_off < job->in_len) {
+        writeret = write(job->stdin_fd, job->in + job->in_off,
+                         job->in_len - job->in_off);
+        if (writeret > 0) {
+            job->in_off += writeret;
+        } else if (writeret < 0 && errno == EINTR) {
+            continue;
+        } else if (writeret < 0 && errno == EAGAIN) {
+            /* pipe full, wait for select() to report it writable */
+            FD_SET(job->stdin_fd, &p->write_set);
+            return;
+        } else {
+            /* EPIPE, the script stopped reading */
+            PROBE(PR_CGI, stdin_closed, "pid %d, errno %d", (int)job->pid,
+                  errno);
+            break;
+        }
+    }
+    cgi_close_stdin(p, job);
+}
 
-/** @brief Build envp from connection info
- *  @param envp pointer to put the envp
- *  @param b Buff struct that represents a connection
- *  @param cgiquery string of cgi query
+/** @brief Feed post bodies to and read available output of running jobs
+ *         and answer the waiting requests once a job hits EOF
+ *  @param p Pool struct of the server
  *  @return Void
  */
-void build_envp(char **envp, Buff *b, char *cgiquery) {
-    Requests *req = b->cur_request;
-    Headers *hdr = NULL;
-    int i = 0;
-    char temp[BUF_SIZE];
-    envp[i++] = malloc_string("GATEWAY_INTERFACE=CGI/1.1");
-
-    sprintf(temp, "PATH_INFO=%s", req->uri + 4); /* skip "/cgi" */
-    envp[i++] = malloc_string(temp);
-    sprintf(temp, "REQUEST_URI=%s", req->uri);
-    envp[i++] = malloc_string(temp);
-    if (*cgiquery != '\0') {
-        sprintf(temp, "QUERY_STRING=%s", cgiquery);
-        envp[i++] = malloc_string(temp);
+void cgi_poll(Pool *p) {
+    CgiJob *job, *next;
+    ssize_t readret;
+
+    for (job = jobs; job; job = next) {
+        next = job->next;
+        if (job->stdin_fd >= 0 && FD_ISSET(job->stdin_fd, &p->ready_write)) {
+            p->nready--;
+            cgi_feed(p, job);
+        }
+        if (job->pipefd < 0 || !FD_ISSET(job->pipefd, &p->ready_read))
+            continue;
+        p->nready--;
+
+        while (1) {
+            if (job->out_size - job->out_len < BUF_SIZE) {
+                job->out_size = job->out_size ? job->out_size * 2 : BUF_SIZE;
+                job->out = (char *)realloc(job->out, job->out_size);
+            }
+            readret = read(job->pipefd, job->out + job->out_len,
+                           job->out_size - job->out_len);
+            if (readret > 0)
+                job->out_len += readret;
+            else if (readret < 0 && errno == EINTR)
+                continue;
+            else
+                break;
+        }
+        if (readret < 0 && errno == EAGAIN)
+            continue;
+
+        /* EOF, the child is done writing */
+        cgi_close_pipe(p, job);
+        cgi_close_stdin(p, job);
+        if (job->cache_key)
+            cache_store(job->cache_key, job->out, job->out_len);
+        cgi_deliver(p, job);
+        if (job->pid == 0)
+            cgi_free(job);
     }
-    envp[i++] = malloc_string("SCRIPT_NAME=/cgi");  /* hard coded */
-    sprintf(temp, "REMOTE_ADDR=%s", b->addr);
-    envp[i++] = malloc_string(temp);
-    sprintf(temp, "REQUEST_METHOD=%s", req->method);
-    envp[i++] = malloc_string(temp);
-    sprintf(temp, "SERVER_PORT=%d", b->port);
-    envp[i++] = malloc_string(temp);
-    envp[i++] = malloc_string("SERVER_PROTOCOL=HTTP/1.1");
-    envp[i++] = malloc_string("SERVER_SOFTWARE=Liso/1.0");
-    envp[i++] = malloc_string("SERVER_NAME=Liso/1.0");
-    if (b->client_context != NULL)
-        envp[i++] = malloc_string("HTTPS=1");
-    hdr = req->header;
-    while (hdr) {
-        if (!strcasecmp(hdr->key, "Content-Length")) {
-            sprintf(temp, "CONTENT_LENGTH=%s", hdr->value);
-            envp[i++] = malloc_string(temp);
-        } else if (!strcasecmp(hdr->key, "Content-Type")) {
-            sprintf(temp, "CONTENT_TYPE=%s", hdr->value);
-            envp[i++] = malloc_string(temp);
-        } else if (!strcasecmp(hdr->key, "Accept")) {
-            sprintf(temp, "HTTP_ACCEPT=%s", hdr->value);
-            envp[i++] = malloc_string(temp);
-        } else if (!strcasecmp(hdr->key, "Referer")) {
-            sprintf(temp, "HTTP_REFERER=%s", hdr->value);
-            envp[i++] = malloc_string(temp);
-        } else if (!strcasecmp(hdr->key, "Accept-Encoding")) {
-            sprintf(temp, "HTTP_ACCEPT_ENCODING=%s", hdr->value);
-            envp[i++] = malloc_string(temp);
-        } else if (!strcasecmp(hdr->key, "Accept-Language")) {
-            sprintf(temp, "HTTP_ACCEPT_LANGUAGE=%s", hdr->value);
-            envp[i++] = malloc_string(temp);
-        } else if (!strcasecmp(hdr->key, "Accept-Charset")) {
-            sprintf(temp, "HTTP_ACCEPT_CHARSET=%s", hdr->value);
-            envp[i++] = malloc_string(temp);
-        } else if (!strcasecmp(hdr->key, "Host")) {
-            sprintf(temp, "HTTP_HOST=%s", hdr->value);
-            envp[i++] = malloc_string(temp);
-        } else if (!strcasecmp(hdr->key, "Cookie")) {
-            sprintf(temp, "HTTP_COOKIE=%s", hdr->value);
-            envp[i++] = malloc_string(temp);
-        } else if (!strcasecmp(hdr->key, "User-Agent")) {
-            sprintf(temp, "HTTP_USER_AGENT=%s", hdr->value);
-            envp[i++] = malloc_string(temp);
-        } else if (!strcasecmp(hdr->key, "Connection")) {
-            sprintf(temp, "HTTP_CONNECTION=%s", hdr->value);
-            envp[i++] = malloc_string(temp);
+}
+
+/** @brief Enforce the queue and runtime limits
+ *  @param p Pool struct of the server
+ *  @return Void
+ */
+void cgi_expire(Pool *p) {
+    CgiJob *job, *next;
+    time_t now = time(NULL);
+
+    for (job = jobs; job; job = next) {
+        next = job->next;
+        if (job->state == JOB_QUEUED &&
+            now - job->queued_at > CGI_QUEUE_TIMEOUT) {
+            cgi_error(p, job, "503", "Service Unavailable",
+                      "Liso is too busy to run the CGI script");
+            cgi_free(job);
+        } else if (job->state == JOB_RUNNING && job->pid > 0 &&
+                   !job->timed_out &&
+                   now - job->started_at > CGI_TIMEOUT) {
+            PROBE(PR_CGI, kill, "pid %d", (int)job->pid);
+            kill(-job->pid, SIGKILL);
+            job->timed_out = 1;
+            cgi_close_pipe(p, job);
+            cgi_close_stdin(p, job);
+            cgi_error(p, job, "504", "Gateway Timeout",
+                      "The CGI script did not finish in time");
         }
-        hdr = hdr->next;
     }
-    envp[i] = NULL;
 }
 
-/** @brief Make a string of env
- *  @param pointer of string to made from
- *  @return point of string just malloced
+/** @brief Detach a request from its job when the connection goes away
+ *  @param p Pool struct of the server
+ *  @param req the request being freed
+ *  @return Void
+ */
+void cgi_cancel(Pool *p, Requests *req) {
+    CgiJob *job = req->job;
+    CgiWaiter **pp, *w;
+
+    if (job == NULL)
+        return;
+    req->job = NULL;
+    for (pp = &job->waiters; *pp; pp = &(*pp)->next)
+        if ((*pp)->req == req) {
+            w = *pp;
+            *pp = w->next;
+            free(w);
+            break;
+        }
+    if (job->waiters != NULL)
+        return;
+
+    if (job->state == JOB_QUEUED) {
+        cgi_free(job);
+        return;
+    }
+    /* a cacheable output is still worth having */
+    if (job->cache_key && job->pipefd >= 0)
+        return;
+    /* nobody will read the output, stop the child */
+    if (job->pid > 0)
+        kill(-job->pid, SIGTERM);
+    cgi_close_pipe(p, job);
+    cgi_close_stdin(p, job);
+    if (job->pid == 0)
+        cgi_free(job);
+}
+
+/** @brief Whether any job is queued or running
+ *         the caller should then wake up periodically for cgi_expire()
+ *  @return 1 on yes 0 on no
+ */
+int cgi_active() {
+    return jobs != NULL;
+}
+
+/** @brief Number of children running
+ *  @return the number
+ */
+int cgi_running() {
+    return running;
+}
+
+/** @brief Number of jobs waiting for a free child
+ *  @return the number
+ */
+int cgi_queued() {
+    return queued;
+}
+
+/** @brief Estimate how long a rejected client should wait
+ *  @return seconds for the Retry-After header
+ */
+int cgi_retry_after() {
+    return 1 + (int)(queued * avg_runtime / CGI_MAX_CHILDREN);
+}
+
+/** @brief Hand the output of a finished job to every waiting request
+ *  @param p Pool struct of the server
+ *  @param job the finished job
+ *  @return Void
+ */
+static void cgi_deliver(Pool *p, CgiJob *job) {
+    CgiWaiter *w;
+    Buff *b;
+    Requests *req;
+    char *hdr_end;
+    int len;
+
+    if (job->waiters == NULL)
+        return;
+    if (job->out_len == 0) {
+        cgi_error(p, job, "502", "Bad Gateway",
+                  "The CGI script produced no output");
+        return;
+    }
+    hdr_end = memmem(job->out, job->out_len, "\r\n\r\n", 4);
+
+    while ((w = job->waiters) != NULL) {
+        job->waiters = w->next;
+        req = w->req;
+        /* a HEAD sharing a GET only gets the headers */
+        len = job->out_len;
+        if (hdr_end && !strcasecmp(req->method, "HEAD"))
+            len = hdr_end - job->out + 4;
+        req->response = (char *)arena_alloc(&req->arena, len);
+        memcpy(req->response, job->out, len);
+        req->response_len = len;
+        req->body = NULL;
+        req->valid = REQ_VALID;
+        TRACE_PHASE(req, PH_READY);
+        req->job = NULL;
+        if ((b = conntab_get(&p->conns, w->conn)) != NULL)
+            FD_SET(b->fd, &p->write_set);
+        free(w);
+    }
+}
+
+/** @brief Answer the requests of a job with an error
+ *  @param p Pool struct of the server
+ *  @param job the failed job
+ *  @param errnum error status number
+ *  @param shortmsg the string of shortmsg to be sent
+ *  @param longmsg the string of longmsg to be sent
+ *  @return Void
+ */
+static void cgi_error(Pool *p, CgiJob *job, char *errnum,
+                      char *shortmsg, char *longmsg) {
+    CgiWaiter *w;
+    Buff *b;
+
+    while ((w = job->waiters) != NULL) {
+        job->waiters = w->next;
+        w->req->job = NULL;
+        if ((b = conntab_get(&p->conns, w->conn)) != NULL) {
+            clienterror(w->req, b->cold->addr, "", errnum, shortmsg, longmsg);
+            FD_SET(b->fd, &p->write_set);
+        }
+        free(w);
+    }
+}
+
+/** @brief Stop selecting on the output pipe of a job and close it
+ *  @param p Pool struct of the server
+ *  @param job the job
+ *  @return Void
+ */
+static void cgi_close_pipe(Pool *p, CgiJob *job) {
+    if (job->pipefd < 0)
+        return;
+    FD_CLR(job->pipefd, &p->read_set);
+    close(job->pipefd);
+    job->pipefd = -1;
+    p->cur_conn -= 1;
+}
+
+/** @brief Stop feeding a job and close its stdin
+ *         the script then sees EOF on its input
+ *  @param p Pool struct of the server
+ *  @param job the job
+ *  @return Void
+ */
+static void cgi_close_stdin(Pool *p, CgiJob *job) {
+    if (job->stdin_fd < 0)
+        return;
+    FD_CLR(job->stdin_fd, &p->write_set);
+    close(job->stdin_fd);
+    job->stdin_fd = -1;
+}
+
+/** @brief Unlink a job from the job list and free it
+ *  @param job the job
+ *  @return Void
+ */
+static void cgi_free(CgiJob *job) {
+    CgiJob **pp;
+    CgiWaiter *w;
+
+    for (pp = &jobs; *pp; pp = &(*pp)->next)
+        if (*pp == job) {
+            *pp = job->next;
+            break;
+        }
+    if (job->state == JOB_QUEUED)
+        queued--;
+    while ((w = job->waiters) != NULL) {
+        job->waiters = w->next;
+        w->req->job = NULL;
+        free(w);
+    }
+    arena_free(&job->arena);
+    free(job->cache_key);
+    free(job->in);
+    free(job->out);
+    free(job);
+}
+
+/** @brief Count the running and queued jobs of a client
+ *  @param addr the client ip address
+ *  @param nrunning pointer to store the # of running children
+ *  @param nqueued pointer to store the # of waiting jobs
+ *  @return Void
  */
-char *malloc_string(char *str) {
-    int length = strlen(str);
-    char *res = (char *)malloc(length + 1);
-    strcpy(res, str);
-    res[length] = '\0';
-    return res;
+static void cgi_count(char *addr, int *nrunning, int *nqueued) {
+    CgiJob *job;
+
+    *nrunning = 0;
+    *nqueued = 0;
+    for (job = jobs; job; job = job->next) {
+        if (strcmp(job->addr, addr))
+            continue;
+        if (job->state == JOB_QUEUED)
+            (*nqueued)++;
+        else if (job->pid > 0)
+            (*nrunning)++;
+    }
 }
 
 
-/** @brief free the envp
- *  @param pointer to the envp to be freeed
+
+/* request headers passed to a script, and the variables they go in */
+static const char *env_headers[][2] = {
+    {"Content-Length", "CONTENT_LENGTH"},
+    {"Content-Type", "CONTENT_TYPE"},
+    {"Accept", "HTTP_ACCEPT"},
+    {"Referer", "HTTP_REFERER"},
+    {"Accept-Encoding", "HTTP_ACCEPT_ENCODING"},
+    {"Accept-Language", "HTTP_ACCEPT_LANGUAGE"},
+    {"Accept-Charset", "HTTP_ACCEPT_CHARSET"},
+    {"Host", "HTTP_HOST"},
+    {"Cookie", "HTTP_COOKIE"},
+    {"User-Agent", "HTTP_USER_AGENT"},
+    {"Connection", "HTTP_CONNECTION"},
+};
+
+/** @brief Build envp from connection info
+ *         Headers may be as long as header_limit, so every string is
+ *         sized to its value in the arena
+ *  @param a the arena the strings are put in
+ *  @param envp pointer to put the envp, ENVP_SIZE slots
+ *  @param b Buff struct that represents a connection
+ *  @param cgiquery string of cgi query
  *  @return Void
  */
-void free_envp(char **str) {
-    int i = 0;
-    while (str[i] != NULL)
-        free(str[i++]);
+void build_envp(Arena *a, char **envp, Buff *b, char *cgiquery) {
+    Requests *req = b->cur_request;
+    Route *r = req->route;
+    Headers *hdr = NULL;
+    int i = 0, j, script, path;
+    char port[16];
+    envp[i++] = arena_strdup(a, "GATEWAY_INTERFACE=CGI/1.1");
+
+    /* the mount of the route names the script, the rest of the path
+       is for it; a script for an extension is named by the whole path */
+    path = strcspn(req->uri, "?");
+    if (r == NULL)
+        script = 4;  /* "/cgi" */
+    else if (r->ext)
+        script = path;
+    else
+        script = r->script_len;
+    i = env_put(a, envp, i, "PATH_INFO", req->uri + script, path - script);
+    i = env_put(a, envp, i, "REQUEST_URI", req->uri, -1);
+    if (*cgiquery != '\0')
+        i = env_put(a, envp, i, "QUERY_STRING", cgiquery, -1);
+    i = env_put(a, envp, i, "SCRIPT_NAME", req->uri, script);
+    i = env_put(a, envp, i, "REMOTE_ADDR", b->cold->addr, -1);
+    i = env_put(a, envp, i, "REQUEST_METHOD", req->method, -1);
+    snprintf(port, sizeof(port), "%d", b->cold->port);
+    i = env_put(a, envp, i, "SERVER_PORT", port, -1);
+    envp[i++] = arena_strdup(a, "SERVER_PROTOCOL=HTTP/1.1");
+    envp[i++] = arena_strdup(a, "SERVER_SOFTWARE=Liso/1.0");
+    envp[i++] = arena_strdup(a, "SERVER_NAME=Liso/1.0");
+    if (b->cold->client_context != NULL)
+        envp[i++] = arena_strdup(a, "HTTPS=1");
+    for (hdr = req->header; hdr; hdr = hdr->next)
+        for (j = 0; j < (int)(sizeof(env_headers) / sizeof(env_headers[0]));
+             j++)
+            if (!strcasecmp(hdr->key, env_headers[j][0])) {
+                i = env_put(a, envp, i, env_headers[j][1], hdr->value, -1);
+                break;
+            }
+    envp[i] = NULL;
+}
+
+/** @brief Add a variable to envp, if a slot is left for it
+ *  @param a the arena the string is put in
+ *  @param envp the envp, ENVP_SIZE slots
+ *  @param i the next free slot
+ *  @param key the name of the variable
+ *  @param value the value
+ *  @param len bytes of the value, -1 for all of it
+ *  @return the next free slot
+ */
+static int env_put(Arena *a, char **envp, int i, const char *key,
+                   const char *value, int len) {
+    int key_len = strlen(key);
+    char *s;
+
+    /* the last slot is for the NULL, repeated headers are dropped */
+    if (i >= ENVP_SIZE - 1)
+        return i;
+    if (len < 0)
+        len = strlen(value);
+    s = (char *)arena_alloc(a, key_len + len + 2);
+    memcpy(s, key, key_len);
+    s[key_len] = '=';
+    memcpy(s + key_len + 1, value, len);
+    s[key_len + 1 + len] = '\0';
+    envp[i] = s;
+    return i + 1;
 }
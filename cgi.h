@@ -10,16 +10,76 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "mio.h" 
 
 
+#define CGI_MAX_CHILDREN      16  /* Max cgi children running at once */
+#define CGI_MAX_PER_CLIENT    4   /* Max running children per client ip */
+#define CGI_QUEUE_SIZE        64  /* Max jobs waiting for a free child */
+#define CGI_QUEUE_PER_CLIENT  8   /* Max waiting jobs per client ip */
+#define CGI_TIMEOUT           30  /* Seconds a child may run before SIGKILL */
+#define CGI_QUEUE_TIMEOUT     10  /* Seconds a job may wait in the queue */
+
+/* serve_dynamic() return values besides EXIT_SUCCESS/EXIT_FAILURE */
+#define CGI_BUSY              2   /* queue full, answer 503 */
+
+#define JOB_QUEUED            0
+#define JOB_RUNNING           1
+
+/** @brief A request waiting for the output of a cgi job
+ *
+ */
+typedef struct cgi_waiter {
+    ConnId conn;      /* connection of the request */
+    Requests *req;
+    struct cgi_waiter *next;
+} CgiWaiter;
+
+/** @brief A cgi execution, queued or running
+ *
+ */
+typedef struct cgi_job {
+    char addr[INET_ADDRSTRLEN]; /* client ip the job is accounted to */
+    CgiWaiter *waiters;  /* requests to answer, identical GETs share a job */
+    char *filename;   /* script to execve */
+    char **envp;      /* environment built when the job was accepted */
+    Arena arena;      /* filename, envp and its strings */
+    int state;
+    pid_t pid;        /* -1 until forked, 0 once reaped */
+    int pipefd;       /* fd from which to read cgi result, -1 on EOF */
+    int stdin_fd;     /* fd to feed the post body to, -1 once closed */
+    char *in;         /* post body, NULL for other methods */
+    int in_len;
+    int in_off;       /* bytes of in already written */
+    char *out;        /* output read so far */
+    int out_len;
+    int out_size;
+    int timed_out;
+    char *cache_key;  /* cache key of a GET, identical requests attach */
+    time_t queued_at;
+    time_t started_at;
+    struct cgi_job *next;
+} CgiJob;
+
 
 /* CGI package */
 void execve_error_handler(void);
+int cgi_init(Pool *p);
 int serve_dynamic(Pool *p, Buff *b, char *filename, char *cgiquery);
-void build_envp(char **envp, Buff *b, char *cgiquery);
-char *malloc_string(char *str);
-void free_envp(char **str);
+void cgi_reap(Pool *p);
+void cgi_poll(Pool *p);
+void cgi_expire(Pool *p);
+void cgi_cancel(Pool *p, Requests *req);
+int cgi_active(void);
+int cgi_running(void);
+int cgi_queued(void);
+int cgi_retry_after(void);
+void build_envp(Arena *a, char **envp, Buff *b, char *cgiquery);
+
+/* lisod.c */
+void clienterror(Requests *req, char *addr, char *cause,
+                 char *errnum, char *shortmsg, char *longmsg);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,180 @@
+/** @file chain.c
+ *  @brief Growable input buffer of pooled segments
+ *         A connection reads its request line and headers into a chain
+ *         that takes one CHAIN_SEG_SIZE segment at a time from a pool
+ *         shared by all connections, up to a limit given by the caller,
+ *         and gives them all back with chain_reset() once the request
+ *         is parsed. Lines are never moved to be made contiguous:
+ *         the parser looks for separators with chain_span() and
+ *         chain_cspan() and copies each token straight into the
+ *         arena of its request.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chain.h"
+#include "mio.h"
+#include "slab.h"
+
+
+#define SEG_ROOM   (CHAIN_SEG_SIZE - sizeof(ChainSeg))
+
+static SlabPool segs = SLAB_POOL(CHAIN_SEG_SIZE);
+
+static ChainSeg *seg_at(Chain *c, size_t *off);
+
+
+/** @brief Read up to the end of a line, or as much of it as the socket
+ *         has, appending to a chain
+ *  @param c the chain
+ *  @param fd the socket
+ *  @param ssl its SSL context, NULL for plain http
+ *  @param limit the most bytes the chain may hold
+ *  @return CHAIN_LINE, CHAIN_AGAIN, CHAIN_EOF or CHAIN_FULL
+ */
+int chain_recvline(Chain *c, int fd, SSL *ssl, size_t limit) {
+    ChainSeg *seg;
+    size_t room, n;
+    char *p;
+
+    while (1) {
+        if (c->len >= limit)
+            return CHAIN_FULL;
+        /* mio_recvlineb() needs a byte for the '\0' */
+        if (c->tail == NULL || SEG_ROOM - c->tail->len < 2) {
+            if ((seg = (ChainSeg *)slab_get(&segs)) == NULL)
+                return CHAIN_EOF;
+            seg->next = NULL;
+            seg->len = 0;
+            if (c->tail)
+                c->tail->next = seg;
+            else
+                c->head = seg;
+            c->tail = seg;
+        }
+        seg = c->tail;
+        room = SEG_ROOM - seg->len;
+        if (room > limit - c->len + 1)
+            room = limit - c->len + 1;
+        p = seg->data + seg->len;
+        if (mio_recvlineb(fd, ssl, p, room) <= 0)
+            return CHAIN_EOF;
+        n = strlen(p);
+        seg->len += n;
+        c->len += n;
+        if (n > 0 && p[n - 1] == '\n')
+            return CHAIN_LINE;
+        if (n < room - 1)
+            return CHAIN_AGAIN;
+    }
+}
+
+/** @brief Get a byte of a chain
+ *  @param c the chain
+ *  @param off its offset
+ *  @return the byte, -1 past the end
+ */
+int chain_byte(Chain *c, size_t off) {
+    ChainSeg *seg = seg_at(c, &off);
+
+    return seg ? (unsigned char)seg->data[off] : -1;
+}
+
+/** @brief strspn() over a range of a chain
+ *  @param c the chain
+ *  @param from offset of the first byte
+ *  @param to offset past the last byte
+ *  @param set the bytes to skip
+ *  @return offset of the first byte not in set, to if there is none
+ */
+size_t chain_span(Chain *c, size_t from, size_t to, const char *set) {
+    size_t off = from;
+    ChainSeg *seg = seg_at(c, &off);
+
+    for (; seg && from < to; seg = seg->next, off = 0)
+        for (; off < seg->len && from < to; off++, from++)
+            if (seg->data[off] == '\0' ||
+                strchr(set, seg->data[off]) == NULL)
+                return from;
+    return to;
+}
+
+/** @brief strcspn() over a range of a chain
+ *  @param c the chain
+ *  @param from offset of the first byte
+ *  @param to offset past the last byte
+ *  @param set the bytes to look for
+ *  @return offset of the first byte in set, to if there is none
+ */
+size_t chain_cspan(Chain *c, size_t from, size_t to, const char *set) {
+    size_t off = from;
+    ChainSeg *seg = seg_at(c, &off);
+
+    for (; seg && from < to; seg = seg->next, off = 0)
+        for (; off < seg->len && from < to; off++, from++)
+            if (seg->data[off] != '\0' && strchr(set, seg->data[off]))
+                return from;
+    return to;
+}
+
+/** @brief Copy a range of a chain into an arena as a string
+ *  @param c the chain
+ *  @param from offset of the first byte
+ *  @param to offset past the last byte
+ *  @param a the arena
+ *  @return the string, NULL if out of memory
+ */
+char *chain_strndup(Chain *c, size_t from, size_t to, Arena *a) {
+    size_t off = from, n;
+    ChainSeg *seg = seg_at(c, &off);
+    char *s, *p;
+
+    if (to < from)
+        to = from;
+    if ((s = p = (char *)arena_alloc(a, to - from + 1)) == NULL)
+        return NULL;
+    for (; seg && from < to; seg = seg->next, off = 0) {
+        n = seg->len - off < to - from ? seg->len - off : to - from;
+        memcpy(p, seg->data + off, n);
+        p += n;
+        from += n;
+    }
+    *p = '\0';
+    return s;
+}
+
+/** @brief Give all the segments of a chain back to the pool
+ *  @param c the chain
+ *  @return Void
+ */
+void chain_reset(Chain *c) {
+    ChainSeg *seg, *next;
+
+    for (seg = c->head; seg; seg = next) {
+        next = seg->next;
+        slab_put(&segs, seg);
+    }
+    c->head = c->tail = NULL;
+    c->len = 0;
+}
+
+/** @brief Bytes held in segments by all chains
+ *  @return the bytes
+ */
+size_t chain_bytes() {
+    return segs.in_use * CHAIN_SEG_SIZE;
+}
+
+/** @brief Find the segment holding a byte
+ *  @param c the chain
+ *  @param off offset in the chain, set to the offset in the segment
+ *  @return the segment, NULL past the end
+ */
+static ChainSeg *seg_at(Chain *c, size_t *off) {
+    ChainSeg *seg;
+
+    for (seg = c->head; seg && *off >= seg->len; seg = seg->next)
+        *off -= seg->len;
+    return seg;
+}
@@ -0,0 +1,46 @@
+#ifndef CHAIN_H
+#define CHAIN_H
+
+#include <stddef.h>
+#include <openssl/ssl.h>
+
+#include "arena.h"
+
+
+#define CHAIN_SEG_SIZE     2048  /* from the shared pool, a typical request fits */
+
+#define CHAIN_LINE          1    /* chain_recvline(): a line ending in \n */
+#define CHAIN_AGAIN        -1    /* part of a line, the rest is not there yet */
+#define CHAIN_EOF           0    /* peer closed, or error */
+#define CHAIN_FULL         -2    /* limit reached before the end of the line */
+
+/** @brief A segment of a chain, bytes go in data
+ *
+ */
+typedef struct chain_seg {
+    struct chain_seg *next;
+    unsigned int len;     /* bytes used in data */
+    char data[];
+} ChainSeg;
+
+/** @brief Input bytes in a list of pooled segments
+ *         Bytes are addressed by their offset from the start of the
+ *         chain, a line or a token may cross segments
+ */
+typedef struct chain {
+    ChainSeg *head;
+    ChainSeg *tail;       /* where bytes are appended */
+    unsigned int len;     /* bytes in all segments */
+} Chain;
+
+
+/* Chain package */
+int chain_recvline(Chain *c, int fd, SSL *ssl, size_t limit);
+int chain_byte(Chain *c, size_t off);
+size_t chain_span(Chain *c, size_t from, size_t to, const char *set);
+size_t chain_cspan(Chain *c, size_t from, size_t to, const char *set);
+char *chain_strndup(Chain *c, size_t from, size_t to, Arena *a);
+void chain_reset(Chain *c);
+size_t chain_bytes(void);
+
+#endif
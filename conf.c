@@ -0,0 +1,368 @@
+/** @file conf.c
+ *  @brief Parse the optional lisod config file
+ *         Each line is a directive followed by its arguments,
+ *         '#' starts a comment:
+ *
+ *             cache_size  16777216
+ *             cache_vary  Accept-Encoding
+ *             cache_ttl   /cgi/news 10 30
+ *             upstream    api 127.0.0.1:5000 127.0.0.1:5001
+ *             upstream_balance api ewma
+ *             upstream_response 16777216
+ *             proxy       /api/ api
+ *             route       /app/ cgi /srv/app.py ttl 10 30 max_body 4096
+ *             route       /img/ static /srv/images ttl 3600
+ *             route       *.py  cgi /usr/bin/python3
+ *             route       /server-status status
+ *             log_flush   100
+ *             log_ring    1048576
+ *             log_overflow sample 10
+ *             log_format  binary
+ *             log_per_worker on
+ *             error_log   /var/log/lisod.err
+ *             admin_port  9100
+ *             slow_log    /var/log/lisod.slow 500
+ *             trace_log   /var/log/lisod.trace.json 100
+ *             probe       conn,cgi
+ *             mem_budget  268435456
+ *             header_limit 32768
+ *             write_quantum 65536
+ *             write_priority on
+ *             overload_conns 768 960
+ *             overload_lag 200 1000
+ *             overload_queue 32 64
+ *             rate_limit  http conns 16
+ *             rate_limit  http requests 50 100
+ *             rate_limit  https cgi 2 5
+ *             stall_threshold 100
+ *             stall_watchdog on
+ *             io_threads  4
+ *             stream_window 1048576
+ */
+
+#include <ctype.h>
+
+#include "conf.h"
+#include "probe.h"
+
+
+Conf conf;
+
+static int conf_limits(char **argv, int max, int *limits);
+static int conf_rate_limit(int argc, char **argv);
+static int conf_route(int argc, char **argv);
+static ConfRoute *conf_add_route(char *prefix, int handler, char *target);
+
+
+/** @brief Set every setting to its default
+ *  @return Void
+ */
+void conf_init() {
+    memset(&conf, 0, sizeof(Conf));
+    conf.cache_size = CONF_CACHE_SIZE;
+    conf.log_flush = CONF_LOG_FLUSH;
+    conf.log_ring = CONF_LOG_RING;
+    conf.log_overflow = LOG_OVERFLOW_DROP;
+    conf.log_sample = CONF_LOG_SAMPLE;
+    conf.header_limit = CONF_HEADER_LIMIT;
+    conf.write_quantum = CONF_WRITE_QUANTUM;
+    conf.write_priority = 1;
+    conf.stall_ms = CONF_STALL_MS;
+    conf.io_threads = CONF_IO_THREADS;
+    conf.stream_window = CONF_STREAM_WINDOW;
+    conf.upstream_response = CONF_UPSTREAM_RESPONSE;
+    conf.overload_conns[0] = CONF_CONNS_SOFT;
+    conf.overload_conns[1] = CONF_CONNS_HARD;
+    conf.overload_lag[0] = CONF_LAG_SOFT;
+    conf.overload_lag[1] = CONF_LAG_HARD;
+    conf.overload_queue[0] = CONF_QUEUE_SOFT;
+    conf.overload_queue[1] = CONF_QUEUE_HARD;
+}
+
+/** @brief Load settings from a config file
+ *  @param file path of the config file
+ *  @return EXIT_FAILURE on fail
+ *  @return EXIT_SUCCESS on success
+ */
+int conf_load(char *file) {
+    FILE *fp;
+    char line[CONF_LINE_SIZE];
+    char *argv[CONF_MAX_ARGS];
+    char *tok;
+    int i, argc, lineno = 0;
+    ConfRoute *rule;
+    ConfUpstream *up;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        fprintf(stderr, "Error opening config file %s.\n", file);
+        return EXIT_FAILURE;
+    }
+
+    while (fgets(line, CONF_LINE_SIZE, fp)) {
+        lineno++;
+        if ((tok = strchr(line, '#')) != NULL)
+            *tok = '\0';
+        argc = 0;
+        for (tok = strtok(line, " \t\r\n"); tok && argc < CONF_MAX_ARGS;
+             tok = strtok(NULL, " \t\r\n"))
+            argv[argc++] = tok;
+        if (argc == 0)
+            continue;
+
+        if (!strcmp(argv[0], "cache_size") && argc == 2) {
+            conf.cache_size = atol(argv[1]);
+        } else if (!strcmp(argv[0], "cache_vary") && argc == 2 &&
+                   conf.n_cache_vary < CONF_MAX_VARY) {
+            conf.cache_vary[conf.n_cache_vary++] = strdup(argv[1]);
+        } else if (!strcmp(argv[0], "cache_ttl") && argc >= 3 &&
+                   argv[1][0] != '*' &&
+                   (rule = conf_add_route(argv[1], ROUTE_NONE, NULL)) != NULL) {
+            rule->ttl = atoi(argv[2]);
+            rule->stale = argc > 3 ? atoi(argv[3]) : 0;
+        } else if (!strcmp(argv[0], "upstream") && argc >= 3 &&
+                   conf.n_upstreams < CONF_MAX_UPSTREAMS &&
+                   strlen(argv[1]) < CONF_NAME_SIZE &&
+                   conf_upstream(argv[1]) == NULL) {
+            up = &conf.upstreams[conf.n_upstreams++];
+            strcpy(up->name, argv[1]);
+            for (i = 2; i < argc && up->n_servers < CONF_MAX_BACKENDS; i++)
+                up->servers[up->n_servers++] = strdup(argv[i]);
+        } else if (!strcmp(argv[0], "upstream_balance") && argc == 3 &&
+                   (up = conf_upstream(argv[1])) != NULL &&
+                   (!strcmp(argv[2], "least_conn") ||
+                    !strcmp(argv[2], "ewma"))) {
+            up->balance = strcmp(argv[2], "ewma") ? BALANCE_LEAST_CONN
+                                                  : BALANCE_EWMA;
+        } else if (!strcmp(argv[0], "upstream_response") && argc == 2 &&
+                   atol(argv[1]) >= 4096 &&
+                   atol(argv[1]) <= CONF_MAX_UPSTREAM_RESPONSE) {
+            conf.upstream_response = atol(argv[1]);
+        } else if (!strcmp(argv[0], "proxy") && argc == 3 &&
+                   argv[1][0] != '*' && conf_upstream(argv[2]) != NULL &&
+                   conf_add_route(argv[1], ROUTE_UPSTREAM, argv[2]) != NULL) {
+            /* conf_add_route() set it */
+        } else if (!strcmp(argv[0], "route") && argc >= 3 &&
+                   conf_route(argc, argv) == EXIT_SUCCESS) {
+            /* conf_route() set it */
+        } else if (!strcmp(argv[0], "log_flush") && argc == 2 &&
+                   atoi(argv[1]) > 0) {
+            conf.log_flush = atoi(argv[1]);
+        } else if (!strcmp(argv[0], "log_ring") && argc == 2 &&
+                   atol(argv[1]) >= 4096) {
+            conf.log_ring = atol(argv[1]);
+        } else if (!strcmp(argv[0], "log_overflow") && argc >= 2 &&
+                   (!strcmp(argv[1], "block") || !strcmp(argv[1], "drop") ||
+                    !strcmp(argv[1], "sample"))) {
+            conf.log_overflow = !strcmp(argv[1], "block") ? LOG_OVERFLOW_BLOCK :
+                                !strcmp(argv[1], "drop") ? LOG_OVERFLOW_DROP :
+                                LOG_OVERFLOW_SAMPLE;
+            if (argc > 2 && atoi(argv[2]) > 0)
+                conf.log_sample = atoi(argv[2]);
+        } else if (!strcmp(argv[0], "log_format") && argc == 2 &&
+                   (!strcmp(argv[1], "text") || !strcmp(argv[1], "binary"))) {
+            conf.log_binary = !strcmp(argv[1], "binary");
+        } else if (!strcmp(argv[0], "log_per_worker") && argc == 2 &&
+                   (!strcmp(argv[1], "on") || !strcmp(argv[1], "off"))) {
+            conf.log_per_worker = !strcmp(argv[1], "on");
+        } else if (!strcmp(argv[0], "admin_port") && argc == 2 &&
+                   atoi(argv[1]) > 0 && atoi(argv[1]) < 65536) {
+            conf.admin_port = atoi(argv[1]);
+        } else if (!strcmp(argv[0], "slow_log") && argc == 3 &&
+                   atoi(argv[2]) >= 0) {
+            conf.slow_log = strdup(argv[1]);
+            conf.slow_ms = atoi(argv[2]);
+        } else if (!strcmp(argv[0], "trace_log") && argc >= 2) {
+            conf.trace_log = strdup(argv[1]);
+            conf.trace_sample = argc > 2 && atoi(argv[2]) > 0 ?
+                                atoi(argv[2]) : 1;
+        } else if (!strcmp(argv[0], "mem_budget") && argc == 2) {
+            conf.mem_budget = atol(argv[1]);
+        } else if (!strcmp(argv[0], "header_limit") && argc == 2 &&
+                   atol(argv[1]) >= 1024) {
+            conf.header_limit = atol(argv[1]);
+        } else if (!strcmp(argv[0], "write_quantum") && argc == 2 &&
+                   atol(argv[1]) >= 0) {
+            conf.write_quantum = atol(argv[1]);
+        } else if (!strcmp(argv[0], "write_priority") && argc == 2 &&
+                   (!strcmp(argv[1], "on") || !strcmp(argv[1], "off"))) {
+            conf.write_priority = !strcmp(argv[1], "on");
+        } else if (!strcmp(argv[0], "overload_conns") && argc == 3 &&
+                   conf_limits(argv, CONF_CONNS_HARD,
+                               conf.overload_conns) == EXIT_SUCCESS) {
+            /* conf_limits() set them */
+        } else if (!strcmp(argv[0], "overload_lag") && argc == 3 &&
+                   conf_limits(argv, 0, conf.overload_lag) == EXIT_SUCCESS) {
+            /* conf_limits() set them */
+        } else if (!strcmp(argv[0], "overload_queue") && argc == 3 &&
+                   conf_limits(argv, 0, conf.overload_queue) == EXIT_SUCCESS) {
+            /* conf_limits() set them */
+        } else if (!strcmp(argv[0], "rate_limit") && argc >= 4 &&
+                   conf_rate_limit(argc, argv) == EXIT_SUCCESS) {
+            /* conf_rate_limit() set it */
+        } else if (!strcmp(argv[0], "stall_threshold") && argc == 2 &&
+                   atoi(argv[1]) >= 0) {
+            conf.stall_ms = atoi(argv[1]);
+        } else if (!strcmp(argv[0], "stall_watchdog") && argc == 2 &&
+                   (!strcmp(argv[1], "on") || !strcmp(argv[1], "off"))) {
+            conf.stall_watchdog = !strcmp(argv[1], "on");
+        } else if (!strcmp(argv[0], "io_threads") && argc == 2 &&
+                   atoi(argv[1]) >= 0 && atoi(argv[1]) <= CONF_MAX_IO_THREADS) {
+            conf.io_threads = atoi(argv[1]);
+        } else if (!strcmp(argv[0], "stream_window") && argc == 2 &&
+                   atol(argv[1]) >= 4096) {
+            conf.stream_window = atol(argv[1]);
+        } else if (!strcmp(argv[0], "probe") && argc == 2 &&
+                   probe_parse(argv[1], &probe_mask) == EXIT_SUCCESS) {
+            /* probe_parse() set the mask */
+        } else if (!strcmp(argv[0], "error_log") && argc == 2) {
+            conf.error_log = strdup(argv[1]);
+        } else {
+            fprintf(stderr, "%s:%d: bad directive %s\n",
+                    file, lineno, argv[0]);
+            fclose(fp);
+            return EXIT_FAILURE;
+        }
+    }
+
+    fclose(fp);
+    return EXIT_SUCCESS;
+}
+
+/** @brief Parse the soft and hard limit of an overload directive
+ *  @param argv the directive and its two arguments
+ *  @param max the most the hard limit may be, 0 for no maximum
+ *  @param limits where to put soft and hard
+ *  @return EXIT_FAILURE unless 0 < soft <= hard <= max
+ *  @return EXIT_SUCCESS on success
+ */
+static int conf_limits(char **argv, int max, int *limits) {
+    int soft = atoi(argv[1]), hard = atoi(argv[2]);
+
+    if (soft <= 0 || soft > hard || (max && hard > max))
+        return EXIT_FAILURE;
+    limits[0] = soft;
+    limits[1] = hard;
+    return EXIT_SUCCESS;
+}
+
+/** @brief Parse a rate_limit directive:
+ *         rate_limit <http|https> conns <n>
+ *         rate_limit <http|https> <requests|cgi> <per second> <burst>
+ *  @param argc # of words
+ *  @param argv the directive and its arguments
+ *  @return EXIT_FAILURE if malformed
+ *  @return EXIT_SUCCESS on success
+ */
+static int conf_rate_limit(int argc, char **argv) {
+    RateLimit *rl;
+    int i;
+
+    if (strcmp(argv[1], "http") && strcmp(argv[1], "https"))
+        return EXIT_FAILURE;
+    rl = &conf.rate_limit[!strcmp(argv[1], "https")];
+    if (!strcmp(argv[2], "conns") && argc == 4 && atoi(argv[3]) >= 0) {
+        rl->conns = atoi(argv[3]);
+        return EXIT_SUCCESS;
+    }
+    if (strcmp(argv[2], "requests") && strcmp(argv[2], "cgi"))
+        return EXIT_FAILURE;
+    i = !strcmp(argv[2], "cgi");
+    if (argc != 5 || atof(argv[3]) < 0 || atoi(argv[4]) < 1)
+        return EXIT_FAILURE;
+    rl->rate[i] = atof(argv[3]);
+    rl->burst[i] = atoi(argv[4]);
+    return EXIT_SUCCESS;
+}
+
+/** @brief Parse a route directive:
+ *         route <prefix|*.ext> <static <folder>|cgi <script>|
+ *                               upstream <name>|status>
+ *               [ttl <seconds> [<stale seconds>]] [max_body <bytes>]
+ *         max_body can only lower the limit of CONF_MAX_BODY bytes
+ *         every post body has
+ *  @param argc # of words
+ *  @param argv the directive and its arguments
+ *  @return EXIT_FAILURE if malformed
+ *  @return EXIT_SUCCESS on success
+ */
+static int conf_route(int argc, char **argv) {
+    static const char *names[] = {"", "static", "cgi", "upstream", "status"};
+    char *prefix = argv[1], *target = NULL;
+    ConfRoute *r;
+    int i = 3, handler;
+
+    for (handler = ROUTE_STATIC; handler <= ROUTE_STATUS; handler++)
+        if (!strcmp(argv[2], names[handler]))
+            break;
+    if (handler > ROUTE_STATUS)
+        return EXIT_FAILURE;
+    if (handler != ROUTE_STATUS) {
+        if (argc < 4)
+            return EXIT_FAILURE;
+        target = argv[i++];
+    }
+    if (handler == ROUTE_UPSTREAM && conf_upstream(target) == NULL)
+        return EXIT_FAILURE;
+    /* the mount is cut off the path, it can't hold a query, and an
+       extension can't hold a folder */
+    if (strchr(prefix, '?') ||
+        (prefix[0] != '/' && strncmp(prefix, "*.", 2)) ||
+        (prefix[0] == '*' && (prefix[2] == '\0' || strchr(prefix, '/'))))
+        return EXIT_FAILURE;
+    if ((r = conf_add_route(prefix, handler, target)) == NULL)
+        return EXIT_FAILURE;
+
+    while (i < argc) {
+        if (!strcmp(argv[i], "ttl") && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            r->ttl = atoi(argv[i + 1]);
+            i += 2;
+            if (i < argc && isdigit((unsigned char)argv[i][0]))
+                r->stale = atoi(argv[i++]);
+        } else if (!strcmp(argv[i], "max_body") && i + 1 < argc &&
+                   atoi(argv[i + 1]) > 0 &&
+                   atoi(argv[i + 1]) <= CONF_MAX_BODY) {
+            r->max_body = atoi(argv[i + 1]);
+            i += 2;
+        } else {
+            free(r->target);
+            conf.n_routes--;
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/** @brief Add a route rule, with every option inherited
+ *  @param prefix uri prefix, or "*.ext"
+ *  @param handler ROUTE_*
+ *  @param target folder, script or upstream name, NULL if none
+ *  @return the rule, NULL if there are too many or the prefix is too long
+ */
+static ConfRoute *conf_add_route(char *prefix, int handler, char *target) {
+    ConfRoute *r;
+
+    if (conf.n_routes == CONF_MAX_ROUTES ||
+        strlen(prefix) >= CONF_PREFIX_SIZE)
+        return NULL;
+    r = &conf.routes[conf.n_routes++];
+    strcpy(r->prefix, prefix);
+    r->handler = handler;
+    r->target = target ? strdup(target) : NULL;
+    r->ttl = -1;
+    r->stale = 0;
+    r->max_body = 0;
+    return r;
+}
+
+/** @brief Find an upstream group by name
+ *  @param name the name of the group
+ *  @return the group, NULL if not defined
+ */
+ConfUpstream *conf_upstream(char *name) {
+    int i;
+
+    for (i = 0; i < conf.n_upstreams; i++)
+        if (!strcmp(conf.upstreams[i].name, name))
+            return &conf.upstreams[i];
+    return NULL;
+}
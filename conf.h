@@ -0,0 +1,130 @@
+#ifndef CONF_H
+#define CONF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+
+
+#define CONF_LINE_SIZE       1024
+#define CONF_PREFIX_SIZE     256
+#define CONF_MAX_VARY        8    /* Max request headers the cache varies on */
+#define CONF_MAX_ROUTES      64   /* Max route, proxy and cache_ttl rules */
+#define CONF_MAX_ARGS        12   /* Max words of a directive */
+#define CONF_NAME_SIZE       64
+#define CONF_MAX_UPSTREAMS   8    /* Max upstream groups */
+#define CONF_MAX_BACKENDS    8    /* Max servers in one upstream group */
+#define CONF_MAX_IO_THREADS  64
+
+#define BALANCE_LEAST_CONN   0    /* Fewest requests in flight */
+#define BALANCE_EWMA         1    /* Lowest latency average, times load */
+
+#define ROUTE_NONE           0    /* options only, the handler is inherited */
+#define ROUTE_STATIC         1    /* files under a folder */
+#define ROUTE_CGI            2    /* a script */
+#define ROUTE_UPSTREAM       3    /* an upstream group */
+#define ROUTE_STATUS         4    /* the metrics of the server */
+
+#define LOG_OVERFLOW_BLOCK   0    /* Wait for the flusher, lose nothing */
+#define LOG_OVERFLOW_DROP    1    /* Drop records that do not fit */
+#define LOG_OVERFLOW_SAMPLE  2    /* Keep 1 in log_sample once nearly full */
+
+#define CONF_CACHE_SIZE      (16 * 1024 * 1024) /* Default cache bytes */
+#define CONF_LOG_FLUSH       100  /* Default ms between log flushes */
+#define CONF_LOG_RING        (1024 * 1024) /* Default log ring bytes */
+#define CONF_LOG_SAMPLE      10
+#define CONF_HEADER_LIMIT    (32 * 1024) /* Default request line + header bytes */
+#define CONF_WRITE_QUANTUM   (64 * 1024) /* Default bytes sent a connection a round */
+#define CONF_CONNS_SOFT      (FD_SETSIZE / 4 * 3) /* Default overload limits */
+#define CONF_CONNS_HARD      (FD_SETSIZE - 64) /* the rest for cgi and upstream */
+#define CONF_LAG_SOFT        200  /* ms */
+#define CONF_LAG_HARD        1000
+#define CONF_QUEUE_SOFT      32   /* cgi jobs waiting for a child */
+#define CONF_QUEUE_HARD      64
+#define CONF_STALL_MS        100  /* Default ms a handler may run */
+#define CONF_IO_THREADS      4    /* Default threads opening static files */
+#define CONF_STREAM_WINDOW   (1024 * 1024) /* Default bytes of a file mapped */
+#define CONF_MAX_BODY        8191 /* Post bodies come in one read of 8 KB */
+#define CONF_UPSTREAM_RESPONSE (16 * 1024 * 1024) /* Default bytes buffered */
+#define CONF_MAX_UPSTREAM_RESPONSE (256 * 1024 * 1024) /* of a proxied response */
+
+/** @brief How requests under a uri prefix, or with a file extension,
+ *         are handled. proxy and cache_ttl directives are routes too
+ *
+ */
+typedef struct conf_route {
+    char prefix[CONF_PREFIX_SIZE]; /* uri prefix, or "*.ext" */
+    int handler;  /* ROUTE_*, ROUTE_NONE keeps that of the enclosing route */
+    char *target; /* folder, script or upstream name */
+    int ttl;      /* seconds a response stays fresh, -1 is inherited */
+    int stale;    /* seconds it may then be served while revalidating */
+    int max_body; /* bytes of a post body, 0 is inherited, at most
+                     CONF_MAX_BODY */
+} ConfRoute;
+
+/** @brief A group of http servers requests can be proxied to
+ *
+ */
+typedef struct conf_upstream {
+    char name[CONF_NAME_SIZE];
+    char *servers[CONF_MAX_BACKENDS];  /* "ip:port" */
+    int n_servers;
+    int balance;
+} ConfUpstream;
+
+/** @brief Per client limits of a listener, 0 is no limit
+ *
+ */
+typedef struct rate_limit {
+    int conns;         /* open connections per client */
+    double rate[2];    /* requests, cgi runs a second per client */
+    int burst[2];      /* and how many may come at once */
+} RateLimit;
+
+/** @brief Settings from the optional config file
+ *
+ */
+typedef struct conf {
+    long cache_size;   /* max bytes held by the response cache, 0 is off */
+    char *cache_vary[CONF_MAX_VARY]; /* request headers added to cache key */
+    int n_cache_vary;
+    ConfRoute routes[CONF_MAX_ROUTES]; /* in the order of the file */
+    int n_routes;
+    ConfUpstream upstreams[CONF_MAX_UPSTREAMS];
+    int n_upstreams;
+    int upstream_response; /* bytes of a proxied response, 502 beyond */
+    int log_flush;     /* ms between writes of the access log */
+    long log_ring;     /* bytes of log buffered per thread */
+    int log_overflow;  /* what to do when the ring is full */
+    int log_sample;
+    int log_binary;    /* write the compact binary log format */
+    int log_per_worker; /* each logging thread writes a file of its own */
+    char *error_log;   /* file stderr is sent to, NULL to leave it */
+    int admin_port;    /* loopback port serving /metrics, 0 is off */
+    char *slow_log;    /* file slow requests are written to, with phases */
+    int slow_ms;       /* threshold of the slow log */
+    char *trace_log;   /* Chrome trace events of sampled requests */
+    int trace_sample;  /* 1 in trace_sample requests is traced */
+    long mem_budget;   /* bytes for connections before idle ones go, 0 is off */
+    long header_limit; /* bytes of request line and headers, 431 beyond */
+    long write_quantum; /* bytes a connection sends a round, 0 is no limit */
+    int write_priority; /* new and small responses go first in a round */
+    int overload_conns[2];  /* soft and hard limits, open connections */
+    int overload_lag[2];    /* ms the event loop is busy per wakeup */
+    int overload_queue[2];  /* cgi jobs waiting for a child */
+    RateLimit rate_limit[2]; /* by listener, http then https */
+    int stall_ms;      /* a handler running this long is a stall, 0 is off */
+    int stall_watchdog; /* backtrace the loop while a stall goes on */
+    int io_threads;    /* open static files off the loop, 0 is in it */
+    long stream_window; /* bytes of a file mapped at a time to send it */
+} Conf;
+
+extern Conf conf;
+
+/* Config package */
+void conf_init(void);
+int conf_load(char *file);
+ConfUpstream *conf_upstream(char *name);
+
+#endif
@@ -0,0 +1,203 @@
+/** @file conntab.c
+ *  @brief Table of the client connections
+ *         Slots come from a free-list and go back to it on close, so
+ *         adding and removing a connection costs the same whatever the
+ *         size of the table. The slots in use are kept dense in live[]
+ *         and the event loop walks only those.
+ *
+ *         Each slot is split in two: the Buff holds what the loop reads
+ *         on every wakeup in one cache line, the ConnCold next to it
+ *         holds the address, the SSL context and the request list.
+ *
+ *         A connection holds no input segments while it is idle. Its
+ *         chain takes them from a pool shared by all connections as a
+ *         request comes in and gives them back once no request is half
+ *         read. The memory held that way, by the request arenas and by
+ *         OpenSSL, is what the mem_budget directive limits.
+ */
+
+#include <malloc.h>
+#include <openssl/crypto.h>
+
+#include "conntab.h"
+
+
+static size_t tls_bytes = 0;
+static size_t tls_base = 0;    /* the server context, certificate and key */
+
+static void *tls_malloc(size_t n, const char *file, int line);
+static void *tls_realloc(void *ptr, size_t n, const char *file, int line);
+static void tls_free(void *ptr, const char *file, int line);
+
+
+/** @brief Set up an empty table, every slot free
+ *  @param t the table
+ *  @return Void
+ */
+void conntab_init(ConnTab *t) {
+    int i;
+
+    memset(t, 0, sizeof(*t));
+    for (i = 0; i < CONN_MAX; i++) {
+        t->hot[i].fd = -1;
+        t->hot[i].cold = &t->cold[i];
+        t->cold[i].live_pos = -1;
+        t->cold[i].next_free = i + 1 < CONN_MAX ? i + 1 : -1;
+    }
+    t->free_head = 0;
+    t->n = 0;
+}
+
+/** @brief Take a free slot for a new connection
+ *         The cold fields other than the slot bookkeeping are left to
+ *         the caller, input segments are taken on the first read
+ *  @param t the table
+ *  @param fd the socket of the connection
+ *  @return the Buff of the connection, NULL if the table is full
+ */
+Buff *conntab_add(ConnTab *t, int fd) {
+    int slot = t->free_head;
+    Buff *b;
+    ConnCold *c;
+
+    if (slot < 0)
+        return NULL;
+    b = &t->hot[slot];
+    c = &t->cold[slot];
+    t->free_head = c->next_free;
+    c->next_free = -1;
+    c->live_pos = t->n;
+    t->live[t->n++] = slot;
+
+    b->fd = fd;
+    b->in.head = b->in.tail = NULL;
+    b->in.len = 0;
+    b->cur_parsed = 0;
+    b->cur_request = NULL;
+    return b;
+}
+
+/** @brief Give the slot of a closed connection back
+ *         The last live slot takes its place in live[], so a loop
+ *         walking live[] from the end is not disturbed by removing
+ *         the slot it is at
+ *  @param t the table
+ *  @param b the Buff of the connection
+ *  @return Void
+ */
+void conntab_remove(ConnTab *t, Buff *b) {
+    int slot = b - t->hot;
+    ConnCold *c = b->cold;
+    int last = t->live[--t->n];
+
+    t->live[c->live_pos] = last;
+    t->cold[last].live_pos = c->live_pos;
+    c->live_pos = -1;
+    c->gen++;
+    c->request = NULL;
+    c->client_context = NULL;
+    chain_reset(&b->in);
+    b->cur_parsed = 0;
+    b->fd = -1;
+    b->cur_request = NULL;
+    c->next_free = t->free_head;
+    t->free_head = slot;
+}
+
+/** @brief Get a handle to a connection
+ *  @param t the table
+ *  @param b the Buff of the connection
+ *  @return the handle
+ */
+ConnId conntab_id(ConnTab *t, Buff *b) {
+    return (b->cold->gen << CONN_SLOT_BITS) | (unsigned int)(b - t->hot);
+}
+
+/** @brief Resolve a handle
+ *  @param t the table
+ *  @param id the handle
+ *  @return the Buff of the connection, NULL if it has been closed since
+ */
+Buff *conntab_get(ConnTab *t, ConnId id) {
+    unsigned int slot = id & ((1U << CONN_SLOT_BITS) - 1);
+
+    if (slot >= CONN_MAX || t->cold[slot].live_pos < 0 ||
+        ((t->cold[slot].gen << CONN_SLOT_BITS) | slot) != id)
+        return NULL;
+    return &t->hot[slot];
+}
+
+/** @brief Count what OpenSSL allocates, must run before it allocates
+ *         anything
+ *  @return Void
+ */
+void conntab_count_tls() {
+    CRYPTO_set_mem_functions(tls_malloc, tls_realloc, tls_free);
+}
+
+/** @brief Take what OpenSSL holds now as not belonging to connections
+ *  @return Void
+ */
+void conntab_tls_baseline() {
+    tls_base = tls_bytes;
+}
+
+/** @brief Memory held for the connections
+ *  @param t the table
+ *  @param m where to put the breakdown, or NULL
+ *  @return the total in bytes
+ */
+size_t conntab_mem(ConnTab *t, ConnMem *m) {
+    ConnMem mem;
+
+    mem.read_buffers = chain_bytes();
+    mem.arenas = arena_bytes();
+    mem.tls = tls_bytes > tls_base ? tls_bytes - tls_base : 0;
+    mem.slots = t->n * (sizeof(Buff) + sizeof(ConnCold));
+    if (m)
+        *m = mem;
+    return mem.read_buffers + mem.arenas + mem.tls + mem.slots;
+}
+
+/** @brief malloc for OpenSSL that keeps count
+ *  @param n bytes wanted
+ *  @param file where OpenSSL called from
+ *  @param line where OpenSSL called from
+ *  @return the memory
+ */
+static void *tls_malloc(size_t n, const char *file, int line) {
+    void *ptr = malloc(n);
+
+    if (ptr)
+        tls_bytes += malloc_usable_size(ptr);
+    return ptr;
+}
+
+/** @brief realloc for OpenSSL that keeps count
+ *  @param ptr the memory to resize
+ *  @param n bytes wanted
+ *  @param file where OpenSSL called from
+ *  @param line where OpenSSL called from
+ *  @return the memory
+ */
+static void *tls_realloc(void *ptr, size_t n, const char *file, int line) {
+    size_t old = ptr ? malloc_usable_size(ptr) : 0;
+    void *ret = realloc(ptr, n);
+
+    if (ret == NULL)
+        return NULL;
+    tls_bytes += malloc_usable_size(ret) - old;
+    return ret;
+}
+
+/** @brief free for OpenSSL that keeps count
+ *  @param ptr the memory
+ *  @param file where OpenSSL called from
+ *  @param line where OpenSSL called from
+ *  @return Void
+ */
+static void tls_free(void *ptr, const char *file, int line) {
+    if (ptr)
+        tls_bytes -= malloc_usable_size(ptr);
+    free(ptr);
+}
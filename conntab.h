@@ -0,0 +1,36 @@
+#ifndef CONNTAB_H
+#define CONNTAB_H
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mio.h"
+
+
+/* The connection in the k-th live slot, k < t->n */
+#define CONNTAB_AT(t, k)  (&(t)->hot[(t)->live[k]])
+
+
+/** @brief Memory held for the connections, by kind
+ *
+ */
+typedef struct conn_mem {
+    size_t read_buffers;  /* input segments taken from the pool */
+    size_t arenas;        /* request strings, headers and responses */
+    size_t tls;           /* held by OpenSSL beyond the server context */
+    size_t slots;         /* Buff and ConnCold of the open connections */
+} ConnMem;
+
+
+/* Connection table package */
+void conntab_init(ConnTab *t);
+Buff *conntab_add(ConnTab *t, int fd);
+void conntab_remove(ConnTab *t, Buff *b);
+void conntab_count_tls(void);
+void conntab_tls_baseline(void);
+size_t conntab_mem(ConnTab *t, ConnMem *m);
+ConnId conntab_id(ConnTab *t, Buff *b);
+Buff *conntab_get(ConnTab *t, ConnId id);
+
+#endif
@@ -0,0 +1,233 @@
+/** @file iopool.c
+ *  @brief I/O threads for the filesystem work of static requests
+ *         The stat() and open() of a static file, and reading in its
+ *         first bytes, block on a cold page cache or a slow
+ *         www folder. serve_client() hands them to io_threads threads
+ *         instead and the request waits with REQ_IO, later requests of
+ *         its connection are answered after it as write_conn() keeps
+ *         the order. A thread opens the file and reads its first
+ *         IO_PREFAULT bytes into the page cache, then posts
+ *         the job to an eventfd the event loop selects on, and
+ *         io_complete() builds the response there. Disk latency then
+ *         holds up only the request waiting on the disk.
+ */
+
+#define _GNU_SOURCE  /* readahead() */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "iopool.h"
+#include "cgi.h"
+#include "conf.h"
+#include "conntab.h"
+#include "metrics.h"
+#include "reqtrace.h"
+#include "probe.h"
+
+
+static int event_fd = -1;
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_wake = PTHREAD_COND_INITIALIZER;
+static IoJob *todo = NULL, *todo_tail = NULL;  /* FIFO for the threads */
+static IoJob *done = NULL;                     /* for the event loop */
+static int pending = 0;
+
+static void *io_worker(void *arg);
+static void io_open(IoJob *job);
+static void io_answer(Pool *p, Buff *b, IoJob *job);
+
+
+/** @brief Start the I/O threads, none if io_threads is 0
+ *  @param p Pool struct of the server
+ *  @return EXIT_SUCCESS, or EXIT_FAILURE if the eventfd fails
+ */
+int io_init(Pool *p) {
+    pthread_t tid;
+    int i, n = 0;
+
+    if (conf.io_threads <= 0)
+        return EXIT_SUCCESS;
+    if ((event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "Error creating eventfd for I/O threads.\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < conf.io_threads; i++)
+        if (pthread_create(&tid, NULL, io_worker, NULL) == 0) {
+            pthread_detach(tid);
+            n++;
+        }
+    if (n == 0) {
+        fprintf(stderr, "Failed creating I/O threads, serving files "
+                        "from the event loop.\n");
+        close(event_fd);
+        event_fd = -1;
+        return EXIT_SUCCESS;
+    }
+    FD_SET(event_fd, &p->read_set);
+    if (event_fd > p->maxfd)
+        p->maxfd = event_fd;
+    return EXIT_SUCCESS;
+}
+
+/** @brief Hand a static request to the I/O threads
+ *  @param p Pool struct of the server
+ *  @param b Buff struct representing a connection
+ *  @param filename the file to serve
+ *  @return EXIT_SUCCESS if queued, EXIT_FAILURE if the caller serves
+ *          it, there are no threads or no memory
+ */
+int io_submit(Pool *p, Buff *b, char *filename) {
+    Requests *req = b->cur_request;
+    IoJob *job;
+
+    if (event_fd < 0 ||
+        (job = (IoJob *)malloc(sizeof(IoJob) + strlen(filename) + 1)) == NULL)
+        return EXIT_FAILURE;
+    job->conn = conntab_id(&p->conns, b);
+    job->req = req;
+    job->head = !strcasecmp(req->method, "HEAD");
+    job->err = 0;
+    job->fd = -1;
+    job->queued = metrics_now();
+    job->next = NULL;
+    strcpy(job->filename, filename);
+
+    req->valid = REQ_IO;
+    pending++;
+
+    pthread_mutex_lock(&io_lock);
+    if (todo_tail)
+        todo_tail->next = job;
+    else
+        todo = job;
+    todo_tail = job;
+    pthread_cond_signal(&io_wake);
+    pthread_mutex_unlock(&io_lock);
+    return EXIT_SUCCESS;
+}
+
+/** @brief Answer the requests whose files the threads have opened
+ *  @param p Pool struct of the server
+ *  @return Void
+ */
+void io_complete(Pool *p) {
+    IoJob *job, *next;
+    uint64_t count;
+    Buff *b;
+
+    if (event_fd < 0 || !FD_ISSET(event_fd, &p->ready_read))
+        return;
+    p->nready--;
+    if (read(event_fd, &count, sizeof(count)) < 0)
+        return;
+
+    pthread_mutex_lock(&io_lock);
+    job = done;
+    done = NULL;
+    pthread_mutex_unlock(&io_lock);
+
+    for (; job; job = next) {
+        next = job->next;
+        pending--;
+        metrics_observe(&metrics.io_wait, metrics_now() - job->queued);
+        PROBE(PR_IO, io_open, "%s, errno %d", job->filename, job->err);
+        if ((b = conntab_get(&p->conns, job->conn)) != NULL)
+            io_answer(p, b, job);
+        else if (job->fd >= 0)
+            close(job->fd);
+        free(job);
+    }
+}
+
+/** @brief Requests waiting on the I/O threads
+ *  @return the count
+ */
+int io_pending() {
+    return pending;
+}
+
+/** @brief Build the response of a request from its opened file
+ *  @param p Pool struct of the server
+ *  @param b Buff struct representing the connection
+ *  @param job the job of its request
+ *  @return Void
+ */
+static void io_answer(Pool *p, Buff *b, IoJob *job) {
+    Requests *req = job->req;
+
+    req->valid = REQ_INVALID;
+    TRACE_PHASE(req, PH_READY);
+    if (job->err) {
+        clienterror(req, b->cold->addr, job->filename,
+                    "404", "Not found",
+                    "Liso couldn't find this file");
+    } else {
+        serve_static(b, req, job->filename, job->sbuf, job->fd);
+    }
+    FD_SET(b->fd, &p->write_set);
+}
+
+/** @brief An I/O thread, runs jobs in the order they were submitted
+ *  @param arg unused
+ *  @return NULL
+ */
+static void *io_worker(void *arg) {
+    uint64_t one = 1;
+    sigset_t mask;
+    IoJob *job;
+
+    /* signals are for the event loop */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while (1) {
+        pthread_mutex_lock(&io_lock);
+        while (todo == NULL)
+            pthread_cond_wait(&io_wake, &io_lock);
+        job = todo;
+        if ((todo = job->next) == NULL)
+            todo_tail = NULL;
+        pthread_mutex_unlock(&io_lock);
+
+        io_open(job);
+
+        pthread_mutex_lock(&io_lock);
+        job->next = done;
+        done = job;
+        pthread_mutex_unlock(&io_lock);
+        if (write(event_fd, &one, sizeof(one)) < 0)
+            fprintf(stderr, "Error waking the event loop for I/O.\n");
+    }
+    return NULL;
+}
+
+/** @brief Stat and open a file, and read it in ahead
+ *  @param job the job, err and fd are set
+ *  @return Void
+ */
+static void io_open(IoJob *job) {
+    if (stat(job->filename, &job->sbuf) < 0) {
+        job->err = errno;
+        return;
+    }
+    /* open() of a fifo would wait for a writer */
+    if (!S_ISREG(job->sbuf.st_mode)) {
+        job->err = EACCES;
+        return;
+    }
+    if (job->head)
+        return;
+    if ((job->fd = open(job->filename, O_RDONLY | O_CLOEXEC)) < 0) {
+        job->err = errno;
+        return;
+    }
+    /* the first quanta go out right away, read them in here, the
+       rest is read ahead while they are sent */
+    readahead(job->fd, 0, IO_PREFAULT);
+}
@@ -0,0 +1,37 @@
+#ifndef IOPOOL_H
+#define IOPOOL_H
+
+#include <sys/stat.h>
+
+#include "mio.h"
+
+
+#define IO_PREFAULT        (1024 * 1024) /* bytes of a file read in ahead */
+
+/** @brief A static file opened by an I/O thread
+ *
+ */
+typedef struct io_job {
+    ConnId conn;          /* the connection, may be gone by completion */
+    Requests *req;        /* its request, valid while conn resolves */
+    int head;             /* HEAD, the file is only stat()ed */
+    int err;              /* errno of stat() or open(), 0 if none */
+    struct stat sbuf;
+    int fd;               /* the file, -1 for HEAD */
+    unsigned long long queued; /* us, when submitted */
+    struct io_job *next;
+    char filename[];
+} IoJob;
+
+
+/* I/O thread package */
+int io_init(Pool *p);
+int io_submit(Pool *p, Buff *b, char *filename);
+void io_complete(Pool *p);
+int io_pending(void);
+
+/* lisod.c */
+void serve_static(Buff *b, Requests *req, char *filename, struct stat sbuf,
+                  int srcfd);
+
+#endif
@@ -0,0 +1,197 @@
+/** @file lag.c
+ *  @brief Event loop lag and stall detection
+ *         The loop tells how long each wakeup kept it busy, and wraps
+ *         every handler it runs in lag_enter() and lag_leave() with the
+ *         function, the connection and its stage. Both times go into
+ *         histograms on the admin port.
+ *
+ *         A handler that runs stall_threshold ms or more is a stall:
+ *         it is written to the error log, traced with the stall probe
+ *         and kept in a ring of the last LAG_RING, served at /stalls.
+ *         A wakeup busy that long with no stalled handler is recorded
+ *         as a stall of "loop", the time went to many small handlers.
+ *
+ *         With stall_watchdog on, a thread looks at the running handler
+ *         every half threshold. Once one has run past the threshold it
+ *         signals the event loop, which writes its own backtrace to the
+ *         error log while it is still stuck. Addresses of static
+ *         functions resolve with addr2line -e lisod.
+ */
+
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <execinfo.h>
+
+#include "lag.h"
+#include "conf.h"
+#include "metrics.h"
+#include "probe.h"
+
+
+#define LAG_SIGNAL    SIGUSR2
+
+Lag lag;
+
+static pthread_t loop_thread;
+static pthread_t watchdog;
+
+static void lag_stall(const char *func, int fd, int stage,
+                      unsigned long long at, unsigned long long us);
+static void *lag_watch(void *arg);
+static void lag_sample(int sig);
+
+
+/** @brief Reset the counters and start the watchdog if configured,
+ *         once the server has become a daemon
+ *  @return Void
+ */
+void lag_init() {
+    struct sigaction sa;
+    void *frames[1];
+
+    memset(&lag, 0, sizeof(lag));
+    if (!conf.stall_watchdog || conf.stall_ms <= 0)
+        return;
+    /* backtrace() loads libgcc on its first call, never do that in
+       the signal handler */
+    backtrace(frames, 1);
+    loop_thread = pthread_self();
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lag_sample;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(LAG_SIGNAL, &sa, NULL);
+    if (pthread_create(&watchdog, NULL, lag_watch, NULL) != 0)
+        fprintf(stderr, "Failed creating stall watchdog.\n");
+}
+
+/** @brief Note that the loop starts a handler
+ *  @param func the handler
+ *  @param fd the connection it serves, -1 if none
+ *  @param stage the stage of the connection
+ *  @return Void
+ */
+void lag_enter(const char *func, int fd, int stage) {
+    lag.func = func;
+    lag.fd = fd;
+    lag.stage = stage;
+    lag.start = metrics_now();
+    __atomic_add_fetch(&lag.seq, 1, __ATOMIC_RELEASE);
+}
+
+/** @brief Note that the handler from lag_enter() returned
+ *  @return Void
+ */
+void lag_leave() {
+    unsigned long long us = metrics_now() - lag.start;
+
+    __atomic_add_fetch(&lag.seq, 1, __ATOMIC_RELEASE);
+    metrics_observe(&metrics.handler, us);
+    if (conf.stall_ms > 0 && us >= conf.stall_ms * 1000ULL)
+        lag_stall(lag.func, lag.fd, lag.stage, lag.start, us);
+    lag.func = NULL;
+}
+
+/** @brief Take the busy time of a wakeup
+ *  @param wake when select() returned, in us
+ *  @param busy_us how long the loop took to get back to select()
+ *  @return Void
+ */
+void lag_wakeup(unsigned long long wake, unsigned long long busy_us) {
+    metrics_observe(&metrics.loop_busy, busy_us);
+    if (conf.stall_ms > 0 && busy_us >= conf.stall_ms * 1000ULL &&
+        lag.stalls == lag.seen)
+        lag_stall("loop", -1, 0, wake, busy_us);
+    lag.seen = lag.stalls;
+}
+
+/** @brief Name of a connection stage
+ *  @param stage STAGE_*
+ *  @return the name, "-" if none
+ */
+const char *lag_stage(int stage) {
+    static const char *names[] = {"muv", "header", "body", "error", "close"};
+
+    if (stage < STAGE_MUV || stage > STAGE_CLOSE)
+        return "-";
+    return names[stage - STAGE_MUV];
+}
+
+/** @brief Record a stall
+ *  @param func the handler
+ *  @param fd its connection
+ *  @param stage the stage of the connection
+ *  @param at when it started, in us
+ *  @param us how long it ran
+ *  @return Void
+ */
+static void lag_stall(const char *func, int fd, int stage,
+                      unsigned long long at, unsigned long long us) {
+    Stall *s = &lag.ring[lag.stalls % LAG_RING];
+    const char *name = lag_stage(stage);
+
+    s->at = at;
+    s->us = us;
+    s->func = func;
+    s->fd = fd;
+    s->stage = stage;
+    lag.stalls++;
+    PROBE(PR_LOOP, stall, "%s, sock %d, %s, %llu us", func, fd, name, us);
+    fprintf(stderr, "Stall of %llu ms in %s, sock %d, stage %s.\n",
+            us / 1000, func, fd, name);
+}
+
+/** @brief The watchdog thread, signals the loop once for each handler
+ *         running past stall_threshold
+ *  @param arg unused
+ *  @return NULL
+ */
+static void *lag_watch(void *arg) {
+    unsigned long long limit = conf.stall_ms * 1000ULL, start;
+    unsigned long seq, sampled = 0;
+    struct timespec nap;
+    const char *func;
+    int fd, stage;
+    sigset_t mask;
+
+    /* signals are for the event loop */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    nap.tv_sec = limit / 2 / 1000000;
+    nap.tv_nsec = limit / 2 % 1000000 * 1000;
+    while (1) {
+        nanosleep(&nap, NULL);
+        seq = __atomic_load_n(&lag.seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1) || seq == sampled)
+            continue;
+        func = lag.func;
+        fd = lag.fd;
+        stage = lag.stage;
+        start = lag.start;
+        /* the handler may have returned while its fields were read */
+        if (__atomic_load_n(&lag.seq, __ATOMIC_ACQUIRE) != seq ||
+            metrics_now() - start < limit)
+            continue;
+        sampled = seq;
+        lag.samples++;
+        fprintf(stderr, "Stall in %s, sock %d, stage %s, running for "
+                        "%llu ms, backtrace:\n", func, fd, lag_stage(stage),
+                (metrics_now() - start) / 1000);
+        pthread_kill(loop_thread, LAG_SIGNAL);
+    }
+    return NULL;
+}
+
+/** @brief Signal handler, on the event loop: write where it is stuck
+ *  @param sig unused
+ *  @return Void
+ */
+static void lag_sample(int sig) {
+    void *frames[LAG_FRAMES];
+    int n;
+
+    n = backtrace(frames, LAG_FRAMES);
+    backtrace_symbols_fd(frames, n, STDERR_FILENO);
+}
@@ -0,0 +1,47 @@
+#ifndef LAG_H
+#define LAG_H
+
+#include <stdlib.h>
+
+
+#define LAG_RING           16    /* last stalls kept for /stalls */
+#define LAG_FRAMES         32    /* frames in a watchdog backtrace */
+
+/** @brief A handler, or a whole wakeup, that kept the loop busy past
+ *         stall_threshold
+ *
+ */
+typedef struct stall {
+    unsigned long long at;  /* us, when it started */
+    unsigned long long us;  /* how long it ran */
+    const char *func;       /* the handler, "loop" for a whole wakeup */
+    int fd;                 /* its connection, -1 if none */
+    int stage;              /* STAGE_* of the connection when it started */
+} Stall;
+
+/** @brief What the event loop is running, and the stalls it had
+ *
+ */
+typedef struct lag {
+    const char *func;       /* handler running, NULL between handlers */
+    int fd;
+    int stage;
+    unsigned long long start;
+    unsigned long seq;      /* odd while a handler runs, for the watchdog */
+    unsigned long stalls;   /* ring[stalls % LAG_RING] is the next one */
+    unsigned long seen;     /* stalls at the last wakeup */
+    unsigned long samples;  /* backtraces taken by the watchdog */
+    Stall ring[LAG_RING];
+} Lag;
+
+extern Lag lag;
+
+
+/* Loop lag package */
+void lag_init(void);
+void lag_enter(const char *func, int fd, int stage);
+void lag_leave(void);
+void lag_wakeup(unsigned long long wake, unsigned long long busy_us);
+const char *lag_stage(int stage);
+
+#endif
@@ -0,0 +1,351 @@
+/** @file liso-bench.c
+ *  @brief Load a web server with a weighted mix of requests
+ *         Closed loop by default, each connection keeps its pipeline
+ *         full. With -r the requests go out at a fixed rate whether or
+ *         not the server keeps up, and latency counts from when each
+ *         was due. A scenario file (-f) sets the mix and the defaults,
+ *         options given after it override them.
+ *
+ *         usage: liso-bench [-c conns] [-t threads] [-d secs] [-n reqs]
+ *                           [-p depth] [-r rate] [-k|-K] [-s] [-m method]
+ *                           [-b body bytes] [-j] [-v] [-f scenario]
+ *                           host:port [uri]
+ *
+ *         Scenario lines, # starts a comment:
+ *             connections <n>      threads <n>     duration <secs>
+ *             requests <n>         depth <n>       rate <req/s>
+ *             keepalive on|off     ssl on|off
+ *             request <weight> <method> <uri> [body bytes]
+ */
+
+#include <pthread.h>
+#include <getopt.h>
+
+#include "loadgen.h"
+
+
+/**************** BEGIN CONSTANTS ***************/
+#define MAX_TEMPLATES   64
+#define MAX_THREADS     64
+#define LINE_SIZE       1024
+
+/**************** END CONSTANTS ***************/
+
+/** @brief A request of the mix, built once
+ *
+ */
+typedef struct template {
+    int weight;
+    char method[32];
+    char *uri;
+    long body;
+    char *data;
+    int len;
+    int head;
+} Template;
+
+/** @brief The workload of one thread
+ *
+ */
+typedef struct workload {
+    unsigned long long rng;
+    long left;                  /* requests still to send, -1 for no limit */
+    pthread_t tid;
+    LgConf conf;
+    LgStats stats;
+} Workload;
+
+static Template templates[MAX_TEMPLATES];
+static int n_templates;
+static int total_weight;
+static char host[256];
+
+static int conns = 10, threads = 1, depth = 1, keepalive = 1, ssl = 0;
+static int json = 0, verbose = 0;
+static double rate = 0, duration = 10;
+static long requests = -1;
+
+static int load_scenario(char *path);
+static int parse_option(int opt, char *arg);
+static int add_template(int weight, char *method, char *uri, long body);
+static void build_template(Template *t);
+static int next_request(void *ctx, LgReq *r);
+static void *run_thread(void *arg);
+
+
+int main(int argc, char *argv[]) {
+    static const char *opts = "c:t:d:n:p:r:kKsm:b:jvf:";
+    struct sockaddr_in addr;
+    Workload *w;
+    LgStats total;
+    char *method = "GET";
+    long body = 0;
+    int opt, i;
+
+    /* the scenario first, so that the options override it */
+    while ((opt = getopt(argc, argv, opts)) != -1)
+        if (opt == 'f' && load_scenario(optarg) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    optind = 1;
+    while ((opt = getopt(argc, argv, opts)) != -1) {
+        if (opt == 'm')
+            method = optarg;
+        else if (opt == 'b')
+            body = atol(optarg);
+        else if (opt == 'f')
+            continue;
+        else if (parse_option(opt, optarg) == EXIT_FAILURE)
+            goto usage;
+    }
+    if (optind >= argc || optind + 2 < argc)
+        goto usage;
+    if (lg_parse_target(argv[optind], &addr) == EXIT_FAILURE) {
+        fprintf(stderr, "Cannot resolve %s.\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    snprintf(host, sizeof(host), "%s", argv[optind]);
+    if (optind + 1 < argc) {
+        n_templates = total_weight = 0;
+        add_template(1, method, argv[optind + 1], body);
+    } else if (n_templates == 0)
+        add_template(1, method, "/", body);
+    if (threads < 1 || threads > MAX_THREADS || conns < threads)
+        goto usage;
+    for (i = 0; i < n_templates; i++)
+        build_template(&templates[i]);
+
+    memset(&total, 0, sizeof(total));
+    w = (Workload *)calloc(threads, sizeof(Workload));
+    for (i = 0; i < threads; i++) {
+        w[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        w[i].left = requests < 0 ? -1 :
+                    requests / threads + (i < requests % threads);
+        w[i].conf.addr = addr;
+        if (ssl && (w[i].conf.ssl = lg_ssl_init()) == NULL) {
+            fprintf(stderr, "Error initializing SSL.\n");
+            return EXIT_FAILURE;
+        }
+        w[i].conf.conns = conns / threads + (i < conns % threads);
+        w[i].conf.depth = depth;
+        w[i].conf.keepalive = keepalive;
+        w[i].conf.mode = rate > 0 ? LG_RATE : LG_CLOSED;
+        w[i].conf.rate = rate / threads;
+        w[i].conf.duration = requests < 0 ? duration * 1e6 : 0;
+        w[i].conf.verbose = verbose;
+        w[i].conf.next = next_request;
+        w[i].conf.ctx = &w[i];
+        pthread_create(&w[i].tid, NULL, run_thread, &w[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(w[i].tid, NULL);
+        lg_merge(&total, &w[i].stats);
+    }
+    lg_report(stdout, &total, json);
+    return total.conn_errors || total.io_errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+    fprintf(stderr, "usage: %s [-c conns] [-t threads] [-d secs] [-n reqs] "
+                    "[-p depth] [-r rate] [-k|-K] [-s] [-m method] "
+                    "[-b body bytes] [-j] [-v] [-f scenario] host:port [uri]\n",
+            argv[0]);
+    return EXIT_FAILURE;
+}
+
+/** @brief Read a scenario file
+ *  @param path the file
+ *  @return EXIT_FAILURE on fail
+ *  @return EXIT_SUCCESS on success
+ */
+static int load_scenario(char *path) {
+    FILE *fp;
+    char line[LINE_SIZE], key[64], arg[LINE_SIZE], method[32], uri[LINE_SIZE];
+    int lineno = 0, n, weight;
+    long body;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Error opening %s.\n", path);
+        return EXIT_FAILURE;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        if (strchr(line, '#'))
+            *strchr(line, '#') = '\0';
+        if (sscanf(line, "%63s %1023s", key, arg) < 1)
+            continue;
+        if (!strcmp(key, "request")) {
+            body = 0;
+            n = sscanf(line, "%*s %d %31s %1023s %ld", &weight, method, uri,
+                       &body);
+            if (n < 3 || weight < 1 ||
+                add_template(weight, method, uri, body) == EXIT_FAILURE)
+                goto bad;
+            continue;
+        }
+        if (!strcmp(key, "connections"))
+            n = 'c';
+        else if (!strcmp(key, "threads"))
+            n = 't';
+        else if (!strcmp(key, "duration"))
+            n = 'd';
+        else if (!strcmp(key, "requests"))
+            n = 'n';
+        else if (!strcmp(key, "depth"))
+            n = 'p';
+        else if (!strcmp(key, "rate"))
+            n = 'r';
+        else if (!strcmp(key, "keepalive"))
+            n = strcmp(arg, "off") ? 'k' : 'K';
+        else if (!strcmp(key, "ssl"))
+            n = 's';
+        else
+            goto bad;
+        if (n == 's')
+            ssl = strcmp(arg, "off") != 0;
+        else if (parse_option(n, arg) == EXIT_FAILURE)
+            goto bad;
+    }
+    fclose(fp);
+    return EXIT_SUCCESS;
+
+bad:
+    fprintf(stderr, "%s:%d: bad line\n", path, lineno);
+    fclose(fp);
+    return EXIT_FAILURE;
+}
+
+/** @brief Apply an option shared by the command line and scenarios
+ *  @param opt the option letter
+ *  @param arg its argument
+ *  @return EXIT_FAILURE on fail
+ *  @return EXIT_SUCCESS on success
+ */
+static int parse_option(int opt, char *arg) {
+    switch (opt) {
+    case 'c':
+        conns = atoi(arg);
+        break;
+    case 't':
+        threads = atoi(arg);
+        break;
+    case 'd':
+        duration = atof(arg);
+        break;
+    case 'n':
+        requests = atol(arg);
+        break;
+    case 'p':
+        depth = atoi(arg);
+        break;
+    case 'r':
+        rate = atof(arg);
+        break;
+    case 'k':
+        keepalive = 1;
+        break;
+    case 'K':
+        keepalive = 0;
+        break;
+    case 's':
+        ssl = 1;
+        break;
+    case 'j':
+        json = 1;
+        break;
+    case 'v':
+        verbose = 1;
+        break;
+    default:
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/** @brief Add a request to the mix
+ *  @param weight how often it is picked relative to the others
+ *  @param method the method
+ *  @param uri the uri
+ *  @param body bytes of body to send
+ *  @return EXIT_FAILURE on fail
+ *  @return EXIT_SUCCESS on success
+ */
+static int add_template(int weight, char *method, char *uri, long body) {
+    Template *t;
+
+    if (n_templates == MAX_TEMPLATES || body < 0)
+        return EXIT_FAILURE;
+    t = &templates[n_templates++];
+    t->weight = weight;
+    snprintf(t->method, sizeof(t->method), "%s", method);
+    t->uri = strdup(uri);
+    t->body = body;
+    total_weight += weight;
+    return EXIT_SUCCESS;
+}
+
+/** @brief Build the bytes of a request once, the threads share them
+ *  @param t the request
+ *  @return Void
+ */
+static void build_template(Template *t) {
+    char hdr[LINE_SIZE * 2];
+    int len;
+
+    t->head = !strcmp(t->method, "HEAD");
+    len = snprintf(hdr, sizeof(hdr), "%s %s HTTP/1.1\r\n"
+                                     "Host: %s\r\n"
+                                     "User-Agent: liso-bench\r\n",
+                   t->method, t->uri, host);
+    if (t->body > 0 || !strcmp(t->method, "POST"))
+        len += snprintf(hdr + len, sizeof(hdr) - len,
+                        "Content-Length: %ld\r\n", t->body);
+    if (!keepalive)
+        len += snprintf(hdr + len, sizeof(hdr) - len, "Connection: close\r\n");
+    len += snprintf(hdr + len, sizeof(hdr) - len, "\r\n");
+    t->data = (char *)malloc(len + t->body);
+    memcpy(t->data, hdr, len);
+    memset(t->data + len, 'x', t->body);
+    t->len = len + t->body;
+}
+
+/** @brief Pick the next request of a thread
+ *  @param ctx the workload of the thread
+ *  @param r where to put it
+ *  @return 0 when there are no more
+ */
+static int next_request(void *ctx, LgReq *r) {
+    Workload *w = (Workload *)ctx;
+    unsigned long long x;
+    int i, pick;
+
+    if (w->left == 0)
+        return 0;
+    if (w->left > 0)
+        w->left--;
+    /* xorshift64 */
+    x = w->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    w->rng = x;
+    pick = x % total_weight;
+    for (i = 0; pick >= templates[i].weight; i++)
+        pick -= templates[i].weight;
+    r->data = templates[i].data;
+    r->len = templates[i].len;
+    r->head = templates[i].head;
+    r->at = 0;
+    r->expect_status = 0;
+    r->expect_size = -1;
+    return 1;
+}
+
+/** @brief Thread body
+ *  @param arg the workload of the thread
+ *  @return NULL
+ */
+static void *run_thread(void *arg) {
+    Workload *w = (Workload *)arg;
+
+    lg_run(&w->conf, &w->stats);
+    return NULL;
+}
@@ -0,0 +1,193 @@
+/** @file liso-idle.c
+ *  @brief Measure what an idle keep-alive connection costs a server
+ *         Opens connections one at a time, sends each one request and
+ *         reads the response, then leaves them all open and idle. The
+ *         resident set of the server process is read from /proc before
+ *         and after, so the server has to run on the same host.
+ *
+ *         usage: liso-idle [-n conns] [-s] [-u uri] [-w secs] [-j]
+ *                          -p pid host:port
+ */
+
+#define _GNU_SOURCE  /* strcasestr() */
+
+#include <getopt.h>
+
+#include "loadgen.h"
+
+
+/**************** BEGIN CONSTANTS ***************/
+#define LINE_SIZE       256
+#define RESP_SIZE       65536
+
+/**************** END CONSTANTS ***************/
+
+static long rss_kb(int pid);
+static int open_idle(struct sockaddr_in *addr, SSL_CTX *ctx, char *req,
+                     int len, SSL **ssl);
+
+
+int main(int argc, char *argv[]) {
+    int conns = 1000, pid = 0, json = 0, wait = 1, opt, i, fd, len, opened = 0;
+    char *uri = "/", req[LINE_SIZE * 2];
+    long before, after;
+    struct sockaddr_in addr;
+    SSL_CTX *ctx = NULL;
+    SSL **ssl;
+    int *fds;
+
+    while ((opt = getopt(argc, argv, "n:su:w:jp:")) != -1) {
+        switch (opt) {
+        case 'n':
+            conns = atoi(optarg);
+            break;
+        case 's':
+            if ((ctx = lg_ssl_init()) == NULL) {
+                fprintf(stderr, "Error initializing SSL.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'u':
+            uri = optarg;
+            break;
+        case 'w':
+            wait = atoi(optarg);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'p':
+            pid = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind + 1 != argc || pid <= 0 || conns < 1)
+        goto usage;
+    if (lg_parse_target(argv[optind], &addr) == EXIT_FAILURE) {
+        fprintf(stderr, "Cannot resolve %s.\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if ((before = rss_kb(pid)) < 0) {
+        fprintf(stderr, "Cannot read the resident set of %d.\n", pid);
+        return EXIT_FAILURE;
+    }
+    len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\n"
+                                     "Host: %s\r\n"
+                                     "User-Agent: liso-idle\r\n\r\n",
+                   uri, argv[optind]);
+
+    fds = (int *)malloc(conns * sizeof(int));
+    ssl = (SSL **)calloc(conns, sizeof(SSL *));
+    for (i = 0; i < conns; i++) {
+        if ((fd = open_idle(&addr, ctx, req, len, &ssl[opened])) < 0)
+            continue;
+        fds[opened++] = fd;
+    }
+    sleep(wait);
+    after = rss_kb(pid);
+
+    if (json)
+        printf("{\"connections\":%d,\"failed\":%d,\"rss_before_kb\":%ld,"
+               "\"rss_after_kb\":%ld,\"bytes_per_connection\":%.0f}\n",
+               opened, conns - opened, before, after,
+               opened ? (after - before) * 1024.0 / opened : 0);
+    else
+        printf("idle         %d connections open, %d failed\n"
+               "rss          %ld kB before, %ld kB after\n"
+               "per conn     %.0f bytes\n",
+               opened, conns - opened, before, after,
+               opened ? (after - before) * 1024.0 / opened : 0);
+
+    for (i = 0; i < opened; i++) {
+        if (ssl[i])
+            SSL_free(ssl[i]);
+        close(fds[i]);
+    }
+    return opened == conns ? EXIT_SUCCESS : EXIT_FAILURE;
+
+usage:
+    fprintf(stderr, "usage: %s [-n conns] [-s] [-u uri] [-w secs] [-j] "
+                    "-p pid host:port\n", argv[0]);
+    return EXIT_FAILURE;
+}
+
+/** @brief Read the resident set size of a process
+ *  @param pid the process
+ *  @return the size in kB, -1 on fail
+ */
+static long rss_kb(int pid) {
+    char path[64], line[LINE_SIZE];
+    long kb = -1;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    fclose(fp);
+    return kb;
+}
+
+/** @brief Open a connection, make one request on it and read the
+ *         response, leaving the connection open
+ *  @param addr the server
+ *  @param ctx SSL context, NULL for plain http
+ *  @param req the request
+ *  @param len its length
+ *  @param ssl where to put the SSL of the connection
+ *  @return the socket, -1 on fail
+ */
+static int open_idle(struct sockaddr_in *addr, SSL_CTX *ctx, char *req,
+                     int len, SSL **ssl) {
+    char resp[RESP_SIZE], *end, *cl;
+    long got = 0, want = -1;
+    int fd, n;
+
+    *ssl = NULL;
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0)
+        goto fail;
+    if (ctx) {
+        if ((*ssl = SSL_new(ctx)) == NULL || SSL_set_fd(*ssl, fd) == 0 ||
+            SSL_connect(*ssl) <= 0)
+            goto fail;
+        n = SSL_write(*ssl, req, len);
+    } else
+        n = send(fd, req, len, 0);
+    if (n != len)
+        goto fail;
+
+    /* headers, then as much body as Content-Length says */
+    while (want < 0 || got < want) {
+        n = ctx ? SSL_read(*ssl, resp + got, sizeof(resp) - got - 1)
+                : recv(fd, resp + got, sizeof(resp) - got - 1, 0);
+        if (n <= 0)
+            goto fail;
+        got += n;
+        resp[got] = '\0';
+        if (want < 0 && (end = strstr(resp, "\r\n\r\n")) != NULL) {
+            cl = strcasestr(resp, "\r\nContent-Length:");
+            want = end + 4 - resp + (cl && cl < end ? atol(cl + 17) : 0);
+        }
+        /* a body bigger than resp is read and dropped */
+        if (got == sizeof(resp) - 1) {
+            if (want < 0)
+                goto fail;
+            want -= got;
+            got = 0;
+        }
+    }
+    return fd;
+
+fail:
+    if (*ssl)
+        SSL_free(*ssl);
+    *ssl = NULL;
+    close(fd);
+    return -1;
+}
@@ -0,0 +1,347 @@
+/** @file liso-logcat.c
+ *  @brief Decode the binary lisod access log
+ *         Prints the records in the text log format, or with -s
+ *         aggregate stats over the whole file. The file is mapped
+ *         rather than read, so large logs are scanned at memory speed.
+ *
+ *         usage: liso-logcat [-s] <log file>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "loglib.h"
+
+
+/**************** BEGIN CONSTANTS ***************/
+#define URI_BUCKETS     65536
+#define TOP_URIS        10
+#define MAX_STATUS      600
+
+/**************** END CONSTANTS ***************/
+
+/** @brief A decoded record, strings point into the mapped file
+ *
+ */
+typedef struct record {
+    int type;
+    unsigned long long ms;
+    unsigned char addr[4];
+    const char *method;
+    int method_len;
+    const char *version;
+    int version_len;
+    unsigned long status;
+    unsigned long long size;
+    const char *str;       /* uri, or the text of a text record */
+    int str_len;
+} Record;
+
+/** @brief Requests seen for one uri
+ *
+ */
+typedef struct uri_count {
+    const char *uri;
+    int len;
+    unsigned long count;
+    struct uri_count *next;
+} UriCount;
+
+static const char *methods[] = LOG_METHODS;
+static const char *versions[] = LOG_VERSIONS;
+
+static const unsigned char *decode(const unsigned char *p,
+                                   const unsigned char *end, Record *rec);
+static const unsigned char *get_varint(const unsigned char *p,
+                                       const unsigned char *end,
+                                       unsigned long long *v);
+static const unsigned char *get_string(const unsigned char *p,
+                                       const unsigned char *end,
+                                       const char **s, int *len);
+static const unsigned char *get_code(const unsigned char *p,
+                                     const unsigned char *end,
+                                     const char **table,
+                                     const char **s, int *len);
+static void print_record(Record *rec);
+static void stats(const unsigned char *p, const unsigned char *end);
+
+
+int main(int argc, char *argv[]) {
+    int fd, show_stats = 0;
+    struct stat st;
+    const unsigned char *map, *p, *end;
+    Record rec;
+
+    if (argc == 3 && !strcmp(argv[1], "-s"))
+        show_stats = 1;
+    else if (argc != 2) {
+        fprintf(stderr, "usage: %s [-s] <log file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if ((fd = open(argv[argc - 1], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error opening %s.\n", argv[argc - 1]);
+        return EXIT_FAILURE;
+    }
+    if (st.st_size < LOG_MAGIC_LEN) {
+        fprintf(stderr, "%s is not a binary lisod log.\n", argv[argc - 1]);
+        return EXIT_FAILURE;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping %s.\n", argv[argc - 1]);
+        return EXIT_FAILURE;
+    }
+    if (memcmp(map, LOG_MAGIC, LOG_MAGIC_LEN)) {
+        fprintf(stderr, "%s is not a binary lisod log.\n", argv[argc - 1]);
+        return EXIT_FAILURE;
+    }
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+    p = map + LOG_MAGIC_LEN;
+    end = map + st.st_size;
+
+    if (show_stats) {
+        stats(p, end);
+        return EXIT_SUCCESS;
+    }
+    while (p < end) {
+        if ((p = decode(p, end, &rec)) == NULL) {
+            fprintf(stderr, "Truncated or corrupt record.\n");
+            return EXIT_FAILURE;
+        }
+        print_record(&rec);
+    }
+    return EXIT_SUCCESS;
+}
+
+/** @brief Decode one record
+ *  @param p start of the record
+ *  @param end end of the file
+ *  @param rec where to put the fields
+ *  @return start of the next record, NULL if malformed
+ */
+static const unsigned char *decode(const unsigned char *p,
+                                   const unsigned char *end, Record *rec) {
+    unsigned long long v;
+
+    rec->type = *p++;
+    if (rec->type == LOG_REC_TEXT)
+        return get_string(p, end, &rec->str, &rec->str_len);
+    if (rec->type != LOG_REC_ACCESS)
+        return NULL;
+
+    if ((p = get_varint(p, end, &rec->ms)) == NULL || end - p < 4)
+        return NULL;
+    memcpy(rec->addr, p, 4);
+    p += 4;
+    if ((p = get_code(p, end, methods, &rec->method,
+                      &rec->method_len)) == NULL ||
+        (p = get_code(p, end, versions, &rec->version,
+                      &rec->version_len)) == NULL ||
+        (p = get_varint(p, end, &v)) == NULL)
+        return NULL;
+    rec->status = v;
+    if ((p = get_varint(p, end, &rec->size)) == NULL)
+        return NULL;
+    return get_string(p, end, &rec->str, &rec->str_len);
+}
+
+/** @brief Decode an unsigned LEB128 varint
+ *  @param p start of the varint
+ *  @param end end of the file
+ *  @param v where to put the value
+ *  @return the byte after it, NULL if truncated
+ */
+static const unsigned char *get_varint(const unsigned char *p,
+                                       const unsigned char *end,
+                                       unsigned long long *v) {
+    int shift = 0;
+
+    *v = 0;
+    while (p < end && shift < 64) {
+        *v |= (unsigned long long)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+            return p;
+        shift += 7;
+    }
+    return NULL;
+}
+
+/** @brief Decode a string
+ *  @param p start of the string
+ *  @param end end of the file
+ *  @param s where to put its start
+ *  @param len where to put its length
+ *  @return the byte after it, NULL if truncated
+ */
+static const unsigned char *get_string(const unsigned char *p,
+                                       const unsigned char *end,
+                                       const char **s, int *len) {
+    unsigned long long v;
+
+    if ((p = get_varint(p, end, &v)) == NULL || v > (unsigned)(end - p))
+        return NULL;
+    *s = (const char *)p;
+    *len = v;
+    return p + v;
+}
+
+/** @brief Decode an interned string code
+ *  @param p start of the code
+ *  @param end end of the file
+ *  @param table the interned strings
+ *  @param s where to put the string
+ *  @param len where to put its length
+ *  @return the byte after it, NULL if malformed
+ */
+static const unsigned char *get_code(const unsigned char *p,
+                                     const unsigned char *end,
+                                     const char **table,
+                                     const char **s, int *len) {
+    int i, code;
+
+    if (p >= end)
+        return NULL;
+    if ((code = *p++) == 0)
+        return get_string(p, end, s, len);
+    for (i = 1; table[i] && i < code; i++)
+        ;
+    if (table[i] == NULL)
+        return NULL;
+    *s = table[i];
+    *len = strlen(table[i]);
+    return p;
+}
+
+/** @brief Print a record as lisod writes it in the text format
+ *  @param rec the record
+ *  @return Void
+ */
+static void print_record(Record *rec) {
+    static time_t last = -1;
+    static char date[LOG_DATE_SIZE];
+    char addr[INET_ADDRSTRLEN];
+    time_t t;
+
+    if (rec->type == LOG_REC_TEXT) {
+        fwrite(rec->str, 1, rec->str_len, stdout);
+        return;
+    }
+    /* many records share a second */
+    t = rec->ms / 1000;
+    if (t != last) {
+        strftime(date, LOG_DATE_SIZE, LOG_DATE_FORMAT, localtime(&t));
+        last = t;
+    }
+    inet_ntop(AF_INET, rec->addr, addr, INET_ADDRSTRLEN);
+    printf("%s [%s] \"%.*s %.*s %.*s\" %lu %llu\n", addr, date,
+           rec->method_len, rec->method, rec->str_len, rec->str,
+           rec->version_len, rec->version, rec->status, rec->size);
+}
+
+/** @brief Print aggregate stats over all records
+ *  @param p first record
+ *  @param end end of the file
+ *  @return Void
+ */
+static void stats(const unsigned char *p, const unsigned char *end) {
+    Record rec;
+    unsigned long requests = 0, texts = 0;
+    unsigned long status[MAX_STATUS] = {0}, other_status = 0;
+    unsigned long method_count[16] = {0}, other_method = 0;
+    unsigned long long bytes = 0, first = 0, last = 0;
+    UriCount **buckets, *u, *top[TOP_URIS];
+    unsigned long h;
+    int i, j;
+    double span;
+
+    buckets = (UriCount **)calloc(URI_BUCKETS, sizeof(UriCount *));
+    while (p < end) {
+        if ((p = decode(p, end, &rec)) == NULL) {
+            fprintf(stderr, "Truncated or corrupt record, stats so far:\n");
+            break;
+        }
+        if (rec.type == LOG_REC_TEXT) {
+            texts++;
+            continue;
+        }
+        requests++;
+        bytes += rec.size;
+        if (first == 0 || rec.ms < first)
+            first = rec.ms;
+        if (rec.ms > last)
+            last = rec.ms;
+        if (rec.status < MAX_STATUS)
+            status[rec.status]++;
+        else
+            other_status++;
+        for (i = 1; methods[i]; i++)
+            if (rec.method == methods[i])
+                break;
+        if (methods[i])
+            method_count[i]++;
+        else
+            other_method++;
+
+        /* FNV-1a */
+        for (h = 2166136261u, i = 0; i < rec.str_len; i++)
+            h = (h ^ (unsigned char)rec.str[i]) * 16777619u;
+        for (u = buckets[h % URI_BUCKETS]; u; u = u->next)
+            if (u->len == rec.str_len && !memcmp(u->uri, rec.str, u->len))
+                break;
+        if (u == NULL) {
+            u = (UriCount *)calloc(1, sizeof(UriCount));
+            u->uri = rec.str;
+            u->len = rec.str_len;
+            u->next = buckets[h % URI_BUCKETS];
+            buckets[h % URI_BUCKETS] = u;
+        }
+        u->count++;
+    }
+
+    span = (last - first) / 1000.0;
+    printf("requests      %lu\n", requests);
+    printf("messages      %lu\n", texts);
+    printf("bytes         %llu\n", bytes);
+    printf("span          %.3f s\n", span);
+    if (span > 0)
+        printf("rate          %.1f req/s\n", requests / span);
+
+    printf("\nstatus\n");
+    for (i = 0; i < MAX_STATUS; i++)
+        if (status[i])
+            printf("  %3d         %lu\n", i, status[i]);
+    if (other_status)
+        printf("  other       %lu\n", other_status);
+
+    printf("\nmethod\n");
+    for (i = 1; methods[i]; i++)
+        if (method_count[i])
+            printf("  %-11s %lu\n", methods[i], method_count[i]);
+    if (other_method)
+        printf("  other       %lu\n", other_method);
+
+    memset(top, 0, sizeof(top));
+    for (h = 0; h < URI_BUCKETS; h++)
+        for (u = buckets[h]; u; u = u->next) {
+            for (i = 0; i < TOP_URIS && top[i] && top[i]->count >= u->count;
+                 i++)
+                ;
+            if (i == TOP_URIS)
+                continue;
+            for (j = TOP_URIS - 1; j > i; j--)
+                top[j] = top[j - 1];
+            top[i] = u;
+        }
+    printf("\ntop uris\n");
+    for (i = 0; i < TOP_URIS && top[i]; i++)
+        printf("  %-10lu  %.*s\n", top[i]->count, top[i]->len, top[i]->uri);
+}
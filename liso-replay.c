@@ -0,0 +1,302 @@
+/** @file liso-replay.c
+ *  @brief Replay a lisod access log against a server
+ *         Every access record of the text log is sent again with its
+ *         method, uri and version. By default each request goes out at
+ *         its original offset from the first one. The log only keeps
+ *         whole seconds, so the requests of a second are spread evenly
+ *         across it. -x speeds the replay up or slows it down, -r
+ *         flattens it to a fixed rate, and -r 0 sends as fast as the
+ *         connections allow. Responses whose status differs from the
+ *         logged one, or whose size (headers included, as logged) is
+ *         off by more than -z bytes, are counted as mismatches and with
+ *         -v printed.
+ *
+ *         A binary log is replayed through liso-logcat:
+ *             liso-logcat log | liso-replay - host:port
+ *
+ *         usage: liso-replay [-c conns] [-t threads] [-p depth] [-x speed]
+ *                            [-r rate] [-z slack] [-K] [-s] [-j] [-v]
+ *                            <log file|-> host:port
+ */
+
+#define _XOPEN_SOURCE 700  /* strptime() */
+#define _DEFAULT_SOURCE    /* timegm() */
+
+#include <pthread.h>
+#include <time.h>
+#include <ctype.h>
+
+#include "loadgen.h"
+
+
+/**************** BEGIN CONSTANTS ***************/
+#define LINE_SIZE       8192
+#define MAX_THREADS     64
+#define SIZE_SLACK      16   /* Keep-Alive vs Close, a Date of another day */
+
+/**************** END CONSTANTS ***************/
+
+/** @brief A request of the log
+ *
+ */
+typedef struct entry {
+    time_t t;                   /* second it was logged in */
+    char *data;
+    int len;
+    int head;
+    int status;
+    long size;
+} Entry;
+
+/** @brief The share of the log one thread replays
+ *
+ */
+typedef struct replayer {
+    Entry **entries;
+    long n;
+    long next;
+    pthread_t tid;
+    LgConf conf;
+    LgStats stats;
+} Replayer;
+
+static Entry *entries;
+static long n_entries;
+static char host[256];
+
+static int parse_line(char *line, Entry *e);
+static void schedule(double speed);
+static int next_request(void *ctx, LgReq *r);
+static void *run_thread(void *arg);
+
+/* offset from the first request in us, filled by schedule() */
+static unsigned long long *offsets;
+
+
+int main(int argc, char *argv[]) {
+    int conns = 10, threads = 1, depth = 1, keepalive = 1, ssl = 0;
+    int json = 0, verbose = 0, opt, i;
+    long slack = SIZE_SLACK, j, size = 0, skipped = 0;
+    double speed = 1, rate = -1;
+    char line[LINE_SIZE];
+    struct sockaddr_in addr;
+    Replayer *w;
+    LgStats total;
+    FILE *fp;
+
+    while ((opt = getopt(argc, argv, "c:t:p:x:r:z:Ksjv")) != -1) {
+        switch (opt) {
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'p':
+            depth = atoi(optarg);
+            break;
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'z':
+            slack = atol(optarg);
+            break;
+        case 'K':
+            keepalive = 0;
+            break;
+        case 's':
+            ssl = 1;
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind + 2 != argc || threads < 1 || threads > MAX_THREADS ||
+        conns < threads || speed <= 0)
+        goto usage;
+    if (lg_parse_target(argv[optind + 1], &addr) == EXIT_FAILURE) {
+        fprintf(stderr, "Cannot resolve %s.\n", argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
+    snprintf(host, sizeof(host), "%s", argv[optind + 1]);
+
+    if (!strcmp(argv[optind], "-"))
+        fp = stdin;
+    else if ((fp = fopen(argv[optind], "r")) == NULL) {
+        fprintf(stderr, "Error opening %s.\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (fgets(line, sizeof(line), fp) && !strncmp(line, "LISOBLG1", 8)) {
+        fprintf(stderr, "%s is a binary log, replay the output of "
+                        "liso-logcat instead.\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    do {
+        if (n_entries == size) {
+            size = size ? size * 2 : 1024;
+            entries = (Entry *)realloc(entries, size * sizeof(Entry));
+        }
+        if (parse_line(line, &entries[n_entries]) == EXIT_SUCCESS)
+            n_entries++;
+        else
+            skipped++;
+    } while (fgets(line, sizeof(line), fp));
+    if (fp != stdin)
+        fclose(fp);
+    if (n_entries == 0) {
+        fprintf(stderr, "No access records in %s.\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (verbose)
+        fprintf(stderr, "%ld requests, %ld other lines skipped\n",
+                n_entries, skipped);
+    schedule(speed);
+
+    /* deal the requests out in turn so that each thread keeps log order */
+    memset(&total, 0, sizeof(total));
+    w = (Replayer *)calloc(threads, sizeof(Replayer));
+    for (i = 0; i < threads; i++) {
+        w[i].entries = (Entry **)malloc((n_entries / threads + 1) *
+                                        sizeof(Entry *));
+        for (j = i; j < n_entries; j += threads)
+            w[i].entries[w[i].n++] = &entries[j];
+        w[i].conf.addr = addr;
+        if (ssl && (w[i].conf.ssl = lg_ssl_init()) == NULL) {
+            fprintf(stderr, "Error initializing SSL.\n");
+            return EXIT_FAILURE;
+        }
+        w[i].conf.conns = conns / threads + (i < conns % threads);
+        w[i].conf.depth = depth;
+        w[i].conf.keepalive = keepalive;
+        w[i].conf.mode = rate < 0 ? LG_TIMED : rate > 0 ? LG_RATE : LG_CLOSED;
+        w[i].conf.rate = rate / threads;
+        w[i].conf.verbose = verbose;
+        w[i].conf.size_slack = slack;
+        w[i].conf.next = next_request;
+        w[i].conf.ctx = &w[i];
+        pthread_create(&w[i].tid, NULL, run_thread, &w[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(w[i].tid, NULL);
+        lg_merge(&total, &w[i].stats);
+    }
+    lg_report(stdout, &total, json);
+    return total.mismatches || total.conn_errors || total.io_errors ?
+           EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+    fprintf(stderr, "usage: %s [-c conns] [-t threads] [-p depth] "
+                    "[-x speed] [-r rate] [-z slack] [-K] [-s] [-j] [-v] "
+                    "<log file|-> host:port\n", argv[0]);
+    return EXIT_FAILURE;
+}
+
+/** @brief Parse an access record and build its request
+ *         Records look like
+ *             addr [date] "method uri version" status size
+ *         and may follow other text on the same line
+ *  @param line the line
+ *  @param e where to put it
+ *  @return EXIT_FAILURE if the line is not an access record
+ *  @return EXIT_SUCCESS on success
+ */
+static int parse_line(char *line, Entry *e) {
+    char method[32], uri[LINE_SIZE], version[32], req[LINE_SIZE + 256];
+    char *quote, *date, *end, *p;
+    struct tm tm;
+
+    if ((quote = strchr(line, '"')) == NULL)
+        return EXIT_FAILURE;
+    for (date = quote; date > line && *date != '['; date--)
+        ;
+    if (*date != '[' || (end = strchr(date, ']')) == NULL || end > quote)
+        return EXIT_FAILURE;
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(date + 1, "%a, %d %b %Y %T", &tm) == NULL)
+        return EXIT_FAILURE;
+    if ((end = strchr(quote + 1, '"')) == NULL)
+        return EXIT_FAILURE;
+    *end = '\0';
+    if (sscanf(quote + 1, "%31s %8191s %31s", method, uri, version) != 3 ||
+        sscanf(end + 1, "%d %ld", &e->status, &e->size) != 2)
+        return EXIT_FAILURE;
+    for (p = method; *p; p++)
+        if (!isupper((unsigned char)*p))
+            return EXIT_FAILURE;
+
+    e->t = timegm(&tm);
+    e->head = !strcmp(method, "HEAD");
+    e->len = snprintf(req, sizeof(req), "%s %s %s\r\n"
+                                        "Host: %s\r\n"
+                                        "User-Agent: liso-replay\r\n%s\r\n",
+                      method, uri, version, host,
+                      strcmp(method, "POST") ? "" : "Content-Length: 0\r\n");
+    e->data = strdup(req);
+    return EXIT_SUCCESS;
+}
+
+/** @brief Work out when each request is sent
+ *         The requests of one logged second are spread across it
+ *  @param speed how many times faster than logged
+ *  @return Void
+ */
+static void schedule(double speed) {
+    long i, j, k;
+    time_t t0 = entries[0].t;
+    double second;
+
+    offsets = (unsigned long long *)malloc(n_entries * sizeof(*offsets));
+    for (i = 0; i < n_entries; i = j) {
+        for (j = i; j < n_entries && entries[j].t == entries[i].t; j++)
+            ;
+        for (k = i; k < j; k++) {
+            /* a clock step back in the log does not go back in time */
+            second = entries[i].t > t0 ? entries[i].t - t0 : 0;
+            second += (double)(k - i) / (j - i);
+            offsets[k] = (unsigned long long)(second * 1e6 / speed);
+            if (k > 0 && offsets[k] < offsets[k - 1])
+                offsets[k] = offsets[k - 1];
+        }
+    }
+}
+
+/** @brief Hand the next request of a thread to the engine
+ *  @param ctx the replayer of the thread
+ *  @param r where to put it
+ *  @return 0 when there are no more
+ */
+static int next_request(void *ctx, LgReq *r) {
+    Replayer *w = (Replayer *)ctx;
+    Entry *e;
+
+    if (w->next == w->n)
+        return 0;
+    e = w->entries[w->next++];
+    r->data = e->data;
+    r->len = e->len;
+    r->head = e->head;
+    r->at = offsets[e - entries];
+    r->expect_status = e->status;
+    r->expect_size = e->size;
+    return 1;
+}
+
+/** @brief Thread body
+ *  @param arg the replayer of the thread
+ *  @return NULL
+ */
+static void *run_thread(void *arg) {
+    Replayer *w = (Replayer *)arg;
+
+    lg_run(&w->conf, &w->stats);
+    return NULL;
+}
@@ -16,20 +16,35 @@
 #include <signal.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 #include <arpa/inet.h>
 #include <openssl/ssl.h>
 
 #include "mio.h"
+#include "conntab.h"
 #include "loglib.h"
 #include "cgi.h"
+#include "conf.h"
+#include "upstream.h"
+#include "metrics.h"
+#include "reqtrace.h"
+#include "probe.h"
+#include "overload.h"
+#include "ratelimit.h"
+#include "lag.h"
+#include "iopool.h"
+#include "stream.h"
+#include "route.h"
 
 #define BUF_SIZE      8192   /* Initial buff size */
 #define MAX_SIZE_HEADER 8192 /* Max length of size info for the incomming msg */
 #define ARG_NUMBER    8    /* The number of argument lisod takes*/
 #define LISTENQ       1024   /* second argument to listen() */
-#define VERBOSE       0 /* Whether to print out debug infomations */
 #define DATE_SIZE     35 /* The max length for date string */
 #define FILETYPE_SIZE 15 /* The max length for file type */
+#define RETRY_SIZE    32 /* The max length for a Retry-After header */
+#define INDEX_SIZE    sizeof("index.html")
+#define CAUSE_SIZE    256 /* The most of a uri or file echoed in an error */
 #define DEAMON        1 /* Wether to do daemon */
 #define AB            1  /* Wether to check http/1.1*/
 
@@ -39,36 +54,50 @@ int open_listen_socket(int port);
 void init_pool(int listen_sock, int ssl_sock, Pool *p);
 void add_client(int conn_sock, Pool *p,
                 struct sockaddr_in *cli_addr, int port);
-void add_client_ssl(SSL *client_context, int conn_sock, Pool *p,
+Buff *add_client_ssl(SSL *client_context, int conn_sock, Pool *p,
                     struct sockaddr_in *cli_addr, int port);
 void serve_clients(Pool *p);
+static void serve_client(Pool *p, Buff *bufi);
+static void header_too_large(Pool *p, Buff *bufi);
+static int rate_limited(Buff *bufi, Requests *req);
 void server_send(Pool *p);
+static int write_first(Buff *bufi);
+static off_t req_size(Requests *req);
+static void write_conn(Pool *p, Buff *bufi);
+void evict_idle(Pool *p);
+static int conn_idle(Buff *b);
+static int admit(Pool *p);
 void clean_state(Pool *p, int listen_sock, int ssl_sock);
 
 void free_buf(Pool *p, Buff *bufi);
 void clienterror(Requests *req, char *addr, char *cause,
                  char *errnum, char *shortmsg, char *longmsg);
+void clienterror_hdr(Requests *req, char *addr, char *cause,
+                     char *errnum, char *shortmsg, char *longmsg,
+                     char *extra_hdr);
+int read_requestline(Buff *b, Requests *req);
 int read_requesthdrs(Buff *b, Requests *req);
 void get_time(char *date);
 Requests *get_freereq(Buff *b);
 void put_header(Requests * req, char *key, char *value);
-void close_conn(Pool *p, int i);
-int parse_uri(Pool *p, char *uri, char *filename, char *cgiargs);
+static void link_header(Requests *req, char *key, char *value);
+void close_conn(Pool *p, Buff *bufi);
+int parse_uri(Requests *req, char **filename, char **cgiargs);
 void get_filetype(char *filename, char *filetype);
-void serve_static(Buff *b, char *filename, struct stat sbuf);
-void put_req(Requests *req, char *method, char *uri, char *version);
 int is_valid_method(char *method);
 char *get_hdr_value_by_key(Headers *hdr, char *key);
 int isnumeric(char *str);
 int daemonize(char* lock_file);
 void liso_shutdown(int ret);
 
+static volatile sig_atomic_t terminate = 0;  /* SIGTERM was received */
+
 /** @brief Wrapper function for closing socket
  *  @param sock The socket fd to be closed
  *  @return 0 on sucess, 1 on error
  */
 int close_socket(int sock) {
-    printf("Close sock %d\n", sock);
+    PROBE(PR_CONN, close, "sock %d", sock);
     log_write_string("Close sock %d\n", sock);
     if (close(sock)) {
         fprintf(stderr, "Failed closing socket.\n");
@@ -85,11 +114,15 @@ void signal_handler(int sig)
         switch(sig)
         {
                 case SIGHUP:
-                        /* rehash the server */
+                        /* reopen the logs, the flusher does it off
+                         * the event loop once it has written out
+                         * what is buffered */
+                        log_reopen();
                         break;
                 case SIGTERM:
-                        /* finalize and shutdown the server */
-                        liso_shutdown(EXIT_SUCCESS);
+                        /* the event loop shuts the server down, the
+                         * log lock may be held where this interrupts */
+                        terminate = 1;
                         break;
                 default:
                         break;
@@ -98,15 +131,19 @@ void signal_handler(int sig)
 }
 
 int main(int argc, char* argv[]) {
-    int listen_sock, client_sock;
+    int listen_sock, client_sock, admin_sock = -1;
     socklen_t cli_size;
     struct sockaddr cli_addr;
 
-    sigset_t mask, old_mask;
+    sigset_t mask, old_mask, wait_mask;
+    struct timespec timeout;
+    unsigned long long handshake, busy, wake = 0;
+    int accepted;
 
     SSL_CTX *ssl_context;
     SSL *client_context;
     int ssl_sock;
+    Buff *bufi;
 
 
     int http_port;  /* The port for the HTTP server to listen on */
@@ -116,9 +153,9 @@ int main(int argc, char* argv[]) {
     char *pri_key; /* Private key file path */
     char *cert;  /* Certificate file path */
 
-    Pool pool;
+    static Pool pool;
 
-    if (argc != ARG_NUMBER + 1) {
+    if (argc != ARG_NUMBER + 1 && argc != ARG_NUMBER + 2) {
       usage();
     }
 
@@ -132,6 +169,10 @@ int main(int argc, char* argv[]) {
     pri_key = argv[7];
     cert = argv[8];
 
+    conf_init();
+    if (argc == ARG_NUMBER + 2 && conf_load(argv[9]) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
     if (DEAMON)
         daemonize(lock_file);
 
@@ -139,10 +180,17 @@ int main(int argc, char* argv[]) {
     sigemptyset(&mask);
     sigemptyset(&old_mask);
     sigaddset(&mask, SIGPIPE);
+    sigaddset(&mask, SIGTERM);
     sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    /* SIGTERM is taken only while the event loop waits in pselect(),
+       the threads started later inherit the mask blocking it */
+    wait_mask = old_mask;
+    sigaddset(&wait_mask, SIGPIPE);
+    sigdelset(&wait_mask, SIGTERM);
 
 
     //signal(SIGPIPE, SIG_IGN);
+    conntab_count_tls();
     SSL_load_error_strings();
     SSL_library_init();
 
@@ -153,6 +201,12 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "Error creating SSL context.\n");
         return EXIT_FAILURE;
     }
+    /* idle connections drop their read and write buffers */
+    SSL_CTX_set_mode(ssl_context, SSL_MODE_RELEASE_BUFFERS);
+    /* responses go out a quantum at a time, from where the last
+       SSL_write() stopped */
+    SSL_CTX_set_mode(ssl_context, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
     /* register private key */
     if (SSL_CTX_use_PrivateKey_file(ssl_context, pri_key,
@@ -171,6 +225,7 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "Error associating certificate.\n");
         return EXIT_FAILURE;
     }
+    conntab_tls_baseline();
     /************ END SSL INIT ************/
 
     fprintf(stdout, "----- Echo Server -----\n");
@@ -187,34 +242,98 @@ int main(int argc, char* argv[]) {
 
 
     init_pool(listen_sock, ssl_sock, &pool);
+    ratelimit_init();
     log_init(log_file);
+    lag_init();
+    if (reqtrace_init() == EXIT_FAILURE ||
+        cgi_init(&pool) == EXIT_FAILURE ||
+        io_init(&pool) == EXIT_FAILURE ||
+        upstream_init(&pool) == EXIT_FAILURE ||
+        route_init(pool.www, pool.cgi) == EXIT_FAILURE) {
+        close_socket(listen_sock);
+        close_socket(ssl_sock);
+        SSL_CTX_free(ssl_context);
+        return EXIT_FAILURE;
+    }
+    if (conf.admin_port) {
+        if ((admin_sock = metrics_listen(conf.admin_port)) < 0) {
+            close_socket(listen_sock);
+            close_socket(ssl_sock);
+            SSL_CTX_free(ssl_context);
+            return EXIT_FAILURE;
+        }
+        FD_SET(admin_sock, &pool.read_set);
+        if (admin_sock > pool.maxfd)
+            pool.maxfd = admin_sock;
+    }
     memset(&cli_addr, 0, sizeof(struct sockaddr));
-    memset(&cli_size, 0, sizeof(socklen_t));
 
     /* finally, loop waiting for input and then write it back */
     while (1) {
 
+        if (wake) {
+            busy = metrics_now() - wake;
+            lag_wakeup(wake, busy);
+            overload_update(&pool, busy);
+        }
+        /* past a hard limit new connections wait in the backlog */
+        if (overload.level == OL_STOP) {
+            FD_CLR(listen_sock, &pool.read_set);
+            FD_CLR(ssl_sock, &pool.read_set);
+        } else {
+            FD_SET(listen_sock, &pool.read_set);
+            FD_SET(ssl_sock, &pool.read_set);
+        }
         pool.ready_read = pool.read_set;
         pool.ready_write = pool.write_set;
-        if (VERBOSE)
-            printf("New select\n");
-
-        pool.nready = select(pool.maxfd + 1,
-                            &pool.ready_read,
-                            &pool.ready_write, NULL, NULL);
-        if (VERBOSE)
-            printf("nready = %d\n", pool.nready);
 
+        /* wake up once a second while cgi jobs or proxied requests
+         * need their limits checked, or overload its level */
+        timeout.tv_sec = 1;
+        timeout.tv_nsec = 0;
+        pool.nready = pselect(pool.maxfd + 1,
+                              &pool.ready_read,
+                              &pool.ready_write, NULL,
+                              cgi_active() || upstream_active() ||
+                              overload.level != OL_NORMAL ?
+                              &timeout : NULL, &wait_mask);
+        PROBE(PR_LOOP, wakeup, "nready %d, %d connections", pool.nready,
+              pool.cur_conn);
+        wake = metrics_now();
+        pool.now = wake / 1000000;
+
+        if (terminate)
+            liso_shutdown(EXIT_SUCCESS);
+        if (pool.nready == -1 && errno == EINTR)
+            continue;
         if (pool.nready == -1) {
             /* Something wrong with select */
-            if (VERBOSE)
-                printf("Select error on %s\n", strerror(errno));
+            PROBE(PR_LOOP, select_error, "errno %d", errno);
             clean_state(&pool, listen_sock, ssl_sock);
         }
 
-        if (FD_ISSET(ssl_sock, &pool.ready_read) &&
-                     pool.cur_conn <= FD_SETSIZE - 10) {
+        lag_enter("cgi_poll", -1, 0);
+        cgi_reap(&pool);
+        cgi_poll(&pool);
+        cgi_expire(&pool);
+        lag_leave();
+        lag_enter("io_complete", -1, 0);
+        io_complete(&pool);
+        lag_leave();
+        lag_enter("upstream_poll", -1, 0);
+        upstream_poll(&pool);
+        upstream_expire(&pool);
+        lag_leave();
+        if (conf.mem_budget &&
+            conntab_mem(&pool.conns, NULL) > (size_t)conf.mem_budget) {
+            lag_enter("evict_idle", -1, 0);
+            evict_idle(&pool);
+            lag_leave();
+        }
+
+        if (FD_ISSET(ssl_sock, &pool.ready_read)) {
 
+            cli_size = sizeof(cli_addr);
             if ((client_sock = accept(ssl_sock,
                                     (struct sockaddr *) &cli_addr,
                                     &cli_size)) == -1) {
@@ -222,8 +341,8 @@ int main(int argc, char* argv[]) {
                 fprintf(stderr, "Error accepting connection.\n");
                 continue;
             }
-            if (VERBOSE)
-                printf("New client %d accepted via https\n", client_sock);
+            PROBE(PR_CONN, accept, "sock %d https", client_sock);
+            METRIC_INC(accepts[SCHEME_HTTPS]);
 
             /************ WRAP SOCKET WITH SSL ************/
             if ((client_context = SSL_new(ssl_context)) == NULL)
@@ -238,22 +357,32 @@ int main(int argc, char* argv[]) {
                 continue;
             }
 
-            if (SSL_accept(client_context) <= 0)
+            handshake = metrics_now();
+            /* the handshake blocks the loop until the client is done */
+            lag_enter("SSL_accept", client_sock, 0);
+            accepted = SSL_accept(client_context);
+            lag_leave();
+            if (accepted <= 0)
             {
                 fprintf(stderr, "Error accepting (handshake) "
                                 "client SSL context.\n");
+                METRIC_INC(tls_failures);
                 close_socket(client_sock);
                 SSL_free(client_context);
                 continue;
             }
-            add_client_ssl(client_context, client_sock, &pool,
-                          (struct sockaddr_in *) &cli_addr, https_port);
+            METRIC_INC(tls_handshakes);
+            if (!admit(&pool)) {
+                overload_reject(client_sock, client_context);
+                pool.nready--;
+            } else if ((bufi = add_client_ssl(client_context, client_sock,
+                                    &pool, (struct sockaddr_in *) &cli_addr,
+                                    https_port)) != NULL)
+                bufi->cold->handshake_us = metrics_now() - handshake;
         }
 
-        if (FD_ISSET(listen_sock, &pool.ready_read) &&
-                     pool.cur_conn <= FD_SETSIZE - 20) {
-            if (VERBOSE)
-                printf("Cur_conn = %d----------------\n", pool.cur_conn);
+        if (FD_ISSET(listen_sock, &pool.ready_read)) {
+            cli_size = sizeof(cli_addr);
             if ((client_sock = accept(listen_sock,
                                     (struct sockaddr *) &cli_addr,
                                     &cli_size)) == -1) {
@@ -262,12 +391,31 @@ int main(int argc, char* argv[]) {
                 fprintf(stderr, "Error accepting connection.\n");
                 continue;
             }
-            if (VERBOSE)
-                printf("New client %d accepted via http\n", client_sock);
+            PROBE(PR_CONN, accept, "sock %d http", client_sock);
+            METRIC_INC(accepts[SCHEME_HTTP]);
 
+            fcntl(client_sock, F_SETFL, O_NONBLOCK);
+            if (!admit(&pool)) {
+                overload_reject(client_sock, NULL);
+                pool.nready--;
+            } else
+                add_client(client_sock, &pool,
+                          (struct sockaddr_in *) &cli_addr, http_port);
+        }
+
+        /* the admin port is served under overload, to tell about it */
+        if (admin_sock >= 0 && FD_ISSET(admin_sock, &pool.ready_read)) {
+            cli_size = sizeof(cli_addr);
+            if ((client_sock = accept(admin_sock,
+                                    (struct sockaddr *) &cli_addr,
+                                    &cli_size)) == -1) {
+                pool.nready--;
+                fprintf(stderr, "Error accepting admin connection.\n");
+                continue;
+            }
             fcntl(client_sock, F_SETFL, O_NONBLOCK);
             add_client(client_sock, &pool,
-                      (struct sockaddr_in *) &cli_addr, http_port);
+                      (struct sockaddr_in *) &cli_addr, conf.admin_port);
         }
 
         serve_clients(&pool);
@@ -288,7 +436,7 @@ void
 usage(void) {
     fprintf(stderr, "usage: ./lisod <HTTP port> <HTTPS port> <log file> "
       "<lock file> <www folder> <CGI script path> <private key file> "
-      "<certificate file>\n");
+      "<certificate file> [config file]\n");
     exit(EXIT_FAILURE);
 }
 
@@ -338,12 +486,7 @@ int open_listen_socket(int port) {
  *  @return Void
  */
 void init_pool(int listen_sock, int ssl_sock, Pool *p) {
-    int i;
-    p->maxi = -1;
-    for (i = 0; i < FD_SETSIZE; i++) {
-        p->buf[i] = NULL;
-        p->pipes[i] = -1;
-    }
+    conntab_init(&p->conns);
 
     p->maxfd = listen_sock > ssl_sock ? listen_sock:ssl_sock;
     p->cur_conn = 0;
@@ -353,6 +496,70 @@ void init_pool(int listen_sock, int ssl_sock, Pool *p) {
     FD_SET(ssl_sock, &p->read_set);
 }
 
+/** @brief Take a slot of the pool for a new connection
+ *  @param conn_sock The socket of client to be added
+ *  @param client_context The SSL struct of SSL connection, NULL for http
+ *  @param p the pointer to the pool
+ *  @param cli_addr the struct contains addr info
+ *  @param port the port of the client
+ *  @return the Buff of the new client, NULL if the table is full
+ */
+static Buff *open_conn(int conn_sock, SSL *client_context, Pool *p,
+                       struct sockaddr_in *cli_addr, int port) {
+    Buff *bufi;
+    ConnCold *cold;
+    Requests *req;
+    int slot = RL_NONE;
+
+    p->nready--;
+    if (port != conf.admin_port &&
+        (slot = ratelimit_connect(cli_addr->sin_addr.s_addr,
+                                  client_context ? SCHEME_HTTPS
+                                                 : SCHEME_HTTP)) == RL_LIMITED) {
+        PROBE(PR_CONN, rate_limit, "sock %d, conns", conn_sock);
+        overload_answer(conn_sock, client_context, "429 Too Many Requests", 1);
+        return NULL;
+    }
+    if ((bufi = conntab_add(&p->conns, conn_sock)) == NULL) {
+        fprintf(stderr, "Too many client.\n");
+        ratelimit_disconnect(slot);
+        if (client_context)
+            SSL_free(client_context);
+        close_socket(conn_sock);
+        return NULL;
+    }
+    p->cur_conn++;
+    cold = bufi->cold;
+    bufi->stage = STAGE_MUV;
+    bufi->last_active = p->now;
+    req = &cold->first;
+    req->response = NULL;
+    req->next = NULL;
+    req->header = NULL;
+    req->method = NULL;
+    req->uri = NULL;
+    req->version = NULL;
+    req->valid = REQ_INVALID;
+    req->post_body = NULL;
+    req->body = NULL;
+    req->body_fd = -1;
+    req->job = NULL;
+    req->proxy = NULL;
+    req->route = NULL;
+    memset(req->phase, 0, sizeof(req->phase));
+    cold->request = req;
+    cold->client_context = client_context;
+    cold->handshake_us = 0;
+    cold->rl_slot = slot;
+    cold->port = port;
+    inet_ntop(AF_INET, &(cli_addr->sin_addr), cold->addr, INET_ADDRSTRLEN);
+    FD_SET(conn_sock, &p->read_set);
+
+    if (conn_sock > p->maxfd)
+        p->maxfd = conn_sock;
+    return bufi;
+}
+
 /** @brief Add a new client fd
  *  @param conn_sock The socket of client to be added
  *  @param p the pointer to the pool
@@ -362,50 +569,10 @@ void init_pool(int listen_sock, int ssl_sock, Pool *p) {
  */
 void add_client(int conn_sock, Pool *p,
                 struct sockaddr_in *cli_addr, int port) {
-    int i;
-    Buff *bufi;
-    p->cur_conn++;
-    p->nready--;
-    for (i = 0; i < FD_SETSIZE; i++)
-        if (p->buf[i] == NULL) {
-
-            p->buf[i] = (Buff *)malloc(sizeof(Buff));
-            bufi = p->buf[i];
-            bufi->buf = (char *)malloc(BUF_SIZE);
-            bufi->stage = STAGE_MUV;
-            bufi->request = (Requests *)malloc(sizeof(Requests));
-            //bufi->request->response = (char *)malloc(BUF_SIZE);
-            bufi->request->response = NULL;
-            bufi->request->next = NULL;
-            bufi->request->header = NULL;
-            bufi->request->method = NULL;
-            bufi->request->uri = NULL;
-            bufi->request->version = NULL;
-            bufi->request->valid = REQ_INVALID;
-            bufi->request->post_body = NULL;
-            bufi->cur_size = 0;
-            bufi->cur_parsed = 0;
-            bufi->size = BUF_SIZE;
-            bufi->fd = conn_sock;
-            bufi->client_context = NULL;
-            bufi->port = port;
-            inet_ntop(AF_INET, &(cli_addr->sin_addr),
-                      bufi->addr, INET_ADDRSTRLEN);
-            FD_SET(conn_sock, &p->read_set);
-
-            if (conn_sock > p->maxfd)
-                p->maxfd = conn_sock;
-            if (i > p->maxi)
-                p->maxi = i;
-            log_write_string("HTTP client added: %s", bufi->addr);
-            break;
-        }
+    Buff *bufi = open_conn(conn_sock, NULL, p, cli_addr, port);
 
-
-    if (i == FD_SETSIZE) {
-        fprintf(stderr, "Too many client.\n");
-        exit(EXIT_FAILURE);
-    }
+    if (bufi != NULL)
+        log_write_string("HTTP client added: %s", bufi->cold->addr);
 }
 
 /** @brief Add a new client fd
@@ -413,435 +580,630 @@ void add_client(int conn_sock, Pool *p,
  *  @param p the pointer to the pool
  *  @param cli_addr the struct contains addr info
  *  @param port the port of the client
- *  @return Void
+ *  @return the Buff of the new client, NULL if the table is full
  */
-void add_client_ssl(SSL *client_context,
+Buff *add_client_ssl(SSL *client_context,
                     int conn_sock, Pool *p,
                     struct sockaddr_in *cli_addr, int port) {
+    Buff *bufi = open_conn(conn_sock, client_context, p, cli_addr, port);
+
+    if (bufi != NULL)
+        log_write_string("HTTPS client added: %s", bufi->cold->addr);
+    return bufi;
+}
+
+/** @brief Perform recv on available sockets in pool
+ *  @param p the pointer to the pool
+ *  @return Void
+ */
+void serve_clients(Pool *p) {
     int i;
     Buff *bufi;
-    p->cur_conn++;
-    p->nready--;
-    for (i = 0; i < FD_SETSIZE; i++)
-        if (p->buf[i] == NULL) {
-
-            p->buf[i] = (Buff *)malloc(sizeof(Buff));
-            bufi = p->buf[i];
-            bufi->buf = (char *)malloc(BUF_SIZE);
-            bufi->stage = STAGE_MUV;
-            bufi->request = (Requests *)malloc(sizeof(Requests));
-            //bufi->request->response = (char *)malloc(BUF_SIZE);
-            bufi->request->response = NULL;
-            bufi->request->next = NULL;
-            bufi->request->header = NULL;
-            bufi->request->method = NULL;
-            bufi->request->uri = NULL;
-            bufi->request->version = NULL;
-            bufi->request->valid = REQ_INVALID;
-            bufi->request->post_body = NULL;
-            bufi->cur_size = 0;
-            bufi->cur_parsed = 0;
-            bufi->size = BUF_SIZE;
-            bufi->client_context = client_context;
-            bufi->fd = conn_sock;
-            bufi->port = port;
-            inet_ntop(AF_INET, &(cli_addr->sin_addr),
-                      bufi->addr, INET_ADDRSTRLEN);
-            FD_SET(conn_sock, &p->read_set);
-
-            if (conn_sock > p->maxfd)
-                p->maxfd = conn_sock;
-            if (i > p->maxi)
-                p->maxi = i;
-            break;
-            log_write_string("HTTPS client added: %s", bufi->addr);
-        }
 
-    if (i == FD_SETSIZE) {
-        fprintf(stderr, "Too many client.\n");
-        exit(EXIT_FAILURE);
+    /* from the end, closing a connection moves the last one into its place */
+    for (i = p->conns.n - 1; (i >= 0) && (p->nready > 0); i--) {
+        bufi = CONNTAB_AT(&p->conns, i);
+
+        if (FD_ISSET(bufi->fd, &p->ready_read)) {
+            p->nready--;
+            FD_CLR(bufi->fd, &p->ready_read); /* Remove it from ready read */
+            bufi->last_active = p->now;
+            lag_enter("serve_client", bufi->fd, bufi->stage);
+            serve_client(p, bufi);
+            lag_leave();
+            /* between requests the segments go back to the pool, as
+               they do once what was read is answered with an error */
+            if (bufi->fd >= 0 && (bufi->in.len == 0 ||
+                                  bufi->stage == STAGE_ERROR ||
+                                  bufi->stage == STAGE_CLOSE)) {
+                chain_reset(&bufi->in);
+                bufi->cur_parsed = 0;
+            }
+        }
     }
 }
 
-/** @brief Perform recv on available sockets in pool
+/** @brief Read from a readable connection and handle what it sent
  *  @param p the pointer to the pool
+ *  @param bufi the Buff of the connection
  *  @return Void
  */
-void serve_clients(Pool *p) {
-    int conn_sock, i;
-    SSL *client_context;
+static void serve_client(Pool *p, Buff *bufi) {
+    int conn_sock = bufi->fd;
+    SSL *client_context = bufi->cold->client_context;
     ssize_t readret;
-    size_t buf_size;
-    char method[BUF_SIZE], uri[BUF_SIZE], version[BUF_SIZE];
-    char filename[BUF_SIZE], cgiquery[BUF_SIZE];
-    char buf[BUF_SIZE];
+    size_t before;
+    char *filename, *cgiquery;
+    char retry[RETRY_SIZE];
     char *value;
     int j;
     struct stat sbuf;
     Requests *req;
-    Buff *bufi;
 
-    if (VERBOSE)
-        printf("entering recv, nready = %d\n", p->nready);
-
-    for (i = 0; (i <= p->maxi) && (p->nready > 0); i++) {
-        if (p->buf[i] == NULL)
-            continue;
-        bufi = p->buf[i];
-        conn_sock = bufi->fd;
-        client_context = bufi->client_context;
+    if (bufi->stage == STAGE_ERROR)
+        return;
+    if (bufi->stage == STAGE_CLOSE)
+        return;
 
-        if (FD_ISSET(conn_sock, &p->ready_read)) {
-            p->nready--;
+    if (bufi->stage == STAGE_MUV) {
+        before = bufi->in.len;
+        j = chain_recvline(&bufi->in, conn_sock, client_context,
+                           conf.header_limit);
+        if (j == CHAIN_EOF) {
+            PROBE(PR_CONN, eof, "sock %d, read %d", conn_sock,
+                  (int)(bufi->in.len - before));
+            close_conn(p, bufi);
+            return;
+        }
+        METRIC_ADD(bytes_in, bufi->in.len - before);
+        if (j == CHAIN_AGAIN)
+            return;
+        /* empty lines ahead of a request are skipped */
+        if (j == CHAIN_LINE &&
+            chain_span(&bufi->in, 0, bufi->in.len, "\r\n") == bufi->in.len) {
+            chain_reset(&bufi->in);
+            return;
+        }
 
-            if (bufi->stage == STAGE_ERROR)
-                continue;
-            if (bufi->stage == STAGE_CLOSE)
-                continue;
+        bufi->cur_request = get_freereq(bufi);
 
-            if (bufi->stage == STAGE_MUV) {
-                buf_size = bufi->size - bufi->cur_size;
-                readret = mio_recvlineb(conn_sock, client_context,
-                                        bufi->buf + bufi->cur_size,
-                                        buf_size);
-                if (readret <= 0) {
-                    printf("serve_clients: readret = %d\n", (int)readret);
-                    close_conn(p, i);
-                    continue;
-                }
-                bufi->cur_size += readret;
-                j = sscanf(bufi->buf, "%s %s %s", method, uri, version);
-                if (j < 3) {
-                    continue;
-                }
-
-
-
-                bufi->cur_request = get_freereq(bufi);
-
-                req = bufi->cur_request;
-                put_req(req, method, uri, version);
-                if (!is_valid_method(method)) {
-                    clienterror(req,
-                                bufi->addr, method,
-                                "501", "Not Implemented",
-                                "Liso does not implement this method");
-                    bufi->stage = STAGE_ERROR;
-                    FD_SET(conn_sock, &p->write_set);
-                    continue;
-                }
-                if (AB)
-                    if (strcasecmp(version, "HTTP/1.1")) {
-                        clienterror(req,
-                                    bufi->addr, version,
-                                    "501", "Not Implemented",
-                                    "Liso does not support the http version");
-                        bufi->stage = STAGE_ERROR;
-                        FD_SET(conn_sock, &p->write_set);
-                        continue;
-                    }
-                bufi->stage = STAGE_HEADER;
-                bufi->cur_parsed = bufi->cur_size;
+        req = bufi->cur_request;
+        if (j == CHAIN_FULL) {
+            header_too_large(p, bufi);
+            return;
+        }
+        if (read_requestline(bufi, req) < 3) {
+            clienterror(req,
+                        bufi->cold->addr, "",
+                        "400", "Bad Request",
+                        "Liso couldn't parse the request");
+            bufi->stage = STAGE_ERROR;
+            FD_SET(conn_sock, &p->write_set);
+            return;
+        }
+        PROBE(PR_PARSE, request, "sock %d: %s %s %s", conn_sock,
+              req->method, req->uri, req->version);
+        req->route = route_match(req->uri);
+        if ((j = rate_limited(bufi, req)) > 0) {
+            sprintf(retry, "Retry-After: %d\r\n", j);
+            clienterror_hdr(req, bufi->cold->addr, "",
+                            "429", "Too Many Requests",
+                            "Liso takes fewer requests from one client",
+                            retry);
+            /* the headers are never read, nothing more can be */
+            bufi->stage = STAGE_CLOSE;
+            FD_SET(conn_sock, &p->write_set);
+            return;
+        }
+        if (!is_valid_method(req->method)) {
+            clienterror(req,
+                        bufi->cold->addr, req->method,
+                        "501", "Not Implemented",
+                        "Liso does not implement this method");
+            bufi->stage = STAGE_ERROR;
+            FD_SET(conn_sock, &p->write_set);
+            return;
+        }
+        if (AB)
+            if (strcasecmp(req->version, "HTTP/1.1")) {
+                clienterror(req,
+                            bufi->cold->addr, req->version,
+                            "501", "Not Implemented",
+                            "Liso does not support the http version");
+                bufi->stage = STAGE_ERROR;
+                FD_SET(conn_sock, &p->write_set);
+                return;
             }
-            if (bufi->stage == STAGE_HEADER) {
-                req = bufi->cur_request;
-                j = read_requesthdrs(bufi, req);
-
-                if (j == -2) {
-                    clienterror(bufi->cur_request,
-                                bufi->addr, "",
-                                "400", "Bad Request",
-                                "Liso couldn't parse the request");
-                    //close_conn(p, i);
-                    bufi->stage = STAGE_ERROR;
-                    FD_SET(conn_sock, &p->write_set);
-                    continue;
-                } else if (j == 0) {
-                    close_conn(p, i);
-                    continue;
-                } else if (j == -1)
-                    continue;
-                else
-                    bufi->stage = STAGE_BODY;
-
-                if (!strcmp(req->method, "POST")) {
-                    if (NULL == (value = get_hdr_value_by_key(req->header,
-                                                     "Content-Length"))) {
-                        clienterror(bufi->cur_request,
-                                bufi->addr, "",
-                                "411", "Length Required",
-                                "Liso needs Content-Length header");
-                        bufi->stage = STAGE_ERROR;
-                        FD_SET(conn_sock, &p->write_set);
-                        continue;
-                    }
-
-                    if (!isnumeric(value)) {
-                        clienterror(bufi->cur_request,
-                                bufi->addr, "",
-                                "400", "Bad Request",
-                                "Liso couldn't parse the request");
-                        bufi->stage = STAGE_ERROR;
-                        FD_SET(conn_sock, &p->write_set);
-                        continue;
-                    }
-
-                    int length = atoi(value);
-                    if (VERBOSE)
-                        printf("length atoi = %d\n", length);
-                    if (client_context != NULL) {
-                        readret = SSL_read(client_context,
-                                                buf,
-                                                BUF_SIZE - 1);
-                    } else {
-                        readret = recv(conn_sock, buf, BUF_SIZE - 1, 0);
-                    }
-                    if (VERBOSE)
-                        printf("readret =  %zx\n", readret);
-                    if (readret != length) {
-                        clienterror(bufi->cur_request,
-                                    bufi->addr, "",
-                                    "400", "Bad Request",
-                                    "Liso couldn't parse the request");
-                        bufi->stage = STAGE_ERROR;
-                        FD_SET(conn_sock, &p->write_set);
-                        continue;
-                    }
-                    req->post_body = (char *)malloc(length + 1);
-                    strncpy(req->post_body, buf, length);
-                    req->post_body[length] = '\0';
-                    if (VERBOSE)
-                        printf("post_body:%s\n", req->post_body);
-                }
-
-                value = get_hdr_value_by_key(req->header, "Connection");
-                if (value) {
-                    if (VERBOSE)
-                        printf("Req->Connection: %s\n", value);
-                    if (!strcmp(value, "Close")) {
-                        bufi->stage = STAGE_CLOSE;
-                    }
-                    if (!strcmp(value, "close")) {
-                        bufi->stage = STAGE_CLOSE;
-                    }
-                }
+        bufi->stage = STAGE_HEADER;
+    }
+    if (bufi->stage == STAGE_HEADER) {
+        req = bufi->cur_request;
+        j = read_requesthdrs(bufi, req);
+
+        if (j == -2) {
+            clienterror(bufi->cur_request,
+                        bufi->cold->addr, "",
+                        "400", "Bad Request",
+                        "Liso couldn't parse the request");
+            //close_conn(p, bufi);
+            bufi->stage = STAGE_ERROR;
+            FD_SET(conn_sock, &p->write_set);
+            return;
+        } else if (j == -3) {
+            header_too_large(p, bufi);
+            return;
+        } else if (j == 0) {
+            close_conn(p, bufi);
+            return;
+        } else if (j == -1)
+            return;
+        else
+            bufi->stage = STAGE_BODY;
+        TRACE_PHASE(req, PH_HEADERS);
+
+        if (!strcmp(req->method, "POST")) {
+            if (NULL == (value = get_hdr_value_by_key(req->header,
+                                             "Content-Length"))) {
+                clienterror(bufi->cur_request,
+                        bufi->cold->addr, "",
+                        "411", "Length Required",
+                        "Liso needs Content-Length header");
+                bufi->stage = STAGE_ERROR;
+                FD_SET(conn_sock, &p->write_set);
+                return;
             }
 
-
-
-            j = parse_uri(p, uri, filename, cgiquery);
-            if (stat(filename, &sbuf) < 0) {
+            if (!isnumeric(value)) {
                 clienterror(bufi->cur_request,
-                            bufi->addr, filename,
-                            "404", "Not found",
-                            "Liso couldn't find this file");
-                //close_conn(p, i);
+                        bufi->cold->addr, "",
+                        "400", "Bad Request",
+                        "Liso couldn't parse the request");
                 bufi->stage = STAGE_ERROR;
                 FD_SET(conn_sock, &p->write_set);
-                continue;
+                return;
             }
 
-            if (j) {
-                serve_static(bufi, filename, sbuf);
+            int length = atoi(value);
+            if (req->route->max_body > 0 && length > req->route->max_body) {
+                clienterror(bufi->cur_request,
+                            bufi->cold->addr, "",
+                            "413", "Payload Too Large",
+                            "Liso takes smaller bodies here");
+                bufi->stage = STAGE_ERROR;
                 FD_SET(conn_sock, &p->write_set);
+                return;
             }
-            else
-                serve_dynamic(p, bufi, filename, cgiquery);
+            /* the body has to come in one read, as it always had to,
+               so max_body of a route can only be lower */
+            if (length > CONF_MAX_BODY) {
+                clienterror(bufi->cur_request,
+                            bufi->cold->addr, "",
+                            "400", "Bad Request",
+                            "Liso couldn't parse the request");
+                bufi->stage = STAGE_ERROR;
+                FD_SET(conn_sock, &p->write_set);
+                return;
+            }
+            req->post_body = (char *)arena_alloc(&req->arena,
+                                                 length + 1);
+            if (client_context != NULL) {
+                readret = SSL_read(client_context,
+                                        req->post_body,
+                                        length);
+            } else {
+                readret = recv(conn_sock, req->post_body, length, 0);
+            }
+            if (readret > 0)
+                METRIC_ADD(bytes_in, readret);
+            if (readret != length) {
+                clienterror(bufi->cur_request,
+                            bufi->cold->addr, "",
+                            "400", "Bad Request",
+                            "Liso couldn't parse the request");
+                bufi->stage = STAGE_ERROR;
+                FD_SET(conn_sock, &p->write_set);
+                return;
+            }
+            req->post_body[length] = '\0';
+            req->post_body_length = length;
+            TRACE_PHASE(req, PH_BODY);
+            PROBE(PR_PARSE, post_body, "sock %d, %d bytes",
+                  conn_sock, length);
+        }
 
+        value = get_hdr_value_by_key(req->header, "Connection");
+        if (value) {
+            if (!strcmp(value, "Close")) {
+                bufi->stage = STAGE_CLOSE;
+            }
+            if (!strcmp(value, "close")) {
+                bufi->stage = STAGE_CLOSE;
+            }
+        }
+    }
 
 
-            /* Now we can select this fd to test if it can be sent to */
 
-            if (VERBOSE)
-                printf("Server received on %d, request:\n%s",
-                    conn_sock, bufi->buf);
-            if (bufi->stage != STAGE_ERROR && bufi->stage != STAGE_CLOSE)
-                bufi->stage = STAGE_MUV;
-            bufi->cur_size = 0;
-            bufi->cur_parsed = 0;
-            FD_CLR(conn_sock, &p->ready_read); /* Remove it from ready read */
+    if (conf.admin_port && bufi->cold->port == conf.admin_port) {
+        metrics_serve(p, bufi);
+        TRACE_PHASE(bufi->cur_request, PH_HANDLER);
+        FD_SET(conn_sock, &p->write_set);
+    } else if (bufi->cur_request->route->handler == ROUTE_UPSTREAM) {
+        /* answered with 502 itself if no server is reachable */
+        TRACE_PHASE(bufi->cur_request, PH_HANDLER);
+        upstream_serve(p, bufi, bufi->cur_request->route->upstream);
+    } else if (bufi->cur_request->route->handler == ROUTE_STATUS) {
+        metrics_status(p, bufi);
+        TRACE_PHASE(bufi->cur_request, PH_HANDLER);
+        FD_SET(conn_sock, &p->write_set);
+    } else {
+        req = bufi->cur_request;
+        j = parse_uri(req, &filename, &cgiquery);
+        /* a static file is opened by an I/O thread, io_complete()
+           answers it */
+        if (j && io_submit(p, bufi, filename) == EXIT_SUCCESS) {
+            TRACE_PHASE(req, PH_HANDLER);
+        } else if (stat(filename, &sbuf) < 0) {
+            clienterror(bufi->cur_request,
+                        bufi->cold->addr, filename,
+                        "404", "Not found",
+                        "Liso couldn't find this file");
+            //close_conn(p, bufi);
+            bufi->stage = STAGE_ERROR;
+            FD_SET(conn_sock, &p->write_set);
+            return;
+        } else if (j) {
+            serve_static(bufi, req, filename, sbuf, -1);
+            TRACE_PHASE(bufi->cur_request, PH_HANDLER);
+            FD_SET(conn_sock, &p->write_set);
+        }
+        else if (TRACE_PHASE(bufi->cur_request, PH_HANDLER),
+                 serve_dynamic(p, bufi, filename, cgiquery) == CGI_BUSY) {
+            sprintf(retry, "Retry-After: %d\r\n", cgi_retry_after());
+            clienterror_hdr(bufi->cur_request,
+                            bufi->cold->addr, "",
+                            "503", "Service Unavailable",
+                            "Liso is too busy to run the CGI script",
+                            retry);
+            bufi->stage = STAGE_ERROR;
+            FD_SET(conn_sock, &p->write_set);
         }
     }
+
+
+
+    /* Now we can select this fd to test if it can be sent to */
+
+    if (bufi->stage != STAGE_ERROR && bufi->stage != STAGE_CLOSE)
+        bufi->stage = STAGE_MUV;
+    chain_reset(&bufi->in);
+    bufi->cur_parsed = 0;
+}
+
+/** @brief Take the tokens a request needs from the buckets of its
+ *         client, one for the request and one more if it runs CGI
+ *  @param bufi the Buff of the connection
+ *  @param req the request, only its request line is read
+ *  @return 0 if it may go on, seconds for Retry-After if not
+ */
+static int rate_limited(Buff *bufi, Requests *req) {
+    int slot = bufi->cold->rl_slot, retry;
+
+    if ((retry = ratelimit_take(slot, RL_REQUESTS)) == 0 &&
+        req->route->handler == ROUTE_CGI)
+        retry = ratelimit_take(slot, RL_CGI);
+    if (retry)
+        PROBE(PR_CONN, rate_limit, "sock %d, %s", bufi->fd,
+              req->route->handler == ROUTE_CGI ? "cgi" : "requests");
+    return retry;
+}
+
+/** @brief Answer a request whose line and headers do not fit in
+ *         header_limit with 431, the connection is closed after it
+ *         since the rest of the request is never read
+ *  @param p the pointer to the pool
+ *  @param bufi the Buff of the connection
+ *  @return Void
+ */
+static void header_too_large(Pool *p, Buff *bufi) {
+    Requests *req = bufi->cur_request;
+
+    PROBE(PR_PARSE, header_limit, "sock %d, %u bytes", bufi->fd,
+          bufi->in.len);
+    if (req->method == NULL)
+        read_requestline(bufi, req);
+    clienterror(req, bufi->cold->addr, "",
+                "431", "Request Header Fields Too Large",
+                "Liso does not take requests with headers this long");
+    bufi->stage = STAGE_CLOSE;
+    FD_SET(bufi->fd, &p->write_set);
 }
 
 
 /** @brief Perform send on available buffs in pool
+ *         Writable connections take turns: each gets write_quantum
+ *         bytes a round and one with more to send stays in write_set
+ *         for the next round, so a large body is spread over many
+ *         rounds instead of holding up every other connection. With
+ *         write_priority on, connections about to send the first bytes
+ *         of a response or whose whole response fits in a quantum go
+ *         first in the round.
  *  @param p the pointer to the pool
  *  @return Void
  */
 void server_send(Pool *p) {
-    int i, conn_sock;
-    SSL *client_context;
-    ssize_t sendret;
-    ssize_t readret;
-    Requests *req;
+    static unsigned int round = 0;
+    static Buff *ready[CONN_MAX];
+    int i, n = 0, rest = 0;
     Buff *bufi;
-    if (VERBOSE)
-        printf("entering send, nready = %d\n", p->nready);
 
-    for (i = 0; (i <= p->maxi) && (p->nready > 0); i++) {
-        /* Go thru all pool unit to see if it is a vaild socket
-           and is available to write */
-        if (p->buf[i] == NULL)
+    /* the round starts one slot further each time, so no connection
+       is always served first */
+    for (i = 0; i < p->conns.n && p->nready > 0; i++) {
+        bufi = CONNTAB_AT(&p->conns, (round + i) % p->conns.n);
+        if (FD_ISSET(bufi->fd, &p->ready_write)) {
+            p->nready--;
+            ready[n++] = bufi;
+        }
+    }
+    round++;
+
+    for (i = 0; i < n; i++) {
+        if (conf.write_priority && !write_first(ready[i])) {
+            ready[rest++] = ready[i];
             continue;
-        bufi = p->buf[i];
-        conn_sock = bufi->fd;
-        client_context = bufi->client_context;
-
-        if (FD_ISSET(conn_sock, &p->ready_write)) {
-            req = bufi->request;
-            while (req) {
-                if (req->valid != REQ_VALID) {
-                    req = req->next;
-                    continue;
-                }
-
-                if ((sendret = mio_sendn(conn_sock, client_context,
-                                         req->response,
-                                         strlen(req->response))) > 0) {
-                    if (VERBOSE)
-                        printf("Server send header to %d\n", conn_sock);
-
-                } else {
-                    close_conn(p, i);
-                    req->valid = REQ_INVALID;
-                    req = req->next;
-                    break;
-
-                }
-
-                if (req->body != NULL) {
-                    if ((sendret = mio_sendn(conn_sock, client_context,
-                                             req->body,
-                                             req->body_size)) > 0) {
-                        if (VERBOSE)
-                            printf("Server send %d bytes to %d\n",
-                                   (int)sendret, conn_sock);
-                        munmap(req->body, req->body_size);
-                        req->body = NULL;
-                    } else {
-                        close_conn(p, i);
-                        req->valid = REQ_INVALID;
-                        req = req->next;
-                        break;
-                    }
-                }
+        }
+        lag_enter("write_conn", ready[i]->fd, ready[i]->stage);
+        write_conn(p, ready[i]);
+        lag_leave();
+    }
+    /* a closed connection keeps its Buff, with fd -1, until reused */
+    for (i = 0; i < rest; i++)
+        if (ready[i]->fd >= 0) {
+            lag_enter("write_conn", ready[i]->fd, ready[i]->stage);
+            write_conn(p, ready[i]);
+            lag_leave();
+        }
+}
 
-                req->valid = REQ_INVALID;
-                req = req->next;
-            }
-            if (bufi->stage == STAGE_CLOSE) {
-                close_conn(p, i);
-            }
-            if (bufi->stage == STAGE_ERROR)
-                bufi->stage = STAGE_MUV;
+/** @brief Whether a connection goes in the first pass of a round
+ *  @param bufi the Buff of the connection
+ *  @return 1 if its next response has sent nothing yet or has no
+ *          more than a quantum left, 0 if not
+ */
+static int write_first(Buff *bufi) {
+    Requests *req;
 
-            FD_CLR(conn_sock, &p->write_set);
-        } /* end if FD_ISSET(conn_sock, &p->ready_write) */
+    for (req = bufi->cold->request; req; req = req->next)
+        if (req->valid == REQ_VALID)
+            return req->sent == 0 || conf.write_quantum <= 0 ||
+                   req_size(req) - req->sent <= conf.write_quantum;
+    return 1;
+}
+
+/** @brief Bytes of a response with its body
+ *  @param req the request
+ *  @return the bytes
+ */
+static off_t req_size(Requests *req) {
+    return req->response_len + (req->body_fd >= 0 ? req->body_size : 0);
+}
 
-        if (p->buf[i] == NULL)
+/** @brief Send the ready responses of a writable connection, at most
+ *         write_quantum bytes of them
+ *         Stops early when the socket takes no more. What is left is
+ *         sent in later rounds, picking up at req->sent.
+ *  @param p the pointer to the pool
+ *  @param bufi the Buff of the connection
+ *  @return Void
+ */
+static void write_conn(Pool *p, Buff *bufi) {
+    int conn_sock = bufi->fd;
+    SSL *client_context = bufi->cold->client_context;
+    long quantum = conf.write_quantum > 0 ? conf.write_quantum : LONG_MAX;
+    off_t left;
+    ssize_t sendret;
+    Requests *req;
+    int waiting = 0;
+
+    bufi->last_active = p->now;
+    for (req = bufi->cold->request; req; req = req->next) {
+        if (req->valid == REQ_INVALID)
             continue;
-        /* if this is a cgi client */
-        req = bufi->request;
-        while (req) {
-            if (req->valid == REQ_PIPE) {
-                if (FD_ISSET(req->pipefd, &p->ready_read)) {
-                    if (VERBOSE)
-                        printf("About to read from pipe\n");
-                    char pipebuf[BUF_SIZE];
-                    req->response = (char *)malloc(4096);
-                    strcpy(req->response, "");
-                    while ((readret = read(req->pipefd,
-                                        pipebuf,
-                                        BUF_SIZE-1)) > 0) {
-
-                        pipebuf[readret] = '\0';
-                        strcat(req->response, pipebuf);
-                        printf("while entered!\n");
-                    }
-                    if (VERBOSE)
-                        printf("Pipe return:%s\n", req->response);
-
-                    //strcpy(req->response, pipebuf);
-                    req->valid = REQ_VALID;
-                    close_socket(req->pipefd);
-
-                    p->cur_conn -= 1;
-                    FD_SET(conn_sock, &p->write_set);
-                    FD_CLR(req->pipefd, &p->read_set);
-                    req->pipefd = -1;
-                }
+        /* a later response never overtakes one still being made */
+        if (req->valid != REQ_VALID) {
+            waiting = 1;
+            break;
+        }
+
+        if (req->sent == 0)
+            TRACE_PHASE(req, PH_WRITE);
+        while (req->sent < req_size(req)) {
+            if (req->sent < req->response_len)
+                left = req->response_len - req->sent;
+            else
+                left = req_size(req) - req->sent;
+            if (left > quantum)
+                left = quantum;
+            /* out of quantum, or the socket is full: next round */
+            if (left == 0)
+                return;
+            if (req->sent < req->response_len)
+                sendret = mio_send(conn_sock, client_context,
+                                   req->response + req->sent, left);
+            else
+                sendret = stream_send(conn_sock, client_context, req,
+                                      req->sent - req->response_len, left);
+            if (sendret < 0) {
+                close_conn(p, bufi);
+                return;
             }
-            req = req->next;
+            if (sendret == 0)
+                return;
+            METRIC_ADD(bytes_out, sendret);
+            quantum -= sendret;
+            req->sent += sendret;
+            if (req->sent == req->response_len) {
+                PROBE(PR_SEND, send_header, "sock %d, %d bytes",
+                      conn_sock, req->response_len);
+                TRACE_PHASE(req, PH_SENT_HDR);
+            }
+        }
+
+        if (req->body_fd >= 0) {
+            PROBE(PR_SEND, send_body, "sock %d, %lld bytes",
+                  conn_sock, (long long)req->body_size);
+            stream_close(req);
         }
+        TRACE_PHASE(req, PH_DONE);
+        metrics_response(req);
+        reqtrace_done(bufi, req);
+        req->valid = REQ_INVALID;
+        arena_reset(&req->arena);
+    }
+
+    /* a response still being made sets the write bit again when it
+       is ready, and only then may the connection close */
+    if (waiting) {
+        FD_CLR(conn_sock, &p->write_set);
+        return;
     }
+    if (bufi->stage == STAGE_CLOSE) {
+        close_conn(p, bufi);
+        return;
+    }
+    if (bufi->stage == STAGE_ERROR)
+        bufi->stage = STAGE_MUV;
+    FD_CLR(conn_sock, &p->write_set);
+}
+
+
+/** @brief Order connections from the least recently active
+ *  @param a pointer to a Buff pointer
+ *  @param b pointer to a Buff pointer
+ *  @return <0, 0 or >0 as for qsort()
+ */
+static int by_last_active(const void *a, const void *b) {
+    unsigned int ta = (*(Buff **)a)->last_active;
+    unsigned int tb = (*(Buff **)b)->last_active;
+
+    return ta < tb ? -1 : ta > tb;
+}
+
+/** @brief Close idle keep-alive connections, least recently active
+ *         first, until the memory held for connections is back under
+ *         90% of mem_budget
+ *         Runs at most once a second. Connections with a request in
+ *         progress are left alone, even if that is not enough.
+ *  @param p the pointer to the pool
+ *  @return Void
+ */
+void evict_idle(Pool *p) {
+    static unsigned int last_pass = 0;
+    static Buff *idle[CONN_MAX];
+    size_t target = conf.mem_budget / 10 * 9;
+    Buff *b;
+    int i, n = 0;
+
+    if (p->now == last_pass)
+        return;
+    last_pass = p->now;
+    for (i = 0; i < p->conns.n; i++) {
+        b = CONNTAB_AT(&p->conns, i);
+        if (conn_idle(b))
+            idle[n++] = b;
+    }
+    qsort(idle, n, sizeof(Buff *), by_last_active);
+    for (i = 0; i < n && conntab_mem(&p->conns, NULL) > target; i++) {
+        PROBE(PR_CONN, evict, "sock %d, idle %us", idle[i]->fd,
+              p->now - idle[i]->last_active);
+        METRIC_INC(evictions);
+        close_conn(p, idle[i]);
+    }
+}
+
+/** @brief Whether a connection is an idle keep-alive one, with no
+ *         request half read or waiting to be answered
+ *  @param b the Buff of the connection
+ *  @return 1 on yes 0 on no
+ */
+static int conn_idle(Buff *b) {
+    Requests *req;
+
+    if (b->stage != STAGE_MUV || b->in.len != 0)
+        return 0;
+    for (req = b->cold->request; req; req = req->next)
+        if (req->valid != REQ_INVALID)
+            return 0;
+    return 1;
 }
 
+/** @brief Decide whether a just accepted connection gets in
+ *         Past a soft limit on connections the least recently active
+ *         idle connection is closed to make room for it, past any
+ *         other soft limit it is turned away
+ *  @param p the pointer to the pool
+ *  @return 1 if it gets in, 0 if it is to be answered with 503
+ */
+static int admit(Pool *p) {
+    Buff *b, *oldest = NULL;
+    int i;
+
+    if (overload.level == OL_NORMAL)
+        return 1;
+    if (overload.cause != OL_CONNS)
+        return 0;
+    for (i = 0; i < p->conns.n; i++) {
+        b = CONNTAB_AT(&p->conns, i);
+        if (conn_idle(b) && b->cold->port != conf.admin_port &&
+            (oldest == NULL || b->last_active < oldest->last_active))
+            oldest = b;
+    }
+    if (oldest == NULL)
+        return 0;
+    PROBE(PR_CONN, evict, "sock %d, idle %us", oldest->fd,
+          p->now - oldest->last_active);
+    overload.evicted++;
+    close_conn(p, oldest);
+    return 1;
+}
 
 /** @brief Clean up all current connected socket
  *  @param p the pointer to the pool
  *  @return Void
  */
 void clean_state(Pool *p, int listen_sock, int ssl_sock) {
-    int i, conn_sock;
-    for (i = 0; i <= p->maxi; i++) {
-        if (p->buf[i]) {
-            conn_sock = p->buf[i]->fd;
-            if (close_socket(conn_sock)) {
-                fprintf(stderr, "Error closing client socket.\n");
-            }
-            p->cur_conn--;
-            FD_CLR(conn_sock, &p->read_set);
-            free_buf(p, p->buf[i]);
-            p->buf[i] = NULL;
-        }
-    }
-    p->maxi = -1;
-    p->maxfd = listen_sock > ssl_sock?listen_sock:ssl_sock;
+    while (p->conns.n > 0)
+        close_conn(p, CONNTAB_AT(&p->conns, p->conns.n - 1));
     p->cur_conn = 0;
 }
 
-/** @brief Free a Buff struct that represents a connection
- *  @param bufi the Buff struct to be freeed
+/** @brief Free what a connection holds besides its slot
+ *         The first request and its arena stay with the slot
+ *  @param bufi the Buff struct that represents the connection
  *  @return Void
  */
 void free_buf(Pool *p, Buff *bufi) {
-    Headers *hdr = NULL;
-    Headers *hdr_pre = NULL;
     Requests *req = NULL;
     Requests *req_pre = NULL;
-    free(bufi->buf);
 
-    req = bufi->request;
-    if (bufi->client_context)
-        SSL_free(bufi->client_context);
+    req = bufi->cold->request;
+    if (bufi->cold->client_context)
+        SSL_free(bufi->cold->client_context);
     while (req) {
         req_pre = req;
         req = req->next;
 
-        hdr = req_pre->header;
-        while (hdr) {
-            hdr_pre = hdr;
-            hdr = hdr->next;
-            free(hdr_pre);
-        }
-        if (req_pre->method)
-            free(req_pre->method);
-        if (req_pre->uri)
-            free(req_pre->uri);
-        if (req_pre->version)
-            free(req_pre->version);
-        if (req_pre->post_body)
-            free(req_pre->post_body);
-        if (req_pre->pipefd != -1) {
-            FD_CLR(req_pre->pipefd, &p->read_set);
-            FD_CLR(req_pre->pipefd, &p->write_set);
-            close(req_pre->pipefd);
+        cgi_cancel(p, req_pre);
+        upstream_cancel(p, req_pre);
+        stream_close(req_pre);
+        if (req_pre == &bufi->cold->first) {
+            arena_reset(&req_pre->arena);
+        } else {
+            arena_free(&req_pre->arena);
+            free(req_pre);
         }
-        free(req_pre->response);
-        free(req_pre);
     }
-    free(bufi);
 }
 
 /** @brief Set clienterror
@@ -856,82 +1218,126 @@ void free_buf(Pool *p, Buff *bufi) {
 void clienterror(Requests *req, char *addr,
                  char *cause, char *errnum, char *shortmsg,
                  char *longmsg) {
+    clienterror_hdr(req, addr, cause, errnum, shortmsg, longmsg, NULL);
+}
+
+/** @brief Set clienterror with additional response headers
+ *  @param req the Requests struct that represents a connection
+ *  @param addr the address string
+ *  @param cause the string about the cause
+ *  @param errnum error status number
+ *  @param shortmsg the string of shortmsg to be sent
+ *  @param longmsg the string of longmsg to be sent
+ *  @param extra_hdr CRLF terminated header lines, or NULL
+ *  @return Void
+ */
+void clienterror_hdr(Requests *req, char *addr,
+                     char *cause, char *errnum, char *shortmsg,
+                     char *longmsg, char *extra_hdr) {
     char date[DATE_SIZE], body[BUF_SIZE], hdr[BUF_SIZE];
-    int len = 0;
+    int len = 0, body_len;
     get_time(date);
     /* Build the HTTPS response body */
-    sprintf(body, "<html><title>Liso</title>");
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Liso Web server</em>\r\n", body);
+    body_len = snprintf(body, BUF_SIZE, "<html><title>Liso</title>%s: %s\r\n"
+                        "<p>%s: %.*s\r\n"
+                        "<hr><em>The Liso Web server</em>\r\n",
+                        errnum, shortmsg, longmsg, CAUSE_SIZE, cause);
+    if (body_len >= BUF_SIZE)
+        body_len = BUF_SIZE - 1;
 
      /* Print the HTTPS response */
-    sprintf(hdr, "HTTP/1.1 %s %s\r\n", errnum, shortmsg);
-    sprintf(hdr, "%sContent-Type: text/html\r\n",hdr);
-    sprintf(hdr, "%sConnection: Close\r\n",hdr);
-    sprintf(hdr, "%sDate: %s\r\n",hdr, date);
-    sprintf(hdr, "%sContent-Length: %d\r\n\r\n%s",hdr,
-                                                (int)strlen(body), body);
-    len = strlen(hdr);
-    req->response = (char *)malloc(len + 1);
+    len = snprintf(hdr, BUF_SIZE, "HTTP/1.1 %s %s\r\n"
+                   "Content-Type: text/html\r\n"
+                   "Connection: Close\r\n"
+                   "Date: %s\r\n%s", errnum, shortmsg, date,
+                   extra_hdr != NULL ? extra_hdr : "");
+    if (len < BUF_SIZE)
+        len += snprintf(hdr + len, BUF_SIZE - len,
+                        "Content-Length: %d\r\n\r\n%s", body_len, body);
+    if (len >= BUF_SIZE)
+        len = BUF_SIZE - 1;
+    req->response = (char *)arena_alloc(&req->arena, len + 1);
     sprintf(req->response, "%s", hdr);
+    req->response_len = len;
     log_write(req, addr, date, errnum, len);
     req->body = NULL;
     req->valid = REQ_VALID;
 }
 
 
-/** @brief Clean up all current connected socket
- *  @param p the pointer to the pool
+/** @brief Split the request line at the start of the input of a
+ *         connection into the method, uri and version of a request
+ *         Missing fields are left empty
+ *  @param b the Buff of the connection
+ *  @param req the request
+ *  @return the number of fields found, 3 for a good request line
+ */
+int read_requestline(Buff *b, Requests *req) {
+    char **field[3] = { &req->method, &req->uri, &req->version };
+    size_t from = 0, to, end = b->in.len;
+    int n, i;
+
+    for (n = 0; n < 3; n++) {
+        from = chain_span(&b->in, from, end, " \t\r\n");
+        if (from == end)
+            break;
+        to = chain_cspan(&b->in, from, end, " \t\r\n");
+        *field[n] = chain_strndup(&b->in, from, to, &req->arena);
+        from = to;
+    }
+    for (i = n; i < 3; i++)
+        *field[i] = "";
+    b->cur_parsed = end;
+    return n;
+}
+
+/** @brief Read header lines into a request up to the empty line
+ *         Lines may cross segments of the input, key and value are
+ *         copied from there straight into the arena of the request
+ *  @param b the Buff of the connection
+ *  @param req the request
  *  @return -1 received a line that does not terminated by \n
  *          -2 received a line that does not match the header format
-             0 EOF encountered
+ *          -3 the request is longer than header_limit
+ *           0 EOF encountered
+ *           1 the empty line is read
  */
 int read_requesthdrs(Buff *b, Requests *req) {
-    int len = 0;
-    char *tmp;
-    char key[BUF_SIZE];
-    char value[BUF_SIZE];
-    char *buf = b->buf + b->cur_parsed;
-
-
-    if (VERBOSE)
-        printf("entering read request:\n%s", buf);
+    Chain *in = &b->in;
+    size_t start, colon, end, before;
+    char *key, *value;
+    int ret;
 
     while (1) {
-        buf += len;
-        mio_recvlineb(b->fd, b->client_context, buf, b->size - b->cur_size);
-        len = strlen(buf);
-
-        if (len == 0)
-            return 1;
-        b->cur_size += len;
-
-        if (buf[len - 1] != '\n') return -1;
-
-        if (VERBOSE)
-            printf("Receive line:\n%s", buf);
-
-        if (!strcmp(buf, "\r\n"))
+        before = in->len;
+        ret = chain_recvline(in, b->fd, b->cold->client_context,
+                             conf.header_limit);
+        METRIC_ADD(bytes_in, in->len - before);
+        if (ret == CHAIN_EOF)
+            return 0;
+        if (ret == CHAIN_FULL)
+            return -3;
+        if (ret == CHAIN_AGAIN)
+            return -1;
+
+        start = b->cur_parsed;
+        end = in->len;
+        b->cur_parsed = end;
+        if (chain_span(in, start, end, "\r\n") == end)
             break;
-        tmp = strchr(b->buf + b->cur_parsed, ':');
-        if (NULL == tmp)
+        colon = chain_cspan(in, start, end, ":");
+        if (colon == end)
             return -2;
-        *tmp = '\0';
-        strcpy(key, b->buf + b->cur_parsed);
-        strcpy(value, tmp + 2);
-        value[strlen(value) - 2] = '\0';
-        if (VERBOSE)
-            printf("key = %s, value = %s\n", key, value);
-        *tmp = ':';
-
-        b->cur_parsed += len;
-
-        put_header(req, key, value);
+        end -= chain_byte(in, end - 2) == '\r' ? 2 : 1;
+        key = chain_strndup(in, start, colon, &req->arena);
+        value = chain_strndup(in, chain_span(in, colon + 1, end, " \t"),
+                              end, &req->arena);
+        if (key == NULL || value == NULL)
+            return -2;
+        PROBE(PR_PARSE, header, "sock %d: %s: %s", b->fd, key, value);
+        link_header(req, key, value);
     }
     b->stage = STAGE_BODY;
-    if (VERBOSE)
-        printf("leaving read request\n");
     return 1;
 }
 
@@ -954,37 +1360,43 @@ void get_time(char *date) {
  *  @return a pointer to the new Requests
  */
 Requests *get_freereq(Buff *b) {
-    Requests *req = b->request;
-    while (req->valid == REQ_VALID) {
-        if (req->next == NULL)
-            break;
-        req = req->next;
-    }
-
-    if (req->valid == REQ_INVALID) {
-        Headers *hdr = req->header;
-        Headers *hdr_pre;
-        while (hdr) {
-            hdr_pre = hdr;
-            hdr = hdr->next;
-            free(hdr_pre);
+    Requests **link, *req = NULL, *tail = NULL;
+
+    /* responses go out in list order, so the request always goes
+       last: a free one is moved to the tail, or a new one added */
+    for (link = &b->cold->request; *link; ) {
+        if (req == NULL && (*link)->valid == REQ_INVALID) {
+            req = *link;
+            *link = req->next;
+            continue;
         }
-        req->header = NULL;
-
-    } else {
-        req->next = (Requests *)malloc(sizeof(Requests));
-
-        req = req->next;
+        tail = *link;
+        link = &(*link)->next;
     }
-    req->pipefd = -1;
+    if (req != NULL)
+        arena_reset(&req->arena);
+    else
+        req = (Requests *)calloc(1, sizeof(Requests));
+    req->next = NULL;
+    if (tail)
+        tail->next = req;
+    else
+        b->cold->request = req;
+    req->job = NULL;
+    req->proxy = NULL;
+    req->route = NULL;
+    memset(req->phase, 0, sizeof(req->phase));
+    req->phase[PH_START] = metrics_now();
     req->response = NULL;
+    req->body = NULL;
+    req->body_fd = -1;
     req->header = NULL;
-    req->next = NULL;
     req->method = NULL;
     req->uri = NULL;
     req->version = NULL;
     req->valid = REQ_INVALID;
     req->post_body = NULL;
+    req->sent = 0;
     return req;
 }
 
@@ -995,85 +1407,86 @@ Requests *get_freereq(Buff *b) {
  *  @return Void
  */
 void put_header(Requests * req, char *key, char *value) {
-    Headers *hdr = req->header;
-    if (req->header == NULL) {
-        req->header = (Headers *)malloc(sizeof(Headers));
-        req->header->next = NULL;
-        req->header->key = (char *)malloc(strlen(key) + 1);
-        req->header->value = (char *)malloc(strlen(value) + 1);
-        strcpy(req->header->key, key);
-        strcpy(req->header->value, value);
-        return;
-    }
+    link_header(req, arena_strdup(&req->arena, key),
+                arena_strdup(&req->arena, value));
+}
 
-    while (hdr->next != NULL)
-        hdr = hdr->next;
+/** @brief Append a header whose strings are already in the arena of
+ *         the request
+ *  @param req the request
+ *  @param key the key string
+ *  @param value the value string
+ *  @return Void
+ */
+static void link_header(Requests *req, char *key, char *value) {
+    Headers **tail = &req->header;
+    Headers *hdr = (Headers *)arena_alloc(&req->arena, sizeof(Headers));
 
-    hdr->next = (Headers *)malloc(sizeof(Headers));
-    hdr = hdr->next;
+    while (*tail != NULL)
+        tail = &(*tail)->next;
     hdr->next = NULL;
-    hdr->key = (char *)malloc(strlen(key) + 1);
-    hdr->value = (char *)malloc(strlen(value) + 1);
-    strcpy(hdr->key, key);
-    strcpy(hdr->value, value);
+    hdr->key = key;
+    hdr->value = value;
+    *tail = hdr;
 }
 
 /** @brief Close given connection
  *  @param p the Pool struct
- *         i the ith connection in the pool
+ *  @param bufi the Buff of the connection
  *  @return Void
  */
-void close_conn(Pool *p, int i) {
-    //if (p->buf[i] == NULL)
-        //return;
-    int conn_sock = p->buf[i]->fd;
+void close_conn(Pool *p, Buff *bufi) {
+    int conn_sock = bufi->fd;
     if (close_socket(conn_sock)) {
         fprintf(stderr, "Error closing client socket.\n");
     }
     p->cur_conn--;
-    free_buf(p, p->buf[i]);
+    ratelimit_disconnect(bufi->cold->rl_slot);
+    free_buf(p, bufi);
     FD_CLR(conn_sock, &p->read_set);
     FD_CLR(conn_sock, &p->write_set);
-    p->buf[i] = NULL;
+    conntab_remove(&p->conns, bufi);
 }
 
 
-/** @brief Parse the uri
- *  @param p the pointer to the pool
- *  @param uri the string of uri
- *  @param filename the pointer to store filename
- *  @param cgiargs the pointer to store cgi args
+/** @brief Parse the uri by the route of the request
+ *         The uri is left whole, the cache key, the log and the CGI
+ *         environment need its query. The part of the path past the
+ *         mount of a folder of files names a file under it
+ *  @param req the request, its route is set
+ *  @param filename the pointer to store the file or the script
+ *  @param cgiargs the pointer to store cgi args, the tail of the uri
  *  @return 1 if it is a static request
  *          0 if it is a dynamic request
  */
-int parse_uri(Pool *p, char *uri, char *filename, char *cgiargs) {
-    char *ptr;
-
-    if (!strstr(uri, "/cgi/")) {
-        strcpy(cgiargs, "");
-        strcpy(filename, p->www);
-        strcat(filename, uri);
-        if (uri[strlen(uri)-1] == '/')
-            strcat(filename, "index.html");
-        if (VERBOSE)
-            printf("Static!\n");
-        return 1;
-    } else {  /* Dynamic content */
-        ptr = index(uri, '?');
-        if (ptr) {
-            strcpy(cgiargs, ptr+1);
-            *ptr = '\0';
-        } else
-            strcpy(cgiargs, "");
-        strcpy(filename, p->cgi);  /* cgi */
-        if (VERBOSE) {
-            printf("Dynamic!\n");
-            printf("uri:%s\n", uri);
-            printf("filename:%s\n", filename);
-            printf("cgiargs:%s\n", cgiargs);
-        }
+int parse_uri(Requests *req, char **filename, char **cgiargs) {
+    Route *r = req->route;
+    char *uri = req->uri, *path, *f;
+    size_t end = strcspn(uri, "?"), len;
+
+    *cgiargs = uri[end] == '?' ? uri + end + 1 : "";
+
+    if (r->handler == ROUTE_CGI) {
+        *filename = (char *)r->target;
+        PROBE(PR_PARSE, dynamic, "%.*s, query %s", (int)end, uri, *cgiargs);
         return 0;
     }
+
+    /* a prefix holds no '?', so the mount ends before the query */
+    path = uri + r->mount_len;
+    while (*path == '/')
+        path++;
+    len = uri + end - path;
+    f = (char *)arena_alloc(&req->arena, r->target_len + len + INDEX_SIZE + 1);
+    memcpy(f, r->target, r->target_len);
+    f[r->target_len] = '/';
+    memcpy(f + r->target_len + 1, path, len);
+    f[r->target_len + 1 + len] = '\0';
+    if (len == 0 || path[len - 1] == '/')
+        memcpy(f + r->target_len + 1 + len, "index.html", INDEX_SIZE);
+    *filename = f;
+    PROBE(PR_PARSE, static, "%s", f);
+    return 1;
 }
 
 
@@ -1097,35 +1510,19 @@ void get_filetype(char *filename, char *filetype) {
         strcpy(filetype, "text/plain");
 }
 
-/** @brief put method, uri and version to the Requests struct
- *  @param req the Requests struct to put things in
- *  @param method the string of method
- *  @param uri the string of uri
- *  @param version the string of version
- *  @return Void
- */
-void put_req(Requests *req, char *method, char *uri, char *version) {
-    req->method = (char *)malloc(strlen(method) + 1);
-    req->uri = (char *)malloc(strlen(uri) + 1);
-    req->version = (char *)malloc(strlen(version) + 1);
-    strcpy(req->method, method);
-    strcpy(req->uri, uri);
-    strcpy(req->version, version);
-}
-
-
 /** @brief Serve static content
  *  @param b the Buff struct that represent a connection
+ *  @param req the request, not the one being read if from an I/O thread
  *  @param filename the name of file to be sent
  *  @param sbuf the stat struct contain file attributes
+ *  @param srcfd the file opened by an I/O thread, -1 to open it here
  *  @return Void
  */
-void serve_static(Buff *b, char *filename, struct stat sbuf) {
-    int srcfd;
-    int filesize = sbuf.st_size;
+void serve_static(Buff *b, Requests *req, char *filename, struct stat sbuf,
+                  int srcfd) {
+    off_t filesize = sbuf.st_size;
     int len = 0;
-    char *srcp, filetype[FILETYPE_SIZE], date[DATE_SIZE], buf[BUF_SIZE];
-    Requests *req = b->cur_request;
+    char filetype[FILETYPE_SIZE], date[DATE_SIZE], buf[BUF_SIZE];
     char modify_time[DATE_SIZE];
 
 
@@ -1135,31 +1532,41 @@ void serve_static(Buff *b, char *filename, struct stat sbuf) {
     get_time(date);
     /* Send response headers to client */
     get_filetype(filename, filetype);
-    sprintf(buf, "HTTP/1.1 200 OK\r\n");
-    sprintf(buf, "%sServer: Liso/1.0\r\n", buf);
-    sprintf(buf, "%sDate:%s\r\n", buf, date);
-    if (b->stage == STAGE_CLOSE)
-        sprintf(buf, "%sConnection: Close\r\n", buf);
-    else
-        sprintf(buf, "%sConnection: Keep-Alive\r\n", buf);
-    sprintf(buf, "%sContent-Length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sLast-Modified:%s\r\n", buf, modify_time);
-    sprintf(buf, "%sContent-Type: %s\r\n\r\n", buf, filetype);
-
-    len = strlen(buf);
-    req->response = (char *)malloc(len + 1);
-    sprintf(req->response, "%s", buf);
+    /* only the last request read may have asked to close */
+    len = snprintf(buf, BUF_SIZE, "HTTP/1.1 200 OK\r\n"
+                   "Server: Liso/1.0\r\n"
+                   "Date:%s\r\n"
+                   "Connection: %s\r\n"
+                   "Content-Length: %lld\r\n"
+                   "Last-Modified:%s\r\n", date,
+                   b->stage == STAGE_CLOSE && req->next == NULL ?
+                   "Close" : "Keep-Alive",
+                   (long long)filesize, modify_time);
+    /* the ttl of the route is for caches on the way */
+    if (req->route != NULL && req->route->ttl >= 0)
+        len += snprintf(buf + len, BUF_SIZE - len,
+                        "Cache-Control: max-age=%d\r\n", req->route->ttl);
+    len += snprintf(buf + len, BUF_SIZE - len,
+                    "Content-Type: %s\r\n\r\n", filetype);
+
+    req->response = (char *)arena_alloc(&req->arena, len + 1);
+    memcpy(req->response, buf, len + 1);
+    req->response_len = len;
 
     if (strcmp(req->method, "HEAD")) {
-        srcfd = open(filename, O_RDONLY, 0);
-        srcp = mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-        req->body = srcp;
-        req->body_size = filesize;
-        close(srcfd);
-        log_write(req, b->addr, date, "200", len + filesize);
+        if (srcfd < 0 &&
+            (srcfd = open(filename, O_RDONLY | O_CLOEXEC, 0)) < 0) {
+            clienterror(req, b->cold->addr, filename, "404", "Not found",
+                        "Liso couldn't find this file");
+            return;
+        }
+        /* only a fd and offsets, whatever the size of the file */
+        stream_open(req, srcfd, filesize);
+        log_write(req, b->cold->addr, date, "200", len + filesize);
     } else {
-        req->body = NULL;
-        log_write(req, b->addr, date, "200", len);
+        if (srcfd >= 0)
+            close(srcfd);
+        log_write(req, b->cold->addr, date, "200", len);
     }
 
 
@@ -1247,7 +1654,7 @@ int daemonize(char* lock_file)
         sprintf(str, "%d\n", getpid());
         write(lfp, str, strlen(str)); /* record pid to lockfile */
 
-        signal(SIGCHLD, SIG_IGN); /* child terminate signal */
+        /* SIGCHLD is left alone, cgi_init() reaps children via signalfd */
 
         signal(SIGHUP, signal_handler); /* hangup signal */
         signal(SIGTERM, signal_handler); /* software termination signal from kill */
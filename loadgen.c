@@ -0,0 +1,769 @@
+/** @file loadgen.c
+ *  @brief Load generator engine shared by liso-bench and liso-replay
+ *         One call to lg_run() drives a set of non-blocking connections
+ *         from one epoll loop, so a tool runs one per thread. Requests
+ *         come from a workload callback and are pipelined up to a depth
+ *         per connection. In LG_RATE and LG_TIMED modes a request's
+ *         latency counts from when it was meant to be sent, not from
+ *         when a connection was free to send it. That way a stalled
+ *         server cannot hide its own queueing (coordinated omission).
+ */
+
+#define _GNU_SOURCE  /* strcasestr(), memmem() */
+
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+
+#include "loadgen.h"
+
+
+/**************** BEGIN CONSTANTS ***************/
+#define IN_SIZE      65536
+#define MAX_EVENTS   256
+#define MAX_HDR      65536
+#define RETRY_US     10000 /* wait after a failed connect before the next */
+
+#define C_IDLE       0     /* closed, opened again when needed */
+#define C_CONNECTING 1
+#define C_HANDSHAKE  2
+#define C_OPEN       3
+
+/**************** END CONSTANTS ***************/
+
+/** @brief A request sent and not answered yet
+ *
+ */
+typedef struct slot {
+    unsigned long long start;   /* us, when it was sent or meant to be */
+    char *req;                  /* for printing a mismatch */
+    int head;
+    int expect_status;
+    long expect_size;
+} Slot;
+
+/** @brief A connection to the server
+ *
+ */
+typedef struct lg_conn {
+    int fd;
+    SSL *ssl;
+    int state;
+    unsigned int events;        /* epoll interest */
+    int want_write;             /* TLS needs the socket writable */
+    char *out;                  /* requests not sent yet */
+    int out_len;
+    int out_off;
+    int out_size;
+    char *in;                   /* responses read so far */
+    int in_len;
+    int in_size;
+    Slot slots[LG_MAX_DEPTH];   /* ring of requests in flight */
+    int first;
+    int n;
+    /* the response being parsed */
+    int hdr_len;
+    int status;
+    long body_len;              /* -1 if not given */
+    int chunked;
+    int chunk_off;
+    int closing;                /* the server closes after it */
+} LgConn;
+
+/** @brief State of one lg_run()
+ *
+ */
+typedef struct engine {
+    LgConf *c;
+    LgStats *s;
+    LgConn *conns;
+    int epfd;
+    int rr;                     /* where to look for a free connection */
+    unsigned long long retry_at;  /* no new connections before then */
+    unsigned long long t0;
+} Engine;
+
+static LgConn *conn_pick(Engine *e);
+static void conn_open(Engine *e, LgConn *c);
+static void conn_close(Engine *e, LgConn *c);
+static void conn_update(Engine *e, LgConn *c);
+static void conn_ready(Engine *e, LgConn *c);
+static void conn_handshake(Engine *e, LgConn *c);
+static void conn_flush(Engine *e, LgConn *c);
+static void conn_read(Engine *e, LgConn *c);
+static int conn_parse(LgConn *c, int eof);
+static void conn_done(Engine *e, LgConn *c, int len);
+static int hist_index(unsigned long long us);
+static unsigned long long hist_value(int i);
+
+
+/** @brief Create the TLS context for https targets
+ *         lisod only speaks TLSv1, so old versions are allowed
+ *  @return the context, NULL on fail
+ */
+SSL_CTX *lg_ssl_init() {
+    SSL_CTX *ctx;
+
+    SSL_load_error_strings();
+    SSL_library_init();
+    if ((ctx = SSL_CTX_new(TLS_client_method())) == NULL)
+        return NULL;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_VERSION);
+    SSL_CTX_set_security_level(ctx, 0);
+    SSL_CTX_set_cipher_list(ctx, "ALL:@SECLEVEL=0");
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                          SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    return ctx;
+}
+
+/** @brief Resolve "host:port"
+ *  @param target the string
+ *  @param addr where to put the address
+ *  @return EXIT_FAILURE on fail
+ *  @return EXIT_SUCCESS on success
+ */
+int lg_parse_target(char *target, struct sockaddr_in *addr) {
+    char host[256], *colon;
+    struct addrinfo hints, *res;
+
+    snprintf(host, sizeof(host), "%s", target);
+    if ((colon = strrchr(host, ':')) == NULL)
+        return EXIT_FAILURE;
+    *colon = '\0';
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res))
+        return EXIT_FAILURE;
+    memcpy(addr, res->ai_addr, sizeof(*addr));
+    freeaddrinfo(res);
+    return EXIT_SUCCESS;
+}
+
+/** @brief Microseconds on the monotonic clock
+ *  @return the time
+ */
+unsigned long long lg_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** @brief Load the server until the workload runs out or time is up
+ *  @param c how to load it
+ *  @param s where to put what was measured, zeroed first
+ *  @return EXIT_FAILURE on fail
+ *  @return EXIT_SUCCESS on success
+ */
+int lg_run(LgConf *c, LgStats *s) {
+    Engine e;
+    LgConn *conn;
+    LgReq req;
+    struct epoll_event ev[MAX_EVENTS];
+    unsigned long long now, seq = 0, wait;
+    int i, n, have = 0, exhausted = 0, in_flight, timeout;
+    Slot *slot;
+
+    memset(s, 0, sizeof(LgStats));
+    memset(&e, 0, sizeof(e));
+    e.c = c;
+    e.s = s;
+    if (!c->keepalive || c->depth < 1)
+        c->depth = 1;
+    if (c->depth > LG_MAX_DEPTH)
+        c->depth = LG_MAX_DEPTH;
+    if ((e.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return EXIT_FAILURE;
+    e.conns = (LgConn *)calloc(c->conns, sizeof(LgConn));
+    for (i = 0; i < c->conns; i++)
+        e.conns[i].fd = -1;
+    e.t0 = lg_now();
+
+    while (1) {
+        now = lg_now();
+        if (c->duration && now - e.t0 >= c->duration)
+            break;
+
+        /* hand out every request that is due */
+        while (!exhausted) {
+            if (!have) {
+                if (!c->next(c->ctx, &req)) {
+                    exhausted = 1;
+                    break;
+                }
+                have = 1;
+                if (c->mode == LG_RATE)
+                    req.at = (unsigned long long)(seq / c->rate * 1e6);
+                seq++;
+            }
+            if (c->mode != LG_CLOSED && e.t0 + req.at > now)
+                break;
+            if ((conn = conn_pick(&e)) == NULL)
+                break;
+            if (conn->out_size - conn->out_len < req.len) {
+                conn->out_size = conn->out_len + req.len + IN_SIZE;
+                conn->out = (char *)realloc(conn->out, conn->out_size);
+            }
+            memcpy(conn->out + conn->out_len, req.data, req.len);
+            conn->out_len += req.len;
+            slot = &conn->slots[(conn->first + conn->n) % LG_MAX_DEPTH];
+            slot->start = c->mode == LG_CLOSED ? now : e.t0 + req.at;
+            slot->req = req.data;
+            slot->head = req.head;
+            slot->expect_status = req.expect_status;
+            slot->expect_size = req.expect_size;
+            conn->n++;
+            s->sent++;
+            have = 0;
+            if (conn->state == C_OPEN)
+                conn_flush(&e, conn);
+        }
+
+        for (i = in_flight = 0; i < c->conns; i++)
+            in_flight += e.conns[i].n;
+        if (exhausted && in_flight == 0)
+            break;
+
+        /* sleep until the next request is due, or something happens */
+        timeout = 100;
+        if (have && c->mode != LG_CLOSED) {
+            wait = e.t0 + req.at > now ? e.t0 + req.at - now : 0;
+            if (wait / 1000 < (unsigned long long)timeout)
+                timeout = wait / 1000;
+        }
+        if (e.retry_at > now && (e.retry_at - now) / 1000 + 1 <
+                                (unsigned long long)timeout)
+            timeout = (e.retry_at - now) / 1000 + 1;
+        if (c->duration && (e.t0 + c->duration - now) / 1000 <
+                           (unsigned long long)timeout)
+            timeout = (e.t0 + c->duration - now) / 1000;
+
+        n = epoll_wait(e.epfd, ev, MAX_EVENTS, timeout);
+        for (i = 0; i < n; i++) {
+            conn = (LgConn *)ev[i].data.ptr;
+            if (conn->state == C_CONNECTING)
+                conn_ready(&e, conn);
+            if (conn->state == C_HANDSHAKE)
+                conn_handshake(&e, conn);
+            if (conn->state == C_OPEN && (ev[i].events & EPOLLOUT))
+                conn_flush(&e, conn);
+            if (conn->state == C_OPEN &&
+                (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                conn_read(&e, conn);
+        }
+    }
+
+    s->elapsed = lg_now() - e.t0;
+    for (i = 0; i < c->conns; i++) {
+        s->unfinished += e.conns[i].n;
+        e.conns[i].n = 0;
+        if (e.conns[i].state != C_IDLE)
+            conn_close(&e, &e.conns[i]);
+        free(e.conns[i].out);
+        free(e.conns[i].in);
+    }
+    free(e.conns);
+    close(e.epfd);
+    return EXIT_SUCCESS;
+}
+
+/** @brief Find a connection with room for one more request,
+ *         opening one if needed
+ *  @param e the engine
+ *  @return the connection, NULL if all are full
+ */
+static LgConn *conn_pick(Engine *e) {
+    LgConn *c;
+    int i;
+
+    for (i = 0; i < e->c->conns; i++) {
+        c = &e->conns[(e->rr + i) % e->c->conns];
+        if (c->n >= e->c->depth || c->closing ||
+            (c->state == C_IDLE && lg_now() < e->retry_at))
+            continue;
+        e->rr = (e->rr + i + 1) % e->c->conns;
+        if (c->state == C_IDLE)
+            conn_open(e, c);
+        return c->state == C_IDLE ? NULL : c;
+    }
+    return NULL;
+}
+
+/** @brief Start connecting
+ *  @param e the engine
+ *  @param c the connection
+ *  @return Void
+ */
+static void conn_open(Engine *e, LgConn *c) {
+    struct epoll_event ev;
+    int yes = 1;
+
+    e->s->connects++;
+    if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        0)) < 0) {
+        e->s->conn_errors++;
+        e->retry_at = lg_now() + RETRY_US;
+        return;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    if (connect(c->fd, (struct sockaddr *)&e->c->addr,
+                sizeof(e->c->addr)) < 0 && errno != EINPROGRESS) {
+        e->s->conn_errors++;
+        e->retry_at = lg_now() + RETRY_US;
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+    c->state = C_CONNECTING;
+    c->events = EPOLLIN | EPOLLOUT;
+    ev.events = c->events;
+    ev.data.ptr = c;
+    epoll_ctl(e->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+/** @brief Close a connection, requests in flight on it are lost
+ *  @param e the engine
+ *  @param c the connection
+ *  @return Void
+ */
+static void conn_close(Engine *e, LgConn *c) {
+    e->s->io_errors += c->n;
+    epoll_ctl(e->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    if (c->ssl)
+        SSL_free(c->ssl);
+    close(c->fd);
+    c->ssl = NULL;
+    c->fd = -1;
+    c->state = C_IDLE;
+    c->n = c->first = 0;
+    c->out_len = c->out_off = c->in_len = 0;
+    c->hdr_len = 0;
+    c->closing = 0;
+    c->want_write = 0;
+}
+
+/** @brief Select on what the connection waits for
+ *  @param e the engine
+ *  @param c the connection
+ *  @return Void
+ */
+static void conn_update(Engine *e, LgConn *c) {
+    struct epoll_event ev;
+    unsigned int events = EPOLLIN;
+
+    if (c->state == C_CONNECTING || c->want_write ||
+        (c->state == C_OPEN && c->out_off < c->out_len))
+        events |= EPOLLOUT;
+    if (events == c->events)
+        return;
+    c->events = events;
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(e->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/** @brief Finish a non-blocking connect
+ *  @param e the engine
+ *  @param c the connection
+ *  @return Void
+ */
+static void conn_ready(Engine *e, LgConn *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err) {
+        e->s->conn_errors++;
+        e->retry_at = lg_now() + RETRY_US;
+        c->n = 0;  /* never sent, not lost */
+        conn_close(e, c);
+        return;
+    }
+    if (e->c->ssl) {
+        c->ssl = SSL_new(e->c->ssl);
+        SSL_set_fd(c->ssl, c->fd);
+        SSL_set_connect_state(c->ssl);
+        c->state = C_HANDSHAKE;
+        return;
+    }
+    c->state = C_OPEN;
+    conn_flush(e, c);
+}
+
+/** @brief Move the TLS handshake along
+ *  @param e the engine
+ *  @param c the connection
+ *  @return Void
+ */
+static void conn_handshake(Engine *e, LgConn *c) {
+    int ret = SSL_do_handshake(c->ssl);
+
+    if (ret == 1) {
+        c->state = C_OPEN;
+        c->want_write = 0;
+        conn_flush(e, c);
+        return;
+    }
+    switch (SSL_get_error(c->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+        c->want_write = 0;
+        conn_update(e, c);
+        break;
+    case SSL_ERROR_WANT_WRITE:
+        c->want_write = 1;
+        conn_update(e, c);
+        break;
+    default:
+        e->s->conn_errors++;
+        e->retry_at = lg_now() + RETRY_US;
+        c->n = 0;
+        conn_close(e, c);
+    }
+}
+
+/** @brief Send what is buffered
+ *  @param e the engine
+ *  @param c the connection
+ *  @return Void
+ */
+static void conn_flush(Engine *e, LgConn *c) {
+    int ret;
+
+    c->want_write = 0;
+    while (c->out_off < c->out_len) {
+        if (c->ssl) {
+            ret = SSL_write(c->ssl, c->out + c->out_off,
+                            c->out_len - c->out_off);
+            if (ret <= 0) {
+                ret = SSL_get_error(c->ssl, ret);
+                if (ret == SSL_ERROR_WANT_WRITE || ret == SSL_ERROR_WANT_READ)
+                    break;
+                conn_close(e, c);
+                return;
+            }
+        } else {
+            ret = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                       MSG_NOSIGNAL);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret < 0 && errno == EAGAIN)
+                break;
+            if (ret < 0) {
+                conn_close(e, c);
+                return;
+            }
+        }
+        c->out_off += ret;
+    }
+    if (c->out_off == c->out_len)
+        c->out_off = c->out_len = 0;
+    conn_update(e, c);
+}
+
+/** @brief Read responses that have arrived
+ *  @param e the engine
+ *  @param c the connection
+ *  @return Void
+ */
+static void conn_read(Engine *e, LgConn *c) {
+    int ret, len, eof = 0;
+
+    while (1) {
+        if (c->in_size - c->in_len < IN_SIZE / 4) {
+            c->in_size = c->in_size ? c->in_size * 2 : IN_SIZE;
+            c->in = (char *)realloc(c->in, c->in_size);
+        }
+        if (c->ssl) {
+            ret = SSL_read(c->ssl, c->in + c->in_len, c->in_size - c->in_len);
+            if (ret <= 0) {
+                ret = SSL_get_error(c->ssl, ret);
+                if (ret == SSL_ERROR_WANT_READ || ret == SSL_ERROR_WANT_WRITE)
+                    break;
+                eof = 1;
+                break;
+            }
+        } else {
+            ret = recv(c->fd, c->in + c->in_len, c->in_size - c->in_len, 0);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret < 0 && errno == EAGAIN)
+                break;
+            if (ret <= 0) {
+                eof = 1;
+                break;
+            }
+        }
+        c->in_len += ret;
+        e->s->bytes_in += ret;
+        /* take complete responses off as they come */
+        while (c->n > 0 && (len = conn_parse(c, 0)) > 0) {
+            conn_done(e, c, len);
+            if (c->state != C_OPEN)
+                return;
+        }
+        if (len < 0) {
+            conn_close(e, c);
+            return;
+        }
+    }
+
+    if (eof) {
+        /* a body that runs until the server closes is done now */
+        if (c->n > 0 && (len = conn_parse(c, 1)) > 0)
+            conn_done(e, c, len);
+        if (c->state != C_IDLE)
+            conn_close(e, c);
+    }
+}
+
+/** @brief Parse the response at the start of the input
+ *  @param c the connection
+ *  @param eof whether the server has closed
+ *  @return its length when complete, 0 if more is to come, -1 if malformed
+ */
+static int conn_parse(LgConn *c, int eof) {
+    Slot *slot = &c->slots[c->first];
+    char *end, *line, *eol, *p;
+    long size;
+    int line_len;
+
+    if (c->hdr_len == 0) {
+        if ((end = memmem(c->in, c->in_len, "\r\n\r\n", 4)) == NULL)
+            return c->in_len > MAX_HDR ? -1 : 0;
+        if (c->in_len < 12 || strncmp(c->in, "HTTP/1.", 7))
+            return -1;
+        c->hdr_len = end + 4 - c->in;
+        c->status = atoi(c->in + 9);
+        c->body_len = -1;
+        c->chunked = 0;
+        for (line = memmem(c->in, c->hdr_len, "\r\n", 2) + 2;
+             line < end; line = eol + 2) {
+            eol = memmem(line, end + 2 - line, "\r\n", 2);
+            if ((p = memchr(line, ':', eol - line)) == NULL)
+                continue;
+            if (p - line == 14 && !strncasecmp(line, "Content-Length", 14))
+                c->body_len = atol(p + 1);
+            else if (p - line == 17 &&
+                     !strncasecmp(line, "Transfer-Encoding", 17) &&
+                     memmem(p, eol - p, "chunked", 7))
+                c->chunked = 1;
+            else if (p - line == 10 && !strncasecmp(line, "Connection", 10) &&
+                     (memmem(p, eol - p, "close", 5) ||
+                      memmem(p, eol - p, "Close", 5)))
+                c->closing = 1;
+        }
+        if (slot->head || c->status == 204 || c->status == 304 ||
+            c->status < 200)
+            c->body_len = 0;
+        c->chunk_off = c->hdr_len;
+    }
+
+    if (c->chunked && c->body_len != 0) {
+        while (1) {
+            line = c->in + c->chunk_off;
+            if ((eol = memmem(line, c->in_len - c->chunk_off, "\r\n", 2))
+                == NULL)
+                return 0;
+            line_len = eol + 2 - line;
+            if ((size = strtol(line, NULL, 16)) < 0)
+                return -1;
+            if (size == 0) {
+                if ((end = memmem(line, c->in_len - c->chunk_off,
+                                  "\r\n\r\n", 4)) == NULL)
+                    return 0;
+                return end + 4 - c->in;
+            }
+            if (c->chunk_off + line_len + size + 2 > c->in_len)
+                return 0;
+            c->chunk_off += line_len + size + 2;
+        }
+    }
+    if (c->body_len >= 0)
+        return c->in_len >= c->hdr_len + c->body_len ?
+               c->hdr_len + c->body_len : 0;
+    /* no length given, the body runs until the server closes */
+    return eof ? c->in_len : 0;
+}
+
+/** @brief Account for a complete response and drop it from the input
+ *  @param e the engine
+ *  @param c the connection
+ *  @param len length of the response
+ *  @return Void
+ */
+static void conn_done(Engine *e, LgConn *c, int len) {
+    Slot *slot = &c->slots[c->first];
+    unsigned long long now = lg_now();
+    int mismatch = 0;
+
+    lg_hist_add(&e->s->latency, now > slot->start ? now - slot->start : 0);
+    e->s->done++;
+    e->s->status[c->status >= 100 && c->status < 600 ? c->status / 100 : 0]++;
+    if (slot->expect_status && slot->expect_status != c->status)
+        mismatch = 1;
+    if (slot->expect_size >= 0 && labs(slot->expect_size - len) >
+                                  e->c->size_slack)
+        mismatch = 1;
+    if (mismatch) {
+        e->s->mismatches++;
+        if (e->c->verbose)
+            fprintf(stderr, "mismatch: %.*s: expected %d %ld, got %d %d\n",
+                    (int)strcspn(slot->req, "\r"), slot->req,
+                    slot->expect_status, slot->expect_size, c->status, len);
+    }
+
+    c->first = (c->first + 1) % LG_MAX_DEPTH;
+    c->n--;
+    c->in_len -= len;
+    memmove(c->in, c->in + len, c->in_len);
+    c->hdr_len = 0;
+    if (c->closing || !e->c->keepalive)
+        conn_close(e, c);
+}
+
+/** @brief Add up the results of several runs
+ *  @param to the sum
+ *  @param from a run
+ *  @return Void
+ */
+void lg_merge(LgStats *to, LgStats *from) {
+    int i;
+
+    to->sent += from->sent;
+    to->done += from->done;
+    for (i = 0; i < 6; i++)
+        to->status[i] += from->status[i];
+    to->mismatches += from->mismatches;
+    to->connects += from->connects;
+    to->conn_errors += from->conn_errors;
+    to->io_errors += from->io_errors;
+    to->unfinished += from->unfinished;
+    to->bytes_in += from->bytes_in;
+    if (from->elapsed > to->elapsed)
+        to->elapsed = from->elapsed;
+    for (i = 0; i < LG_HIST_BUCKETS; i++)
+        to->latency.buckets[i] += from->latency.buckets[i];
+    to->latency.count += from->latency.count;
+    to->latency.sum += from->latency.sum;
+    if (from->latency.max > to->latency.max)
+        to->latency.max = from->latency.max;
+}
+
+/** @brief Print what a run measured
+ *  @param fp where to
+ *  @param s the results
+ *  @param json one JSON object instead of a table
+ *  @return Void
+ */
+void lg_report(FILE *fp, LgStats *s, int json) {
+    static const double q[] = {0.5, 0.9, 0.99, 0.999};
+    static const char *qname[] = {"p50", "p90", "p99", "p99.9"};
+    double secs = s->elapsed / 1e6;
+    LgHist *h = &s->latency;
+    int i;
+
+    if (secs <= 0)
+        secs = 1e-6;
+    if (json) {
+        fprintf(fp, "{\"requests\":%lu,\"seconds\":%.3f,\"rps\":%.1f,"
+                    "\"bytes\":%llu,\"1xx\":%lu,\"2xx\":%lu,\"3xx\":%lu,"
+                    "\"4xx\":%lu,\"5xx\":%lu,\"mismatches\":%lu,"
+                    "\"connects\":%lu,\"conn_errors\":%lu,\"io_errors\":%lu,"
+                    "\"unfinished\":%lu,\"mean_us\":%.1f",
+                s->done, secs, s->done / secs, s->bytes_in, s->status[1],
+                s->status[2], s->status[3], s->status[4], s->status[5],
+                s->mismatches, s->connects, s->conn_errors, s->io_errors,
+                s->unfinished, h->count ? (double)h->sum / h->count : 0);
+        for (i = 0; i < 4; i++)
+            fprintf(fp, ",\"%s_us\":%llu", qname[i],
+                    lg_hist_percentile(h, q[i]));
+        fprintf(fp, ",\"max_us\":%llu}\n", h->max);
+        return;
+    }
+    fprintf(fp, "requests     %lu in %.2fs, %.1f req/s, %.2f MB/s\n",
+            s->done, secs, s->done / secs, s->bytes_in / secs / 1e6);
+    fprintf(fp, "responses    1xx %lu  2xx %lu  3xx %lu  4xx %lu  5xx %lu"
+                "  other %lu\n", s->status[1], s->status[2], s->status[3],
+            s->status[4], s->status[5], s->status[0]);
+    fprintf(fp, "errors       connect %lu  lost %lu  unfinished %lu"
+                "  mismatched %lu  (%lu connects)\n",
+            s->conn_errors, s->io_errors, s->unfinished, s->mismatches,
+            s->connects);
+    fprintf(fp, "latency      mean %.3fms", h->count ?
+            (double)h->sum / h->count / 1000 : 0);
+    for (i = 0; i < 4; i++)
+        fprintf(fp, "  %s %.3fms", qname[i],
+                lg_hist_percentile(h, q[i]) / 1000.0);
+    fprintf(fp, "  max %.3fms\n", h->max / 1000.0);
+}
+
+/** @brief Add a sample to a histogram
+ *  @param h the histogram
+ *  @param us the sample
+ *  @return Void
+ */
+void lg_hist_add(LgHist *h, unsigned long long us) {
+    h->buckets[hist_index(us)]++;
+    h->count++;
+    h->sum += us;
+    if (us > h->max)
+        h->max = us;
+}
+
+/** @brief Value below which a fraction of the samples fall
+ *  @param h the histogram
+ *  @param q the fraction
+ *  @return the value in microseconds
+ */
+unsigned long long lg_hist_percentile(LgHist *h, double q) {
+    unsigned long rank, cum = 0;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+    rank = (unsigned long)(q * h->count);
+    if (rank >= h->count)
+        rank = h->count - 1;
+    for (i = 0; i < LG_HIST_BUCKETS; i++) {
+        cum += h->buckets[i];
+        if (cum > rank)
+            break;
+    }
+    return hist_value(i) < h->max ? hist_value(i) : h->max;
+}
+
+/** @brief Bucket of a sample, the top LG_HIST_SUB_BITS + 1 bits of it
+ *  @param us the sample
+ *  @return the bucket
+ */
+static int hist_index(unsigned long long us) {
+    int e;
+
+    if (us < LG_HIST_SUB)
+        return us;
+    e = 63 - __builtin_clzll(us);
+    if (e - LG_HIST_SUB_BITS + 1 >= LG_HIST_BUCKETS / LG_HIST_SUB)
+        return LG_HIST_BUCKETS - 1;
+    return (e - LG_HIST_SUB_BITS + 1) * LG_HIST_SUB +
+           ((us >> (e - LG_HIST_SUB_BITS)) & (LG_HIST_SUB - 1));
+}
+
+/** @brief Largest sample that falls in a bucket
+ *  @param i the bucket
+ *  @return the sample in microseconds
+ */
+static unsigned long long hist_value(int i) {
+    int e, sub;
+
+    if (i < LG_HIST_SUB)
+        return i;
+    e = i / LG_HIST_SUB + LG_HIST_SUB_BITS - 1;
+    sub = i % LG_HIST_SUB;
+    return ((unsigned long long)(LG_HIST_SUB + sub + 1)
+            << (e - LG_HIST_SUB_BITS)) - 1;
+}
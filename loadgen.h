@@ -0,0 +1,94 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/ssl.h>
+
+
+#define LG_MAX_DEPTH      256   /* Max requests in flight per connection */
+#define LG_HIST_SUB_BITS  5     /* 32 buckets per power of two, 3% error */
+#define LG_HIST_SUB       (1 << LG_HIST_SUB_BITS)
+#define LG_HIST_BUCKETS   (LG_HIST_SUB * 40)
+
+#define LG_CLOSED         0     /* send as soon as a slot frees up */
+#define LG_RATE           1     /* fixed rate, latency from intended start */
+#define LG_TIMED          2     /* at the times the requests carry */
+
+/** @brief Log-linear latency histogram in microseconds
+ *
+ */
+typedef struct lg_hist {
+    unsigned long buckets[LG_HIST_BUCKETS];
+    unsigned long count;
+    unsigned long long sum;
+    unsigned long long max;
+} LgHist;
+
+/** @brief A request handed to the engine by the workload
+ *
+ */
+typedef struct lg_req {
+    char *data;                 /* the whole request, not copied */
+    int len;
+    int head;                   /* response has no body */
+    unsigned long long at;      /* LG_TIMED: us after the start to send it */
+    int expect_status;          /* 0 to not check */
+    long expect_size;           /* response bytes with headers, -1: no check */
+} LgReq;
+
+/** @brief What one run measured
+ *
+ */
+typedef struct lg_stats {
+    unsigned long sent;
+    unsigned long done;
+    unsigned long status[6];      /* by status class, 0 for unparsable */
+    unsigned long mismatches;     /* status or size not as expected */
+    unsigned long connects;
+    unsigned long conn_errors;    /* failed connects and handshakes */
+    unsigned long io_errors;      /* connections lost with requests in flight */
+    unsigned long unfinished;     /* still in flight at the end */
+    unsigned long long bytes_in;
+    unsigned long long elapsed;   /* us */
+    LgHist latency;
+} LgStats;
+
+/** @brief How to load the server
+ *
+ */
+typedef struct lg_conf {
+    struct sockaddr_in addr;
+    SSL_CTX *ssl;               /* NULL for plain http */
+    int conns;
+    int depth;                  /* pipelined requests per connection */
+    int keepalive;              /* else one request per connection */
+    int mode;
+    double rate;                /* LG_RATE: requests per second */
+    unsigned long long duration; /* us, 0 until the workload runs out */
+    int verbose;                /* print mismatching responses */
+    long size_slack;            /* bytes a size may be off by and match */
+    /* fill in the next request, return 0 when there are no more */
+    int (*next)(void *ctx, LgReq *r);
+    void *ctx;
+} LgConf;
+
+
+/* Load generator package */
+SSL_CTX *lg_ssl_init(void);
+int lg_run(LgConf *c, LgStats *s);
+void lg_merge(LgStats *to, LgStats *from);
+void lg_report(FILE *fp, LgStats *s, int json);
+unsigned long long lg_now(void);
+void lg_hist_add(LgHist *h, unsigned long long us);
+unsigned long long lg_hist_percentile(LgHist *h, double q);
+int lg_parse_target(char *target, struct sockaddr_in *addr);
+
+#endif
@@ -1,31 +1,96 @@
 /* Author: Kiran Kumar Lekkala */
 /* This source code takes care of initializing and providing the logging module for the http server */
+/* Records are formatted into a ring owned by the logging thread and */
+/* written out in batches with writev() by a flusher thread, so the  */
+/* event loop never waits on the disk.                               */
 
  
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
 #include "loglib.h"
+#include "conf.h"
 
 int log_file;
 
+static LogRing *rings = NULL;          /* every thread that has logged */
+static __thread LogRing *my_ring = NULL;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher;
+static int started = 0;
+static volatile int stopping = 0;
+static volatile sig_atomic_t reopen = 0;
+static char log_path[LOG_PATH_SIZE];
+static int n_rings = 0;
+
+static void *log_flusher(void *arg);
+static void log_drain(void);
+static void log_push(char *str, size_t len);
+static LogRing *log_ring(void);
+static void log_writev(int fd, struct iovec *iov, int cnt);
+static int log_collect(LogRing *r, struct iovec *iov, char *note,
+                       size_t *head);
+static void log_reopen_files(void);
+static int log_open(char *path);
+static int log_open_worker(LogRing *r);
+static int log_binary_access(unsigned char *rec, Requests *req, char *addr,
+                             char *status, long long size);
+static int log_binary_text(unsigned char *rec, char *str, int len);
+static int put_varint(unsigned char *p, unsigned long long v);
+static int put_string(unsigned char *p, char *s, int len);
+static int log_code(const char **table, char *s);
+
 /* Initializing the loging module */
 /* arg: log file */
 /* return: void */ 
 void log_init(char *file) {
-	log_file = open(file, O_RDWR|O_CREAT, 0640);
+	int fd;
+
+	snprintf(log_path, LOG_PATH_SIZE, "%s", file);
+	log_file = log_open(log_path);
+	if (conf.error_log && (fd = open(conf.error_log,
+	                                 O_WRONLY|O_CREAT|O_APPEND, 0640)) >= 0) {
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	}
+	stopping = 0;
+	if (pthread_create(&flusher, NULL, log_flusher, NULL) == 0)
+		started = 1;
+	else
+		fprintf(stderr, "Failed creating log flusher, logging synchronously.\n");
 }
 
 /* write a log record with date*/
 /* arg: struct req, address,date, status and size */
 /* return: void */
-void log_write(Requests *req, char *addr, char *date, char *status, int size) {
-	char str[256] = {0};
-	sprintf(str, "%s [%s] \"%s %s %s\" %s %d\n", addr,
+void log_write(Requests *req, char *addr, char *date, char *status,
+               long long size) {
+	char str[LOG_RECORD];
+	int len;
+
+	if (conf.log_binary) {
+		len = log_binary_access((unsigned char *)str, req, addr, status, size);
+		log_push(str, len);
+		return;
+	}
+	len = snprintf(str, LOG_RECORD, "%s [%s] \"%s %s %s\" %s %lld\n", addr,
 	                                            date, 
 	                                            req->method, 
 	                                            req->uri, 
 	                                            req->version, 
 	                                            status, 
 	                                            size);
-    write(log_file, str, strlen(str)); 
+	if (len >= LOG_RECORD) {
+		len = LOG_RECORD - 1;
+		str[len - 1] = '\n';
+	}
+	log_push(str, len);
 }
 
 /** @brief write a formated string to log
@@ -33,19 +98,434 @@ void log_write(Requests *req, char *addr, char *date, char *status, int size) {
  *  @return void
  */
 void log_write_string(char *format, ...) {
-	char str[256] = {0};
+	char str[LOG_RECORD];
+	int len;
 	va_list args;
     va_start(args, format);
-	vsprintf(str, format, args);
-	write(log_file, str, strlen(str)); 
-	//fflush(log_file);
+	len = vsnprintf(str, LOG_RECORD, format, args);
 	va_end(args);
+	if (len >= LOG_RECORD)
+		len = LOG_RECORD - 1;
+	if (conf.log_binary) {
+		char rec[LOG_RECORD + 16];
+		log_push(rec, log_binary_text((unsigned char *)rec, str, len));
+		return;
+	}
+	log_push(str, len);
 }
 
 
-/** @brief close log file
+/** @brief close log file, after writing out what is buffered
  *  @return Void
  */
 void log_close() {
+	LogRing *r;
+
+	if (started) {
+		stopping = 1;
+		pthread_mutex_lock(&log_lock);
+		pthread_cond_signal(&log_wake);
+		pthread_mutex_unlock(&log_lock);
+		pthread_join(flusher, NULL);
+		started = 0;
+	}
+	for (r = rings; r; r = r->next)
+		if (r->fd >= 0 && r->fd != log_file)
+			close(r->fd);
 	close(log_file);
 }
+
+
+/** @brief Copy a record into the ring of the calling thread
+ *         When the ring is full, conf.log_overflow decides whether to
+ *         wait for the flusher, drop the record, or keep 1 in
+ *         conf.log_sample records once it is three quarters full
+ *  @param str the formatted record
+ *  @param len length of str
+ *  @return Void
+ */
+static void log_push(char *str, size_t len) {
+	LogRing *r;
+	size_t head, used, off, n;
+	struct timespec pause = {0, 1000000};
+
+	if (!started) {
+		write(log_file, str, len);
+		return;
+	}
+	if ((r = log_ring()) == NULL)
+		return;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	used = head - atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (conf.log_overflow == LOG_OVERFLOW_SAMPLE && used > r->size / 4 * 3 &&
+	    r->sampled++ % conf.log_sample) {
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	while (r->size - used < len) {
+		if (conf.log_overflow != LOG_OVERFLOW_BLOCK) {
+			atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+			return;
+		}
+		pthread_mutex_lock(&log_lock);
+		pthread_cond_signal(&log_wake);
+		pthread_mutex_unlock(&log_lock);
+		nanosleep(&pause, NULL);
+		used = head - atomic_load_explicit(&r->tail, memory_order_acquire);
+	}
+	if (used <= r->size / 4 * 3)
+		r->sampled = 0;
+
+	off = head & (r->size - 1);
+	n = r->size - off < len ? r->size - off : len;
+	memcpy(r->data + off, str, n);
+	memcpy(r->data, str + n, len - n);
+	atomic_store_explicit(&r->head, head + len, memory_order_release);
+
+	/* hurry the flusher up once half full rather than wait a full interval */
+	if (used < r->size / 2 && used + len >= r->size / 2) {
+		pthread_mutex_lock(&log_lock);
+		pthread_cond_signal(&log_wake);
+		pthread_mutex_unlock(&log_lock);
+	}
+}
+
+/** @brief Get the ring of the calling thread, creating it on first use
+ *  @return the ring, NULL if out of memory
+ */
+static LogRing *log_ring() {
+	LogRing *r;
+	size_t size = 4096;
+
+	if (my_ring != NULL)
+		return my_ring;
+	while (size < (size_t)conf.log_ring)
+		size <<= 1;
+	if ((r = (LogRing *)calloc(1, sizeof(LogRing))) == NULL)
+		return NULL;
+	if ((r->data = (char *)malloc(size)) == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->size = size;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->dropped, 0);
+	r->fd = -1;
+
+	pthread_mutex_lock(&log_lock);
+	r->index = n_rings++;
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&log_lock);
+	my_ring = r;
+	return r;
+}
+
+/** @brief Flusher thread, writes the rings out every conf.log_flush ms
+ *         or sooner when a ring fills up, and reopens the log files
+ *         when log_reopen() asked for it
+ *  @param arg unused
+ *  @return NULL
+ */
+static void *log_flusher(void *arg) {
+	struct timespec ts;
+	sigset_t mask;
+
+	/* signals are for the event loop */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	while (!stopping) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += (long)conf.log_flush * 1000000;
+		ts.tv_sec += ts.tv_nsec / 1000000000;
+		ts.tv_nsec %= 1000000000;
+		pthread_mutex_lock(&log_lock);
+		if (!stopping)
+			pthread_cond_timedwait(&log_wake, &log_lock, &ts);
+		pthread_mutex_unlock(&log_lock);
+		log_drain();
+		if (reopen) {
+			reopen = 0;
+			log_reopen_files();
+		}
+	}
+	log_drain();
+	return NULL;
+}
+
+/** @brief Write out everything logged so far with as few writev() as
+ *         possible, plus a note of records dropped since last time
+ *  @return Void
+ */
+static void log_drain() {
+	struct iovec iov[LOG_IOV];
+	LogRing *r, *list;
+	size_t head[LOG_IOV];
+	LogRing *done[LOG_IOV];
+	char note[LOG_IOV][64];
+	int cnt = 0, n_done = 0, n, i;
+
+	pthread_mutex_lock(&log_lock);
+	list = rings;
+	pthread_mutex_unlock(&log_lock);
+
+	for (r = list; r; r = r->next) {
+		if (conf.log_per_worker) {
+			/* a file of its own, nothing to batch with */
+			if (r->fd < 0 && (r->fd = log_open_worker(r)) < 0)
+				r->fd = log_file;
+			if ((n = log_collect(r, iov, note[0], &head[0])) > 0)
+				log_writev(r->fd, iov, n);
+			atomic_store_explicit(&r->tail, head[0], memory_order_release);
+			continue;
+		}
+		/* room for both halves of a wrapped ring and a note */
+		if (cnt + 3 > LOG_IOV) {
+			log_writev(log_file, iov, cnt);
+			for (i = 0; i < n_done; i++)
+				atomic_store_explicit(&done[i]->tail, head[i],
+				                      memory_order_release);
+			cnt = n_done = 0;
+		}
+		cnt += log_collect(r, iov + cnt, note[n_done], &head[n_done]);
+		done[n_done++] = r;
+	}
+	if (cnt > 0)
+		log_writev(log_file, iov, cnt);
+	for (i = 0; i < n_done; i++)
+		atomic_store_explicit(&done[i]->tail, head[i], memory_order_release);
+}
+
+/** @brief Point iovecs at what a ring holds, and at a note of records
+ *         it dropped
+ *  @param r the ring
+ *  @param iov where to put up to 3 iovecs
+ *  @param note 64 bytes for the note
+ *  @param head where to put the position the ring is written up to
+ *  @return number of iovecs used
+ */
+static int log_collect(LogRing *r, struct iovec *iov, char *note,
+                       size_t *head) {
+	size_t tail, off, len;
+	unsigned long dropped;
+	char text[48];
+	int cnt = 0;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	*head = atomic_load_explicit(&r->head, memory_order_acquire);
+	len = *head - tail;
+	off = tail & (r->size - 1);
+	if (len > 0) {
+		iov[cnt].iov_base = r->data + off;
+		iov[cnt].iov_len = r->size - off < len ? r->size - off : len;
+		if (iov[cnt].iov_len < len) {
+			iov[cnt + 1].iov_base = r->data;
+			iov[cnt + 1].iov_len = len - iov[cnt].iov_len;
+			cnt++;
+		}
+		cnt++;
+	}
+	if ((dropped = atomic_exchange_explicit(&r->dropped, 0,
+	                                        memory_order_relaxed))) {
+		len = sprintf(text, "Log dropped %lu records\n", dropped);
+		if (conf.log_binary)
+			len = log_binary_text((unsigned char *)note, text, len);
+		else
+			memcpy(note, text, len);
+		iov[cnt].iov_base = note;
+		iov[cnt].iov_len = len;
+		cnt++;
+	}
+	return cnt;
+}
+
+/** @brief writev() all of iov, resuming after partial writes
+ *  @param fd the file
+ *  @param iov the buffers
+ *  @param cnt number of buffers
+ *  @return Void
+ */
+static void log_writev(int fd, struct iovec *iov, int cnt) {
+	ssize_t ret;
+
+	while (cnt > 0) {
+		ret = writev(fd, iov, cnt);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return;
+		while (cnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+}
+
+/** @brief Ask the flusher to reopen the log files, e.g. after they
+ *         were renamed for rotation. Safe to call from a signal handler,
+ *         what is buffered goes to the old files first
+ *  @return Void
+ */
+void log_reopen() {
+	reopen = 1;
+}
+
+/** @brief Reopen the access, error and per-worker logs. dup2() swaps
+ *         each file in place, so the descriptors never go invalid
+ *  @return Void
+ */
+static void log_reopen_files() {
+	LogRing *r, *list;
+	int fd;
+
+	if ((fd = log_open(log_path)) >= 0) {
+		dup2(fd, log_file);
+		close(fd);
+	}
+	if (conf.error_log && (fd = open(conf.error_log,
+	                                 O_WRONLY|O_CREAT|O_APPEND, 0640)) >= 0) {
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	}
+
+	pthread_mutex_lock(&log_lock);
+	list = rings;
+	pthread_mutex_unlock(&log_lock);
+	for (r = list; r; r = r->next) {
+		if (r->fd < 0 || r->fd == log_file)
+			continue;
+		if ((fd = log_open_worker(r)) >= 0) {
+			dup2(fd, r->fd);
+			close(fd);
+		}
+	}
+}
+
+/** @brief Open a log file for appending, starting a new binary log
+ *         with its header
+ *  @param path the file
+ *  @return the fd, -1 on fail
+ */
+static int log_open(char *path) {
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0640)) < 0)
+		return -1;
+	if (conf.log_binary && fstat(fd, &st) == 0 && st.st_size == 0)
+		write(fd, LOG_MAGIC, LOG_MAGIC_LEN);
+	return fd;
+}
+
+/** @brief Open the log file of one logging thread, the access log
+ *         path followed by the number of the thread
+ *  @param r the ring of the thread
+ *  @return the fd, -1 on fail
+ */
+static int log_open_worker(LogRing *r) {
+	char path[LOG_PATH_SIZE + 16];
+
+	snprintf(path, sizeof(path), "%s.%d", log_path, r->index);
+	return log_open(path);
+}
+
+/** @brief Encode an access record of the binary log
+ *  @param rec where to put the record, LOG_RECORD bytes
+ *  @param req the request
+ *  @param addr client ip address
+ *  @param status response status
+ *  @param size response size
+ *  @return length of the record
+ */
+static int log_binary_access(unsigned char *rec, Requests *req, char *addr,
+                             char *status, long long size) {
+	static const char *methods[] = LOG_METHODS;
+	static const char *versions[] = LOG_VERSIONS;
+	unsigned char *p = rec;
+	struct timeval now;
+	int code, len;
+
+	gettimeofday(&now, NULL);
+	*p++ = LOG_REC_ACCESS;
+	p += put_varint(p, (unsigned long long)now.tv_sec * 1000 +
+	                   now.tv_usec / 1000);
+	if (inet_pton(AF_INET, addr, p) != 1)
+		memset(p, 0, 4);
+	p += 4;
+	*p++ = code = log_code(methods, req->method);
+	if (code == 0)
+		p += put_string(p, req->method, 32);
+	*p++ = code = log_code(versions, req->version);
+	if (code == 0)
+		p += put_string(p, req->version, 32);
+	p += put_varint(p, atoi(status));
+	p += put_varint(p, size < 0 ? 0 : size);
+	len = LOG_RECORD - (p - rec) - 2;
+	p += put_string(p, req->uri, len);
+	return p - rec;
+}
+
+/** @brief Encode a text record of the binary log
+ *  @param rec where to put the record, len + 16 bytes
+ *  @param str the text
+ *  @param len length of str
+ *  @return length of the record
+ */
+static int log_binary_text(unsigned char *rec, char *str, int len) {
+	rec[0] = LOG_REC_TEXT;
+	return 1 + put_string(rec + 1, str, len);
+}
+
+/** @brief Encode an unsigned LEB128 varint
+ *  @param p where to put it, 10 bytes
+ *  @param v the value
+ *  @return bytes used
+ */
+static int put_varint(unsigned char *p, unsigned long long v) {
+	int n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+/** @brief Encode a string, truncated to max bytes
+ *  @param p where to put it
+ *  @param s the string, NULL is empty
+ *  @param max max bytes of s to keep, less than 16384
+ *  @return bytes used
+ */
+static int put_string(unsigned char *p, char *s, int max) {
+	int len = 0, n;
+
+	while (s && len < max && s[len])
+		len++;
+	n = put_varint(p, len);
+	memcpy(p + n, s, len);
+	return n + len;
+}
+
+/** @brief Find the code of an interned string
+ *  @param table the strings, the first and the last are NULL
+ *  @param s the string
+ *  @return its index, 0 if not in table
+ */
+static int log_code(const char **table, char *s) {
+	int i;
+
+	for (i = 1; s && table[i]; i++)
+		if (!strcmp(table[i], s))
+			return i;
+	return 0;
+}
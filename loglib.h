@@ -6,6 +6,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include "mio.h"
 
 
@@ -14,11 +17,51 @@
 #define INIT_NEW      1
 #define INIT_APPEND   2
 
+#define LOG_RECORD    512   /* Max length of one formatted record */
+#define LOG_IOV       64    /* Max iovecs handed to one writev() */
+#define LOG_PATH_SIZE 1024
+
+/* Binary log: LOG_MAGIC, then records starting with a type byte.
+ * An access record is
+ *     time (varint, ms since the epoch) | ipv4 address (4 bytes) |
+ *     method code (1 byte, 0 then a string if not in LOG_METHODS) |
+ *     version code (1 byte, 0 then a string if not in LOG_VERSIONS) |
+ *     status (varint) | size (varint) | uri (string)
+ * a text record is one string. Strings are a varint length then bytes.
+ */
+#define LOG_MAGIC       "LISOBLG1"
+#define LOG_MAGIC_LEN   8
+#define LOG_REC_ACCESS  1
+#define LOG_REC_TEXT    2
+#define LOG_METHODS     {NULL, "GET", "HEAD", "POST", "PUT", "DELETE", \
+                         "OPTIONS", "TRACE", "CONNECT", "PATCH", NULL}
+#define LOG_VERSIONS    {NULL, "HTTP/1.0", "HTTP/1.1", "HTTP/0.9", NULL}
+#define LOG_DATE_SIZE   35
+#define LOG_DATE_FORMAT "%a, %d %b %Y %T %Z"  /* same as the Date: header */
+
+
+/** @brief Records one thread logged that the flusher has not written yet
+ *         head only moves in the logging thread, tail only in the flusher
+ *
+ */
+typedef struct log_ring {
+    char *data;
+    size_t size;             /* a power of two */
+    atomic_size_t head;      /* total bytes logged */
+    atomic_size_t tail;      /* total bytes written out */
+    atomic_ulong dropped;    /* records lost to a full ring */
+    unsigned long sampled;   /* records seen while nearly full */
+    int index;               /* order the thread first logged in */
+    int fd;                  /* file of its own with log_per_worker */
+    struct log_ring *next;
+} LogRing;
 
 
 void log_init(char *file);
-void log_write(Requests *req, char *addr, char *date, char *status, int size);
+void log_write(Requests *req, char *addr, char *date, char *status,
+               long long size);
 void log_write_string(char *format, ...);
+void log_reopen(void);
 void log_close(void);
 
 #endif
\ No newline at end of file
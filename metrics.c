@@ -0,0 +1,475 @@
+/** @file metrics.c
+ *  @brief Counters and latency histograms in Prometheus text format
+ *         The admin port only listens on the loopback interface.
+ *         Its connections go through the normal client path, and
+ *         serve_clients() hands their requests to metrics_serve():
+ *
+ *             curl http://127.0.0.1:<admin_port>/metrics
+ *
+ *         /probes shows and sets the probe subsystems, see probe.c.
+ *         /stalls lists the last stalls of the event loop, see lag.c.
+ */
+
+#include <stdarg.h>
+#include <strings.h>
+
+#include "metrics.h"
+#include "cgi.h"
+#include "probe.h"
+#include "conntab.h"
+#include "conf.h"
+#include "overload.h"
+#include "ratelimit.h"
+#include "lag.h"
+#include "iopool.h"
+#include "stream.h"
+
+
+/**************** BEGIN CONSTANTS ***************/
+#define OUT_SIZE     65536
+#define LISTENQ      1024
+
+/**************** END CONSTANTS ***************/
+
+Metrics metrics;
+
+/** @brief A growing buffer for the scrape output
+ *
+ */
+typedef struct out {
+    char *buf;
+    int len;
+    int size;
+} Out;
+
+static void metrics_reply(Buff *b, Out *o);
+static void metrics_scrape(Pool *p, Out *o);
+static void stalls_list(Out *o);
+static void out_printf(Out *o, const char *format, ...);
+static void out_histogram(Out *o, char *name, char *help, Histogram *h);
+static int hist_index(unsigned long long us);
+static unsigned long long hist_upper(int i);
+
+
+/** @brief Microseconds on the monotonic clock
+ *  @return the time
+ */
+unsigned long long metrics_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** @brief Add a sample to a histogram
+ *  @param h the histogram
+ *  @param us the sample in microseconds
+ *  @return Void
+ */
+void metrics_observe(Histogram *h, unsigned long long us) {
+    __atomic_fetch_add(&h->buckets[hist_index(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+/** @brief Account for a response that has been sent in full
+ *  @param req the request, its response starts with the status line
+ *  @return Void
+ */
+void metrics_response(Requests *req) {
+    int status = 0, m;
+
+    if (req->response_len > 12)
+        status = atoi(req->response + 9);
+    if (status > 0 && status < METRIC_STATUS)
+        METRIC_INC(status[status]);
+
+    if (req->method == NULL)
+        m = METRIC_METHODS - 1;
+    else if (!strcasecmp(req->method, "GET"))
+        m = 0;
+    else if (!strcasecmp(req->method, "HEAD"))
+        m = 1;
+    else if (!strcasecmp(req->method, "POST"))
+        m = 2;
+    else
+        m = METRIC_METHODS - 1;
+    METRIC_INC(requests[m]);
+
+    if (req->phase[PH_START]) {
+        metrics_observe(&metrics.ttfb,
+                        req->phase[PH_WRITE] - req->phase[PH_START]);
+        metrics_observe(&metrics.total,
+                        req->phase[PH_DONE] - req->phase[PH_START]);
+    }
+}
+
+/** @brief Create the admin socket on the loopback interface
+ *  @param port the admin port
+ *  @return the socket, -1 on fail
+ */
+int metrics_listen(int port) {
+    int sock, yes = 1;
+    struct sockaddr_in addr;
+
+    if ((sock = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
+        fprintf(stderr, "Failed creating admin socket.\n");
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(sock, LISTENQ)) {
+        close(sock);
+        fprintf(stderr, "Failed binding admin socket for port %d.\n", port);
+        return -1;
+    }
+    return sock;
+}
+
+/** @brief Answer a request on the admin port
+ *  @param p Pool struct of the server
+ *  @param b Buff struct representing a connection
+ *  @return Void
+ */
+void metrics_serve(Pool *p, Buff *b) {
+    Requests *req = b->cur_request;
+    Out o = {NULL, 0, 0};
+    char names[PROBE_NAMES_SIZE];
+    unsigned int mask;
+
+    if (!strcmp(req->uri, "/metrics")) {
+        metrics_scrape(p, &o);
+    } else if (!strncmp(req->uri, "/probes", 7) &&
+               (req->uri[7] == '\0' || req->uri[7] == '?')) {
+        /* /probes?conn,cgi sets the subsystems traced to stderr */
+        if (req->uri[7] == '?') {
+            if (probe_parse(req->uri + 8, &mask) == EXIT_FAILURE) {
+                clienterror(req, b->cold->addr, req->uri + 8, "400", "Bad Request",
+                            "Unknown probe subsystem");
+                return;
+            }
+            probe_mask = mask;
+        }
+        probe_names(probe_mask, names, PROBE_NAMES_SIZE);
+        out_printf(&o, "%s\n", names);
+    } else if (!strcmp(req->uri, "/stalls")) {
+        stalls_list(&o);
+    } else {
+        clienterror(req, b->cold->addr, req->uri, "404", "Not found",
+                    "The admin port only serves /metrics, /probes and /stalls");
+        return;
+    }
+    metrics_reply(b, &o);
+}
+
+/** @brief Answer a request routed to the status of the server, with
+ *         the metrics of /metrics. Nothing can be changed from here
+ *  @param p Pool struct of the server
+ *  @param b Buff struct representing a connection
+ *  @return Void
+ */
+void metrics_status(Pool *p, Buff *b) {
+    Out o = {NULL, 0, 0};
+
+    metrics_scrape(p, &o);
+    metrics_reply(b, &o);
+}
+
+/** @brief Make the response of the current request from an output
+ *  @param b Buff struct representing a connection
+ *  @param o the output, freed
+ *  @return Void
+ */
+static void metrics_reply(Buff *b, Out *o) {
+    Requests *req = b->cur_request;
+    char hdr[256];
+    int len;
+
+    len = sprintf(hdr, "HTTP/1.1 200 OK\r\n"
+                       "Server: Liso/1.0\r\n"
+                       "Content-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: %d\r\n"
+                       "Connection: %s\r\n\r\n",
+                  o->len, b->stage == STAGE_CLOSE ? "Close" : "Keep-Alive");
+    req->response = (char *)arena_alloc(&req->arena, len + o->len);
+    memcpy(req->response, hdr, len);
+    if (strcasecmp(req->method, "HEAD"))
+        memcpy(req->response + len, o->buf, o->len);
+    else
+        o->len = 0;
+    req->response_len = len + o->len;
+    req->body = NULL;
+    req->valid = REQ_VALID;
+    free(o->buf);
+}
+
+/** @brief Write every metric in the Prometheus text format
+ *  @param p Pool struct of the server
+ *  @param o the output
+ *  @return Void
+ */
+static void metrics_scrape(Pool *p, Out *o) {
+    static const char *methods[] = {"GET", "HEAD", "POST", "other"};
+    static const char *stages[] = {"muv", "header", "body", "error", "close"};
+    unsigned long by_stage[5] = {0};
+    ConnMem mem;
+    Buff *b;
+    int i;
+
+    for (i = 0; i < p->conns.n; i++) {
+        b = CONNTAB_AT(&p->conns, i);
+        if (b->stage >= STAGE_MUV && b->stage <= STAGE_CLOSE)
+            by_stage[b->stage - STAGE_MUV]++;
+    }
+
+    out_printf(o, "# HELP liso_accepts_total Connections accepted.\n"
+                   "# TYPE liso_accepts_total counter\n"
+                   "liso_accepts_total{scheme=\"http\"} %lu\n"
+                   "liso_accepts_total{scheme=\"https\"} %lu\n",
+               metrics.accepts[SCHEME_HTTP], metrics.accepts[SCHEME_HTTPS]);
+    out_printf(o, "# HELP liso_tls_handshakes_total TLS handshakes.\n"
+                   "# TYPE liso_tls_handshakes_total counter\n"
+                   "liso_tls_handshakes_total{result=\"ok\"} %lu\n"
+                   "liso_tls_handshakes_total{result=\"failed\"} %lu\n",
+               metrics.tls_handshakes, metrics.tls_failures);
+    out_printf(o, "# HELP liso_connections Open client connections.\n"
+                   "# TYPE liso_connections gauge\n");
+    for (i = 0; i < 5; i++)
+        out_printf(o, "liso_connections{stage=\"%s\"} %lu\n",
+                   stages[i], by_stage[i]);
+    out_printf(o, "# HELP liso_requests_total Responses sent, by method.\n"
+                   "# TYPE liso_requests_total counter\n");
+    for (i = 0; i < METRIC_METHODS; i++)
+        out_printf(o, "liso_requests_total{method=\"%s\"} %lu\n",
+                   methods[i], metrics.requests[i]);
+    out_printf(o, "# HELP liso_responses_total Responses sent, by status.\n"
+                   "# TYPE liso_responses_total counter\n");
+    for (i = 0; i < METRIC_STATUS; i++)
+        if (metrics.status[i])
+            out_printf(o, "liso_responses_total{status=\"%d\"} %lu\n",
+                       i, metrics.status[i]);
+    out_printf(o, "# HELP liso_received_bytes_total Bytes read from clients.\n"
+                   "# TYPE liso_received_bytes_total counter\n"
+                   "liso_received_bytes_total %lu\n"
+                   "# HELP liso_sent_bytes_total Bytes sent to clients.\n"
+                   "# TYPE liso_sent_bytes_total counter\n"
+                   "liso_sent_bytes_total %lu\n",
+               metrics.bytes_in, metrics.bytes_out);
+    out_printf(o, "# HELP liso_cgi_spawns_total CGI children forked.\n"
+                   "# TYPE liso_cgi_spawns_total counter\n"
+                   "liso_cgi_spawns_total %lu\n"
+                   "# HELP liso_cgi_running CGI children running.\n"
+                   "# TYPE liso_cgi_running gauge\n"
+                   "liso_cgi_running %d\n",
+               metrics.cgi_spawns, cgi_running());
+    out_printf(o, "# HELP liso_cache_lookups_total CGI cache lookups.\n"
+                   "# TYPE liso_cache_lookups_total counter\n"
+                   "liso_cache_lookups_total{result=\"hit\"} %lu\n"
+                   "liso_cache_lookups_total{result=\"stale\"} %lu\n"
+                   "liso_cache_lookups_total{result=\"miss\"} %lu\n",
+               metrics.cache_hits, metrics.cache_stale, metrics.cache_misses);
+    conntab_mem(&p->conns, &mem);
+    out_printf(o, "# HELP liso_connection_memory_bytes Memory held for "
+                   "client connections.\n"
+                   "# TYPE liso_connection_memory_bytes gauge\n"
+                   "liso_connection_memory_bytes{kind=\"read_buffers\"} %zu\n"
+                   "liso_connection_memory_bytes{kind=\"arenas\"} %zu\n"
+                   "liso_connection_memory_bytes{kind=\"tls\"} %zu\n"
+                   "liso_connection_memory_bytes{kind=\"slots\"} %zu\n"
+                   "# HELP liso_connection_memory_budget_bytes mem_budget, "
+                   "0 if unlimited.\n"
+                   "# TYPE liso_connection_memory_budget_bytes gauge\n"
+                   "liso_connection_memory_budget_bytes %ld\n"
+                   "# HELP liso_evictions_total Idle connections closed "
+                   "to stay under mem_budget.\n"
+                   "# TYPE liso_evictions_total counter\n"
+                   "liso_evictions_total %lu\n",
+               mem.read_buffers, mem.arenas, mem.tls, mem.slots,
+               conf.mem_budget, metrics.evictions);
+    out_printf(o, "# HELP liso_overload_level 0 normal, 1 shedding new "
+                   "connections, 2 not accepting.\n"
+                   "# TYPE liso_overload_level gauge\n"
+                   "liso_overload_level{cause=\"%s\"} %d\n"
+                   "# HELP liso_overload_signal What admission control "
+                   "watches, with its soft and hard limits.\n"
+                   "# TYPE liso_overload_signal gauge\n",
+               overload_signal(overload.cause), overload.level);
+    for (i = 0; i < OL_SIGNALS; i++)
+        out_printf(o, "liso_overload_signal{signal=\"%s\"} %ld\n"
+                       "liso_overload_signal{signal=\"%s\",limit=\"soft\"} "
+                       "%ld\n"
+                       "liso_overload_signal{signal=\"%s\",limit=\"hard\"} "
+                       "%ld\n",
+                   overload_signal(i), overload.value[i],
+                   overload_signal(i), overload_limit(i, OL_SHED),
+                   overload_signal(i), overload_limit(i, OL_STOP));
+    out_printf(o, "# HELP liso_overload_shed_total New connections answered "
+                   "with 503, or let in by closing an idle one.\n"
+                   "# TYPE liso_overload_shed_total counter\n"
+                   "liso_overload_shed_total{action=\"reject\"} %lu\n"
+                   "liso_overload_shed_total{action=\"evict\"} %lu\n"
+                   "# HELP liso_overload_paused_wakeups_total Wakeups with "
+                   "accept() stopped.\n"
+                   "# TYPE liso_overload_paused_wakeups_total counter\n"
+                   "liso_overload_paused_wakeups_total %lu\n",
+               overload.shed, overload.evicted, overload.paused);
+    out_printf(o, "# HELP liso_rate_limited_total Answered 429 for a client "
+                   "over its limit\n"
+                   "# TYPE liso_rate_limited_total counter\n"
+                   "liso_rate_limited_total{kind=\"conns\"} %lu\n"
+                   "liso_rate_limited_total{kind=\"requests\"} %lu\n"
+                   "liso_rate_limited_total{kind=\"cgi\"} %lu\n"
+                   "# HELP liso_rate_limit_clients Clients in the rate "
+                   "limit table\n"
+                   "# TYPE liso_rate_limit_clients gauge\n"
+                   "liso_rate_limit_clients %d\n"
+                   "# HELP liso_rate_limit_evicted_total Clients dropped "
+                   "from the table for new ones\n"
+                   "# TYPE liso_rate_limit_evicted_total counter\n"
+                   "liso_rate_limit_evicted_total %lu\n",
+               rate_stats.limited[RL_CONNS], rate_stats.limited[RL_REQUESTS],
+               rate_stats.limited[RL_CGI], rate_stats.tracked,
+               rate_stats.evicted);
+    out_histogram(o, "liso_ttfb_seconds",
+                  "Time from the request line to the first byte out.",
+                  &metrics.ttfb);
+    out_histogram(o, "liso_request_duration_seconds",
+                  "Time from the request line to the last byte out.",
+                  &metrics.total);
+    out_printf(o, "# HELP liso_loop_stalls_total Handlers, or whole wakeups, "
+                   "that ran past stall_threshold.\n"
+                   "# TYPE liso_loop_stalls_total counter\n"
+                   "liso_loop_stalls_total %lu\n"
+                   "# HELP liso_loop_stall_samples_total Backtraces taken "
+                   "by the stall watchdog.\n"
+                   "# TYPE liso_loop_stall_samples_total counter\n"
+                   "liso_loop_stall_samples_total %lu\n",
+               lag.stalls, lag.samples);
+    out_printf(o, "# HELP liso_io_pending Static requests waiting on the "
+                   "I/O threads.\n"
+                   "# TYPE liso_io_pending gauge\n"
+                   "liso_io_pending %d\n", io_pending());
+    out_histogram(o, "liso_io_wait_seconds",
+                  "Time a static file takes to be opened by the I/O threads.",
+                  &metrics.io_wait);
+    out_printf(o, "# HELP liso_stream_open Static bodies being streamed "
+                   "from their files.\n"
+                   "# TYPE liso_stream_open gauge\n"
+                   "liso_stream_open %d\n"
+                   "# HELP liso_stream_mapped_bytes Bytes of file windows "
+                   "mapped to send bodies over https.\n"
+                   "# TYPE liso_stream_mapped_bytes gauge\n"
+                   "liso_stream_mapped_bytes %ld\n",
+               stream_stats.open, stream_stats.mapped);
+    out_histogram(o, "liso_loop_busy_seconds",
+                  "Time from select() returning to its next call.",
+                  &metrics.loop_busy);
+    out_histogram(o, "liso_loop_handler_seconds",
+                  "Time in one handler of the event loop.",
+                  &metrics.handler);
+
+}
+
+/** @brief Write the last stalls of the event loop, newest first
+ *  @param o the output
+ *  @return Void
+ */
+static void stalls_list(Out *o) {
+    unsigned long long now = metrics_now();
+    unsigned long i;
+    Stall *s;
+
+    out_printf(o, "# %lu stalls of %d ms or more\n"
+                   "# seconds_ago ms handler sock stage\n",
+               lag.stalls, conf.stall_ms);
+    for (i = lag.stalls; i > 0 && i + LAG_RING > lag.stalls; i--) {
+        s = &lag.ring[(i - 1) % LAG_RING];
+        out_printf(o, "%.1f %llu %s %d %s\n", (now - s->at) / 1e6,
+                   s->us / 1000, s->func, s->fd, lag_stage(s->stage));
+    }
+}
+
+/** @brief Append formatted text to the scrape output
+ *  @param o the output
+ *  @param format the format
+ *  @return Void
+ */
+static void out_printf(Out *o, const char *format, ...) {
+    va_list args;
+    int n;
+
+    while (1) {
+        if (o->size - o->len < 256) {
+            o->size = o->size ? o->size * 2 : OUT_SIZE;
+            o->buf = (char *)realloc(o->buf, o->size);
+        }
+        va_start(args, format);
+        n = vsnprintf(o->buf + o->len, o->size - o->len, format, args);
+        va_end(args);
+        if (n < o->size - o->len)
+            break;
+        o->size *= 2;
+        o->buf = (char *)realloc(o->buf, o->size);
+    }
+    o->len += n;
+}
+
+/** @brief Append a histogram, with cumulative buckets up to the last
+ *         one that has ever been used
+ *  @param o the output
+ *  @param name metric name
+ *  @param help description
+ *  @param h the histogram
+ *  @return Void
+ */
+static void out_histogram(Out *o, char *name, char *help, Histogram *h) {
+    unsigned long cum = 0;
+    int i, last = -1;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        if (h->buckets[i])
+            last = i;
+    out_printf(o, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (i = 0; i <= last; i++) {
+        cum += h->buckets[i];
+        out_printf(o, "%s_bucket{le=\"%g\"} %lu\n", name,
+                   hist_upper(i) / 1e6, cum);
+    }
+    out_printf(o, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %g\n%s_count %lu\n",
+               name, h->count, name, h->sum / 1e6, name, h->count);
+}
+
+/** @brief Bucket of a sample, the top HIST_SUB_BITS + 1 bits of it
+ *  @param us the sample
+ *  @return the bucket
+ */
+static int hist_index(unsigned long long us) {
+    int e;
+
+    if (us < HIST_SUB)
+        return us;
+    e = 63 - __builtin_clzll(us);
+    if (e - 1 > HIST_BUCKETS / HIST_SUB)
+        return HIST_BUCKETS - 1;
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+           ((us >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/** @brief Largest sample that falls in a bucket
+ *  @param i the bucket
+ *  @return the sample in microseconds
+ */
+static unsigned long long hist_upper(int i) {
+    int e, sub;
+
+    if (i < HIST_SUB)
+        return i;
+    e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    sub = i % HIST_SUB;
+    return ((unsigned long long)(HIST_SUB + sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
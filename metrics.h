@@ -0,0 +1,76 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mio.h"
+
+
+#define HIST_SUB_BITS     3    /* 8 buckets per power of two, 12.5% error */
+#define HIST_SUB          (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS      (HIST_SUB * 40)  /* up to 2^41 us, about 25 days */
+#define METRIC_STATUS     600
+#define METRIC_METHODS    4    /* GET, HEAD, POST, anything else */
+
+#define SCHEME_HTTP       0
+#define SCHEME_HTTPS      1
+
+/* Counters are bumped with relaxed atomics, no locks, so threads can
+ * share them and a scrape reads them while they move */
+#define METRIC_ADD(field, n) \
+    __atomic_fetch_add(&metrics.field, (n), __ATOMIC_RELAXED)
+#define METRIC_INC(field)    METRIC_ADD(field, 1)
+
+/** @brief Log-linear latency histogram in microseconds, values within
+ *         a power of two are split in HIST_SUB equal buckets
+ *
+ */
+typedef struct histogram {
+    unsigned long buckets[HIST_BUCKETS];
+    unsigned long count;
+    unsigned long long sum;
+} Histogram;
+
+/** @brief Counters served on the admin port
+ *
+ */
+typedef struct metrics {
+    unsigned long accepts[2];        /* by SCHEME_* */
+    unsigned long tls_handshakes;
+    unsigned long tls_failures;
+    unsigned long requests[METRIC_METHODS];
+    unsigned long status[METRIC_STATUS];
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long cgi_spawns;
+    unsigned long cache_hits;
+    unsigned long cache_stale;       /* served stale while revalidating */
+    unsigned long cache_misses;
+    unsigned long evictions;         /* idle connections closed, mem_budget */
+    Histogram ttfb;                  /* request line read to first byte out */
+    Histogram total;                 /* request line read to last byte out */
+    Histogram loop_busy;             /* select() return to the next call */
+    Histogram handler;               /* one handler of the event loop */
+    Histogram io_wait;               /* static file with the I/O threads */
+} Metrics;
+
+extern Metrics metrics;
+
+
+/* Metrics package */
+unsigned long long metrics_now(void);
+void metrics_observe(Histogram *h, unsigned long long us);
+void metrics_response(Requests *req);
+int metrics_listen(int port);
+void metrics_serve(Pool *p, Buff *b);
+void metrics_status(Pool *p, Buff *b);
+
+#endif
@@ -0,0 +1,600 @@
+/** @file microbench.c
+ *  @brief Microbenchmarks for the lisod hot paths
+ *         Each benchmark runs its operation in growing batches until a
+ *         batch takes long enough to time, then reports time, heap
+ *         allocations and system calls per operation. Allocations and
+ *         system calls are counted by wrapping them at link time
+ *         (see BENCH_WRAP in the Makefile), so only calls made by lisod
+ *         code are seen, not those inside libc or OpenSSL.
+ *
+ *         Output is one line per benchmark in the Go benchmark format,
+ *         so runs of two commits can be compared with benchstat, or
+ *         one JSON object per line with -j.
+ *
+ *         usage: microbench [-j] [-t min secs] [name filter]
+ */
+
+#define _GNU_SOURCE  /* strcasestr() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "mio.h"
+#include "conntab.h"
+#include "loglib.h"
+#include "cgi.h"
+#include "conf.h"
+#include "stream.h"
+#include "route.h"
+
+
+/**************** BEGIN CONSTANTS ***************/
+#define BUF_SIZE        8192
+#define MIN_TIME        0.5     /* seconds a timed batch must take */
+#define MAX_OPS         (1L << 30)
+#define REFILL          64      /* requests written to the socket at once */
+#define SEND_SIZE       4096
+#define ENVP_SIZE       64
+
+#define REQUEST "GET /images/liso_header.png HTTP/1.1\r\n" \
+                "Host: www.cs.cmu.edu\r\n" \
+                "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:31.0)\r\n" \
+                "Accept: text/html,application/xhtml+xml,*/*;q=0.8\r\n" \
+                "Accept-Language: en-US,en;q=0.5\r\n" \
+                "Accept-Encoding: gzip, deflate\r\n" \
+                "Referer: http://www.cs.cmu.edu/\r\n" \
+                "Cookie: session=0123456789abcdef\r\n" \
+                "Connection: keep-alive\r\n" \
+                "\r\n"
+#define LINE    "GET /index.html HTTP/1.1 with some padding to 64 bytes...\r\n"
+
+/**************** END CONSTANTS ***************/
+
+/** @brief A benchmark
+ *
+ */
+typedef struct bench {
+    char *name;
+    void (*run)(long n);
+} Bench;
+
+/* lisod.c has no header, it is built with main renamed for this */
+int read_requesthdrs(Buff *b, Requests *req);
+void put_header(Requests *req, char *key, char *value);
+char *get_hdr_value_by_key(Headers *hdr, char *key);
+int read_requestline(Buff *b, Requests *req);
+void get_filetype(char *filename, char *filetype);
+void serve_static(Buff *b, Requests *req, char *filename, struct stat sbuf,
+                  int srcfd);
+void clienterror(Requests *req, char *addr, char *cause, char *errnum,
+                 char *shortmsg, char *longmsg);
+
+static void bench_parse_request(long n);
+static void bench_put_header(long n);
+static void bench_get_hdr_value_by_key(long n);
+static void bench_mio_recvlineb(long n);
+static void bench_mio_sendn(long n);
+static void bench_log_write(long n);
+static void bench_get_filetype(long n);
+static void bench_clienterror(long n);
+static void bench_serve_static(long n);
+static void bench_build_envp(long n);
+static void bench_route_match(long n);
+static void bench_conntab_add_remove(long n);
+static void setup(void);
+static void bench_pause(void);
+static void bench_resume(void);
+static void free_request(Requests *req);
+static void fill_headers(Requests *req);
+static void refill(int fd, char *data, int n);
+static double now(void);
+
+static Bench benches[] = {
+    {"ParseRequest", bench_parse_request},
+    {"PutHeader", bench_put_header},
+    {"GetHdrValueByKey", bench_get_hdr_value_by_key},
+    {"MioRecvlineb", bench_mio_recvlineb},
+    {"MioSendn", bench_mio_sendn},
+    {"LogWrite", bench_log_write},
+    {"GetFiletype", bench_get_filetype},
+    {"Clienterror", bench_clienterror},
+    {"ServeStatic", bench_serve_static},
+    {"BuildEnvp", bench_build_envp},
+    {"RouteMatch", bench_route_match},
+    {"ConntabAddRemove", bench_conntab_add_remove},
+    {NULL, NULL}
+};
+
+/* counted while a batch runs, the log flusher thread counts too */
+static volatile int counting;
+static unsigned long n_allocs;
+static unsigned long n_syscalls;
+static double started;
+static double elapsed;
+
+static int sv[2];              /* socketpair, lisod reads sv[0] */
+static Buff buff;
+static ConnCold buff_cold;
+static Requests request;
+static char static_file[] = "/tmp/microbenchXXXXXX.html";
+static char route_conf[] = "/tmp/microbenchXXXXXX.conf";
+static const char routes[] =
+    "route /images/ static /var/images ttl 3600\n"
+    "route /app/ cgi /var/app.py max_body 4096\n"
+    "route /app/admin/ cgi /var/admin.py\n"
+    "cache_ttl /cgi/news 10 30\n"
+    "route /docs/ static /var/docs\n"
+    "route /downloads/ static /var/downloads ttl 600\n"
+    "route /server-status status\n"
+    "route *.py cgi /usr/bin/python3\n"
+    "route *.php cgi /usr/bin/php-cgi\n"
+    "route *.tar.gz static /var/archives\n";
+static struct stat static_stat;
+
+#define COUNT(c) do { \
+        if (counting) \
+            __atomic_fetch_add(&c, 1, __ATOMIC_RELAXED); \
+    } while (0)
+
+
+int main(int argc, char *argv[]) {
+    double min_time = MIN_TIME;
+    int opt, json = 0;
+    char *filter = NULL;
+    unsigned long allocs, syscalls;
+    Bench *b;
+    long n;
+
+    while ((opt = getopt(argc, argv, "jt:")) != -1) {
+        if (opt == 'j')
+            json = 1;
+        else if (opt == 't')
+            min_time = atof(optarg);
+        else {
+            fprintf(stderr, "usage: %s [-j] [-t min secs] [name filter]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind < argc)
+        filter = argv[optind];
+    setup();
+
+    for (b = benches; b->name; b++) {
+        if (filter && !strcasestr(b->name, filter))
+            continue;
+        for (n = 1; n <= MAX_OPS; n *= 2) {
+            n_allocs = n_syscalls = 0;
+            elapsed = 0;
+            bench_resume();
+            b->run(n);
+            bench_pause();
+            if (elapsed >= min_time)
+                break;
+        }
+        allocs = n_allocs;
+        syscalls = n_syscalls;
+        if (json)
+            printf("{\"name\":\"%s\",\"ops\":%ld,\"ns_per_op\":%.1f,"
+                   "\"allocs_per_op\":%.2f,\"syscalls_per_op\":%.2f}\n",
+                   b->name, n, elapsed * 1e9 / n, (double)allocs / n,
+                   (double)syscalls / n);
+        else
+            printf("Benchmark%-20s %10ld %12.1f ns/op %8.2f allocs/op "
+                   "%8.2f syscalls/op\n", b->name, n, elapsed * 1e9 / n,
+                   (double)allocs / n, (double)syscalls / n);
+        fflush(stdout);
+    }
+    log_close();
+    unlink(static_file);
+    return EXIT_SUCCESS;
+}
+
+/** @brief Request line and headers read off a socket, as serve_clients
+ *         does it, then looked up and freed
+ *  @param n operations
+ *  @return Void
+ */
+static void bench_parse_request(long n) {
+    long i;
+
+    for (i = 0; i < n; i++) {
+        if (i % REFILL == 0)
+            refill(sv[1], REQUEST, n - i < REFILL ? n - i : REFILL);
+        buff.stage = STAGE_HEADER;
+        chain_recvline(&buff.in, buff.fd, NULL, conf.header_limit);
+        read_requestline(&buff, &request);
+        read_requesthdrs(&buff, &request);
+        get_hdr_value_by_key(request.header, "Content-Length");
+        get_hdr_value_by_key(request.header, "Connection");
+        chain_reset(&buff.in);
+        buff.cur_parsed = 0;
+        free_request(&request);
+    }
+    request.method = "GET";
+    request.uri = "/cgi/news";
+    request.version = "HTTP/1.1";
+}
+
+/** @brief Headers of a typical request added one by one, then freed
+ *  @param n operations
+ *  @return Void
+ */
+static void bench_put_header(long n) {
+    long i;
+
+    for (i = 0; i < n; i++) {
+        fill_headers(&request);
+        free_request(&request);
+    }
+}
+
+/** @brief Lookup of the last and of a missing header
+ *  @param n operations
+ *  @return Void
+ */
+static void bench_get_hdr_value_by_key(long n) {
+    long i;
+
+    bench_pause();
+    fill_headers(&request);
+    bench_resume();
+    for (i = 0; i < n; i++) {
+        get_hdr_value_by_key(request.header, "Connection");
+        get_hdr_value_by_key(request.header, "Content-Length");
+    }
+    bench_pause();
+    free_request(&request);
+    bench_resume();
+}
+
+/** @brief One 64 byte line read off a socket
+ *  @param n operations
+ *  @return Void
+ */
+static void bench_mio_recvlineb(long n) {
+    static char line[BUF_SIZE];
+    long i;
+
+    for (i = 0; i < n; i++) {
+        if (i % (REFILL * 4) == 0)
+            refill(sv[1], LINE, n - i < REFILL * 4 ? n - i : REFILL * 4);
+        mio_recvlineb(sv[0], NULL, line, sizeof(line));
+    }
+}
+
+/** @brief 4 KB sent to a socket, drained by the peer between batches
+ *  @param n operations
+ *  @return Void
+ */
+static void bench_mio_sendn(long n) {
+    static char data[SEND_SIZE];
+    char sink[65536];
+    long i;
+
+    for (i = 0; i < n; i++) {
+        if (i % 16 == 0) {
+            bench_pause();
+            while (read(sv[1], sink, sizeof(sink)) > 0)
+                ;
+            bench_resume();
+        }
+        mio_sendn(sv[0], NULL, data, SEND_SIZE);
+    }
+    bench_pause();
+    while (read(sv[1], sink, sizeof(sink)) > 0)
+        ;
+    bench_resume();
+}
+
+/** @brief One access log record, the flusher writes to /dev/null
+ *  @param n operations
+ *  @return Void
+ */
+static void bench_log_write(long n) {
+    long i;
+
+    for (i = 0; i < n; i++)
+        log_write(&request, "128.2.42.95", "Fri, 19 Sep 2014 18:38:38 GMT",
+                  "200", 17616);
+}
+
+/** @brief Content type of one of a rotation of file names
+ *  @param n operations
+ *  @return Void
+ */
+static void bench_get_filetype(long n) {
+    static char *names[] = {"/var/www/index.html", "/var/www/style.css",
+                            "/var/www/images/liso_header.png",
+                            "/var/www/images/photo.jpg",
+                            "/var/www/images/anim.gif", "/var/www/README"};
+    char filetype[32];
+    long i;
+
+    for (i = 0; i < n; i++)
+        get_filetype(names[i % 6], filetype);
+}
+
+/** @brief A 404 response built and freed
+ *  @param n operations
+ *  @return Void
+ */
+static void bench_clienterror(long n) {
+    long i;
+
+    for (i = 0; i < n; i++) {
+        clienterror(&request, buff.cold->addr, request.uri, "404", "Not Found",
+                    "Liso couldn't find this file");
+        arena_reset(&request.arena);
+    }
+}
+
+/** @brief Response headers built and a 4 KB file opened to be streamed,
+ *         then closed
+ *  @param n operations
+ *  @return Void
+ */
+static void bench_serve_static(long n) {
+    long i;
+
+    buff.cur_request = &request;
+    buff.stage = STAGE_MUV;
+    for (i = 0; i < n; i++) {
+        serve_static(&buff, &request, static_file, static_stat, -1);
+        stream_close(&request);
+        arena_reset(&request.arena);
+    }
+}
+
+/** @brief CGI environment built from a typical request, then freed
+ *  @param n operations
+ *  @return Void
+ */
+static void bench_build_envp(long n) {
+    static Arena env;
+    char *envp[ENVP_SIZE];
+    long i;
+
+    bench_pause();
+    fill_headers(&request);
+    bench_resume();
+    buff.cur_request = &request;
+    for (i = 0; i < n; i++) {
+        build_envp(&env, envp, &buff, "action=list&page=2");
+        arena_reset(&env);
+    }
+    bench_pause();
+    free_request(&request);
+    bench_resume();
+}
+
+/** @brief The route of uris under a table of a dozen rules
+ *  @param n operations
+ *  @return Void
+ */
+static void bench_route_match(long n) {
+    static char *uris[] = {"/index.html", "/cgi/news?page=2",
+                           "/images/2014/09/photo.jpg", "/app/users/42",
+                           "/docs/guide/install.py", "/server-status"};
+    long i, handlers = 0;
+
+    for (i = 0; i < n; i++)
+        handlers += route_match(uris[i % 6])->handler;
+    (void)handlers;
+}
+
+/** @brief Close and accept on a table that is nearly full
+ *         Should cost the same as on an empty one
+ */
+static void bench_conntab_add_remove(long n) {
+    static ConnTab t;
+    static int filled = 0;
+    long i;
+
+    bench_pause();
+    if (!filled) {
+        conntab_init(&t);
+        while (t.n < CONN_MAX - 1)
+            conntab_add(&t, t.n);
+        filled = 1;
+    }
+    bench_resume();
+    for (i = 0; i < n; i++) {
+        conntab_remove(&t, CONNTAB_AT(&t, (i * 7919) % t.n));
+        conntab_add(&t, i);
+    }
+}
+
+/** @brief Set up the state the benchmarks share
+ *  @return Void
+ */
+static void setup() {
+    static char data[SEND_SIZE];
+    int fd;
+
+    conf_init();
+    conf.log_overflow = LOG_OVERFLOW_BLOCK;  /* measure every record */
+    log_init("/dev/null");
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+
+    memset(&buff, 0, sizeof(buff));
+    buff.cold = &buff_cold;
+    strcpy(buff.cold->addr, "128.2.42.95");
+    buff.fd = sv[0];
+    buff.cold->port = 8080;
+    buff.cold->request = &request;
+    buff.cur_request = &request;
+    request.method = "GET";
+    request.uri = "/cgi/news";
+    request.version = "HTTP/1.1";
+
+    /* routes of a typical site, through the config file */
+    fd = mkstemps(route_conf, 5);
+    write(fd, routes, sizeof(routes) - 1);
+    close(fd);
+    conf_load(route_conf);
+    unlink(route_conf);
+    route_init("/var/www", "/var/cgi.py");
+
+    fd = mkstemps(static_file, 5);
+    memset(data, 'x', sizeof(data));
+    write(fd, data, sizeof(data));
+    fstat(fd, &static_stat);
+    close(fd);
+}
+
+/** @brief Stop the clock and the counters, for setup inside a batch
+ *  @return Void
+ */
+static void bench_pause() {
+    counting = 0;
+    elapsed += now() - started;
+}
+
+/** @brief Start the clock and the counters again
+ *  @return Void
+ */
+static void bench_resume() {
+    started = now();
+    counting = 1;
+}
+
+/** @brief Release what the request line and headers allocated, as get_freereq does
+ *  @param req the request
+ *  @return Void
+ */
+static void free_request(Requests *req) {
+    arena_reset(&req->arena);
+    req->header = NULL;
+}
+
+/** @brief Add the headers of REQUEST
+ *  @param req the request
+ *  @return Void
+ */
+static void fill_headers(Requests *req) {
+    put_header(req, "Host", "www.cs.cmu.edu");
+    put_header(req, "User-Agent", "Mozilla/5.0 (X11; Linux x86_64; rv:31.0)");
+    put_header(req, "Accept", "text/html,application/xhtml+xml,*/*;q=0.8");
+    put_header(req, "Accept-Language", "en-US,en;q=0.5");
+    put_header(req, "Accept-Encoding", "gzip, deflate");
+    put_header(req, "Referer", "http://www.cs.cmu.edu/");
+    put_header(req, "Cookie", "session=0123456789abcdef");
+    put_header(req, "Connection", "keep-alive");
+}
+
+/** @brief Queue copies of a message on a socket, not timed
+ *  @param fd the socket
+ *  @param data the message
+ *  @param n copies
+ *  @return Void
+ */
+static void refill(int fd, char *data, int n) {
+    struct iovec iov[REFILL * 4];
+    int i;
+
+    bench_pause();
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = data;
+        iov[i].iov_len = strlen(data);
+    }
+    writev(fd, iov, n);
+    bench_resume();
+}
+
+/** @brief Seconds on the monotonic clock
+ *  @return the time
+ */
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Link-time wrappers, see BENCH_WRAP in the Makefile */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t __real_recv(int fd, void *buf, size_t len, int flags);
+ssize_t __real_send(int fd, const void *buf, size_t len, int flags);
+int __real_open(const char *path, int flags, mode_t mode);
+int __real_close(int fd);
+void *__real_mmap(void *addr, size_t len, int prot, int flags, int fd,
+                  off_t off);
+int __real_munmap(void *addr, size_t len);
+
+void *__wrap_malloc(size_t size) {
+    COUNT(n_allocs);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    COUNT(n_allocs);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    COUNT(n_allocs);
+    return __real_realloc(ptr, size);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+    COUNT(n_syscalls);
+    return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+    COUNT(n_syscalls);
+    return __real_write(fd, buf, count);
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt) {
+    COUNT(n_syscalls);
+    return __real_writev(fd, iov, iovcnt);
+}
+
+ssize_t __wrap_recv(int fd, void *buf, size_t len, int flags) {
+    COUNT(n_syscalls);
+    return __real_recv(fd, buf, len, flags);
+}
+
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags) {
+    COUNT(n_syscalls);
+    return __real_send(fd, buf, len, flags);
+}
+
+int __wrap_open(const char *path, int flags, mode_t mode) {
+    COUNT(n_syscalls);
+    return __real_open(path, flags, mode);
+}
+
+int __wrap_close(int fd) {
+    COUNT(n_syscalls);
+    return __real_close(fd);
+}
+
+void *__wrap_mmap(void *addr, size_t len, int prot, int flags, int fd,
+                  off_t off) {
+    COUNT(n_syscalls);
+    return __real_mmap(addr, len, prot, flags, fd, off);
+}
+
+int __wrap_munmap(void *addr, size_t len) {
+    COUNT(n_syscalls);
+    return __real_munmap(addr, len);
+}
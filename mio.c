@@ -6,7 +6,10 @@
  *  @bug I am finding
  */
 
+#include <sys/sendfile.h>
+
 #include "mio.h"
+#include "probe.h"
 
 
 /** @brief Send n bytes to a socket or ssl
@@ -28,12 +31,12 @@ ssize_t mio_sendn(int fd, SSL *ssl_context, char *ubuf, size_t n) {
 		    if (errno == EINTR)  /* interrupted by sig handler return */
 				nsend = 0;    /* and call send() again */
 			else if (errno == EPIPE) {
-				fprintf(stderr, "EPIPE handled\n");
+				PROBE(PR_IO, epipe, "fd %d", fd);
 				return -1;
 			} else if (errno == EAGAIN) {
 				nsend = 0;
 			} else {
-				printf("send error on %s\n", strerror(errno));
+				PROBE(PR_IO, send_error, "fd %d, errno %d", fd, errno);
 				return -1;       /* errorno set by send() */
 			}
 		}
@@ -48,12 +51,12 @@ ssize_t mio_sendn(int fd, SSL *ssl_context, char *ubuf, size_t n) {
 	    if (errno == EINTR)  /* interrupted by sig handler return */
 			nsend = 0;    /* and call send() again */
 		else if (errno == EPIPE) {
-			fprintf(stderr, "EPIPE handled\n");
+			PROBE(PR_IO, epipe, "fd %d", fd);
 			return -1;
 		} else if (errno == EAGAIN) {
 			nsend = 0;
 		} else {
-			printf("send error on %s\n", strerror(errno));
+			PROBE(PR_IO, send_error, "fd %d, errno %d", fd, errno);
 			return -1;       /* errorno set by send() */
 		}
 	}
@@ -63,6 +66,75 @@ ssize_t mio_sendn(int fd, SSL *ssl_context, char *ubuf, size_t n) {
     return n;
 }
 
+/** @brief Send what a socket or ssl takes now, without waiting
+ *	@param fd the fd to send to
+ *  @param ssl_context the ssl context to send to
+ *  @param buf the buf containing things to be sent
+ *	@param n the most bytes to send
+ *  @return -1 on error
+ *	@return 0 if the socket is full
+ *  @return the number of bytes sent
+ */
+ssize_t mio_send(int fd, SSL *ssl_context, char *buf, size_t n) {
+	ssize_t nsend;
+	int err;
+
+	if (ssl_context != NULL) {
+		if ((nsend = SSL_write(ssl_context, buf, n)) > 0)
+			return nsend;
+		err = SSL_get_error(ssl_context, nsend);
+		if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+			return 0;    /* call again with the same buf and n */
+		PROBE(PR_IO, send_error, "fd %d, errno %d", fd, errno);
+		return -1;
+	}
+
+	while ((nsend = send(fd, buf, n, 0)) < 0) {
+		if (errno == EINTR)  /* interrupted by sig handler return */
+			continue;
+		if (errno == EAGAIN)
+			return 0;
+		if (errno == EPIPE)
+			PROBE(PR_IO, epipe, "fd %d", fd);
+		else
+			PROBE(PR_IO, send_error, "fd %d, errno %d", fd, errno);
+		return -1;
+	}
+	return nsend;
+}
+
+/** @brief Send what a socket takes now of a file, without waiting,
+ *         the kernel copies it from the page cache
+ *	@param fd the socket to send to, not ssl
+ *  @param file_fd the file to send from
+ *  @param off the offset in the file to start at
+ *	@param n the most bytes to send
+ *  @return -1 on error
+ *	@return 0 if the socket is full
+ *  @return the number of bytes sent
+ */
+ssize_t mio_sendfile(int fd, int file_fd, off_t off, size_t n) {
+	ssize_t nsend;
+
+	while ((nsend = sendfile(fd, file_fd, &off, n)) < 0) {
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN)
+			return 0;
+		if (errno == EPIPE)
+			PROBE(PR_IO, epipe, "fd %d", fd);
+		else
+			PROBE(PR_IO, send_error, "fd %d, errno %d", fd, errno);
+		return -1;
+	}
+	/* the file was cut short under us, do not spin on it */
+	if (nsend == 0 && n > 0) {
+		PROBE(PR_IO, send_error, "fd %d, errno %d", fd, EIO);
+		return -1;
+	}
+	return nsend;
+}
+
 /** @brief Read n bytes from a socket or ssl
  *	@param fd the fd to read from
  *  @param ssl_context the ssl context to read from
@@ -87,7 +159,7 @@ ssize_t mio_readn(int fd, SSL *ssl_context, char *buf, size_t n) {
 			if (errno == EAGAIN)
 				return res;
 			else {
-				printf("send error on %s\n", strerror(errno));
+				PROBE(PR_IO, read_error, "fd %d, errno %d", fd, errno);
 				return -1;
 			}
 		}
@@ -101,7 +173,7 @@ ssize_t mio_readn(int fd, SSL *ssl_context, char *buf, size_t n) {
 		if (errno == EAGAIN)
 			return res;
 		else {
-			printf("send error on %s\n", strerror(errno));
+			PROBE(PR_IO, read_error, "fd %d, errno %d", fd, errno);
 			return -1;
 		}
 	}
@@ -156,7 +228,7 @@ ssize_t mio_recvlineb(int fd, SSL *ssl_context, void *usrbuf, size_t maxlen)
 		} else {
 			if (errno == EWOULDBLOCK)
 				break;
-			printf("send error on %s\n", strerror(errno));
+			PROBE(PR_IO, recv_error, "fd %d, errno %d", fd, errno);
 		    return -1;	  /* error */
 		}
     }
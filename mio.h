@@ -10,6 +10,9 @@
 #include <stdio.h>
 #include <openssl/ssl.h>
 
+#include "arena.h"
+#include "chain.h"
+
 
 
 #define STAGE_MUV              1000
@@ -21,13 +24,28 @@
 
 #define REQ_VALID               1
 #define REQ_INVALID             0
-#define REQ_PIPE                2
+#define REQ_PIPE                2  /* waiting on a queued or running cgi job */
+#define REQ_IO                  3  /* waiting on an I/O thread for its file */
+
+#define PH_START                0  /* request line read */
+#define PH_HEADERS              1  /* headers parsed */
+#define PH_BODY                 2  /* post body read */
+#define PH_HANDLER              3  /* response built, or cgi/proxy started */
+#define PH_READY                4  /* cgi or upstream response arrived */
+#define PH_WRITE                5  /* connection writable, sending starts */
+#define PH_SENT_HDR             6  /* response headers sent */
+#define PH_DONE                 7  /* response body sent */
+#define PH_MAX                  8
 
 #define IO_SSL                  1
 #define IO_HTTP                 0
 
 
 
+struct cgi_job;
+struct proxy;
+struct route;
+
 typedef struct headers {
     char *key;
     char *value;
@@ -41,32 +59,78 @@ typedef struct requests {
     Headers *header;
     int valid;
     char *response;  /* response header */
-    char *body;    /* response body*/ 
+    int response_len; /* length of response, cgi output may hold NULs */
+    char *body;    /* window of the body file mapped for ssl, or NULL */
     char *post_body; /* request post body */
-    int pipefd;       /* fd from which to read cgi result */
+    struct cgi_job *job; /* cgi job producing the response, if any */
+    struct proxy *proxy; /* upstream exchange producing it, if any */
+    struct route *route; /* how it is answered, from its uri */
     int post_body_length;
-    int body_size;
+    unsigned long long phase[PH_MAX]; /* monotonic us at each PH_*, 0 if skipped */
+    int body_fd;     /* file the body is streamed from, -1 if none */
+    off_t body_size; /* bytes of that file */
+    off_t body_off;  /* file offset body is mapped at */
+    size_t body_len; /* bytes mapped at body */
+    off_t body_ahead; /* the file is advised read ahead up to here */
+    off_t sent;      /* bytes of response, then body, sent so far */
+    Arena arena;     /* strings, headers and response of the request */
     struct requests *next;
 } Requests;
 
 
-/** @brief The buff struct that keeps track of current 
- *         used size and whole size
+#define CONN_MAX               FD_SETSIZE
+#define CONN_SLOT_BITS         16   /* low bits of a ConnId, the rest is gen */
+
+
+/** @brief Handle to a connection: slot index and generation
+ *         A handle kept past the close of its connection no longer
+ *         resolves, even once the slot is reused
+ */
+typedef unsigned int ConnId;
+
+/** @brief The fields of a connection touched only on accept, close
+ *         and when a request is built or answered
  *
  */
-typedef struct buff {
+typedef struct conn_cold {
     char addr[INET_ADDRSTRLEN];  /* client ip address */
-    char *buf;    /* actual buf, dynamically allocated */
-    int fd;        /* client fd */
     SSL *client_context;  /* client ssl context */
-    int port; 
-    unsigned int cur_size; /* current used size of this buf */
-    unsigned int cur_parsed;
-    unsigned int size;     /* whole size of this buf */
-    Requests *cur_request;
-    int stage;
+    int port;
     Requests *request;
-} Buff; 
+    unsigned long long handshake_us; /* TLS handshake, traced with 1st request */
+    int rl_slot;          /* client in the rate limit table, < 0 if none */
+    Requests first;       /* head of request, kept with its arena by the slot */
+    unsigned int gen;     /* bumped on every close of the slot */
+    int live_pos;         /* index in ConnTab.live, -1 while free */
+    int next_free;
+} ConnCold;
+
+/** @brief The buff struct that keeps track of what has been read
+ *         of the current request and how much of it is parsed
+ *         Only what the event loop reads on every wakeup, one cache
+ *         line per connection
+ */
+typedef struct buff {
+    int fd;        /* client fd */
+    int stage;
+    unsigned int cur_parsed; /* offset in `in` of the line being read */
+    unsigned int last_active; /* Pool.now when last read or written */
+    Chain in;     /* request line and headers, empty while idle */
+    Requests *cur_request;
+    ConnCold *cold;
+} __attribute__((aligned(64))) Buff;
+
+/** @brief Connection table, slots are recycled through a free-list
+ *         and the slots in use are kept dense in live[]
+ *
+ */
+typedef struct conn_tab {
+    Buff hot[CONN_MAX];
+    ConnCold cold[CONN_MAX];
+    int live[CONN_MAX];   /* slots in use, in no particular order */
+    int n;                /* # of slots in use */
+    int free_head;        /* first free slot, -1 when full */
+} ConnTab;
 
 /** @brief The pool of fd that works with select()
  *
@@ -79,20 +143,19 @@ typedef struct pool {
     fd_set ready_write; /* The set of fd that is ready to write */
     int nready;       /* The # of fd that is ready to recv or send */
     int cur_conn;     /* The current number of established connection */
-    int maxi;         /* The max index of fd */
-    int maxi_pipes;    /* The max index uesd in pipes */
-    int client_sock[FD_SETSIZE]; /* array for client fd */
+    unsigned int now; /* seconds, monotonic, taken at every wakeup */
     FILE *logfd;
     char *www;
     char *cgi;
-    int pipes[FD_SETSIZE];    /* array of cgi pips */
-    Buff *buf[FD_SETSIZE];    /* array of points to buff */
+    ConnTab conns;    /* the client connections */
 } Pool;
 
 
 
 /* Mio (Ming I/O) package */
 ssize_t mio_sendn(int fd, SSL *ssl_context, char *ubuf, size_t n);
+ssize_t mio_send(int fd, SSL *ssl_context, char *buf, size_t n);
+ssize_t mio_sendfile(int fd, int file_fd, off_t off, size_t n);
 ssize_t mio_readn(int fd, SSL *ssl_context, char *buf, size_t n);
 ssize_t mio_recvlineb(int fd, SSL *ssl_context, void *usrbuf, size_t maxlen);
 
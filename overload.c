@@ -0,0 +1,157 @@
+/** @file overload.c
+ *  @brief Admission control for new connections
+ *         Every wakeup the controller looks at three signals: open
+ *         connections, how long the event loop stays busy per wakeup
+ *         (a moving average, the time a ready socket waits at worst),
+ *         and CGI jobs queued for a child. Each has a soft and a hard
+ *         limit from the config file.
+ *
+ *         Past a soft limit new connections are still accepted, so
+ *         clients hear about it: lisod closes the least recently
+ *         active idle keep-alive connection to make room when too many
+ *         are open, or else answers the new one with 503 and a
+ *         Retry-After right away. Past a hard limit the listening
+ *         sockets leave the select() set and new connections wait in
+ *         the backlog. A level is left only once its signal is 10%
+ *         under the limit, so the server does not flap around it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "overload.h"
+#include "cgi.h"
+#include "conf.h"
+#include "metrics.h"
+#include "probe.h"
+
+
+#define RESP_SIZE     256
+#define DRAIN_SIZE    4096
+
+Overload overload;
+
+
+/** @brief Take the signals of this wakeup and set the level
+ *  @param p the pointer to the pool
+ *  @param busy_us how long the last wakeup took to handle
+ *  @return Void
+ */
+void overload_update(Pool *p, unsigned long long busy_us) {
+    int level = OL_NORMAL, cause = overload.cause, i, l;
+    long soft, hard;
+
+    overload.value[OL_CONNS] = p->cur_conn;
+    overload.value[OL_LAG] += ((long)busy_us - overload.value[OL_LAG]) /
+                              OL_LAG_WEIGHT;
+    overload.value[OL_QUEUE] = cgi_queued();
+
+    for (i = 0; i < OL_SIGNALS; i++) {
+        soft = overload_limit(i, OL_SHED);
+        hard = overload_limit(i, OL_STOP);
+        if (overload.level >= OL_SHED)
+            soft -= soft / 10;
+        if (overload.level >= OL_STOP)
+            hard -= hard / 10;
+        l = overload.value[i] >= hard ? OL_STOP :
+            overload.value[i] >= soft ? OL_SHED : OL_NORMAL;
+        if (l > level) {
+            level = l;
+            cause = i;
+        }
+    }
+
+    if (level != overload.level) {
+        PROBE(PR_LOOP, overload, "%s, %s %ld", overload_name(level),
+              overload_signal(cause), overload.value[cause]);
+        fprintf(stderr, "Overload level %s, %s at %ld.\n",
+                overload_name(level), overload_signal(cause),
+                overload.value[cause]);
+    }
+    overload.level = level;
+    overload.cause = cause;
+    if (level == OL_STOP)
+        overload.paused++;
+}
+
+/** @brief Answer a just accepted connection with 503 and close it
+ *  @param fd the socket
+ *  @param ssl its SSL context, NULL for plain http
+ *  @return Void
+ */
+void overload_reject(int fd, SSL *ssl) {
+    int retry;
+
+    retry = overload.cause == OL_QUEUE ? cgi_retry_after() :
+            1 + (int)(overload.value[OL_LAG] / 1000000);
+    PROBE(PR_CONN, shed, "sock %d, %s", fd, overload_signal(overload.cause));
+    overload_answer(fd, ssl, "503 Service Unavailable", retry);
+    overload.shed++;
+}
+
+/** @brief Answer a just accepted connection with an error and close it
+ *         What the client already sent is read first, closing with
+ *         unread data would reset the connection before the client
+ *         sees the answer
+ *  @param fd the socket
+ *  @param ssl its SSL context, NULL for plain http
+ *  @param status status code and reason
+ *  @param retry seconds for Retry-After
+ *  @return Void
+ */
+void overload_answer(int fd, SSL *ssl, char *status, int retry) {
+    char resp[RESP_SIZE], drain[DRAIN_SIZE];
+    int len;
+
+    len = sprintf(resp, "HTTP/1.1 %s\r\n"
+                        "Server: Liso/1.0\r\n"
+                        "Retry-After: %d\r\n"
+                        "Content-Length: 0\r\n"
+                        "Connection: Close\r\n\r\n", status, retry);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (ssl != NULL) {
+        SSL_read(ssl, drain, sizeof(drain));
+        SSL_write(ssl, resp, len);
+        SSL_free(ssl);
+    } else {
+        recv(fd, drain, sizeof(drain), MSG_DONTWAIT);
+        send(fd, resp, len, MSG_DONTWAIT);
+    }
+    close(fd);
+    METRIC_INC(status[atoi(status)]);
+}
+
+/** @brief Limit of a signal from the config file, in its units
+ *  @param signal OL_CONNS, OL_LAG or OL_QUEUE
+ *  @param level OL_SHED for the soft limit, OL_STOP for the hard one
+ *  @return the limit
+ */
+long overload_limit(int signal, int level) {
+    int *limits[OL_SIGNALS] = { conf.overload_conns, conf.overload_lag,
+                                conf.overload_queue };
+    long scale[OL_SIGNALS] = { 1, 1000, 1 };   /* lag limits are in ms */
+
+    return limits[signal][level - OL_SHED] * scale[signal];
+}
+
+/** @brief Name of a level
+ *  @param level OL_NORMAL, OL_SHED or OL_STOP
+ *  @return the name
+ */
+const char *overload_name(int level) {
+    static const char *names[] = { "normal", "shed", "stop" };
+
+    return names[level];
+}
+
+/** @brief Name of a signal
+ *  @param signal OL_CONNS, OL_LAG or OL_QUEUE
+ *  @return the name
+ */
+const char *overload_signal(int signal) {
+    static const char *names[] = { "connections", "loop_lag_us",
+                                   "cgi_queue" };
+
+    return names[signal];
+}
@@ -0,0 +1,44 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include <openssl/ssl.h>
+
+#include "mio.h"
+
+
+#define OL_NORMAL          0
+#define OL_SHED            1    /* past a soft limit: make room or answer 503 */
+#define OL_STOP            2    /* past a hard limit: accept() nothing */
+
+#define OL_CONNS           0    /* what put the server in its level */
+#define OL_LAG             1
+#define OL_QUEUE           2
+#define OL_SIGNALS         3
+
+#define OL_LAG_WEIGHT      8    /* loop lag is averaged over about 8 wakeups */
+
+/** @brief What the overload controller sees and decided at the last
+ *         wakeup
+ *
+ */
+typedef struct overload {
+    int level;            /* OL_NORMAL, OL_SHED or OL_STOP */
+    int cause;            /* OL_CONNS, OL_LAG or OL_QUEUE, if not normal */
+    long value[OL_SIGNALS]; /* connections, lag in us, cgi jobs queued */
+    unsigned long shed;   /* new connections answered with 503 */
+    unsigned long evicted; /* idle connections closed to admit new ones */
+    unsigned long paused; /* wakeups with accept() stopped */
+} Overload;
+
+extern Overload overload;
+
+
+/* Overload package */
+void overload_update(Pool *p, unsigned long long busy_us);
+void overload_reject(int fd, SSL *ssl);
+void overload_answer(int fd, SSL *ssl, char *status, int retry);
+long overload_limit(int signal, int level);
+const char *overload_name(int level);
+const char *overload_signal(int signal);
+
+#endif
@@ -0,0 +1,100 @@
+/** @file probe.c
+ *  @brief Subsystem mask and output of the probes, see probe.h
+ *         The mask is set with the probe directive of the config file
+ *         and changed while running through /probes on the admin port:
+ *
+ *             curl 'http://127.0.0.1:<admin_port>/probes?conn,cgi'
+ */
+
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "probe.h"
+
+
+/**************** BEGIN CONSTANTS ***************/
+#define PROBE_LINE_SIZE  1024
+
+/**************** END CONSTANTS ***************/
+
+unsigned int probe_mask;
+
+static const char *names[] = PR_NAMES;
+
+
+/** @brief Parse a comma separated list of subsystems, or all or none
+ *  @param list the list
+ *  @param mask where to put the bits
+ *  @return EXIT_FAILURE on an unknown subsystem
+ *  @return EXIT_SUCCESS on success
+ */
+int probe_parse(char *list, unsigned int *mask) {
+    unsigned int m = 0;
+    char *p, *end;
+    int i, len;
+
+    for (p = list; *p; p = *end ? end + 1 : end) {
+        end = p + strcspn(p, ",");
+        len = end - p;
+        if (len == 3 && !strncmp(p, "all", 3)) {
+            m |= PR_ALL;
+            continue;
+        }
+        if (len == 4 && !strncmp(p, "none", 4))
+            continue;
+        for (i = 0; names[i]; i++)
+            if ((int)strlen(names[i]) == len && !strncmp(p, names[i], len))
+                break;
+        if (names[i] == NULL)
+            return EXIT_FAILURE;
+        m |= 1 << i;
+    }
+    *mask = m;
+    return EXIT_SUCCESS;
+}
+
+/** @brief Name the subsystems of a mask
+ *  @param mask the bits
+ *  @param buf where to put the comma separated list, or "none"
+ *  @param size size of buf
+ *  @return Void
+ */
+void probe_names(unsigned int mask, char *buf, int size) {
+    int i, len = 0;
+
+    buf[0] = '\0';
+    for (i = 0; names[i] && len < size; i++)
+        if (mask & (1 << i))
+            len += snprintf(buf + len, size - len, "%s%s", len ? "," : "",
+                            names[i]);
+    if (len == 0)
+        snprintf(buf, size, "none");
+}
+
+/** @brief Print a probe that fired, in one write so lines do not mix
+ *  @param sub the subsystem
+ *  @param name the probe
+ *  @param format the format of the args
+ *  @return Void
+ */
+void probe_printf(unsigned int sub, const char *name, const char *format,
+                  ...) {
+    char line[PROBE_LINE_SIZE];
+    struct timespec ts;
+    va_list args;
+    int i, len;
+
+    for (i = 0; names[i] && !(sub & (1 << i)); i++)
+        ;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    len = snprintf(line, PROBE_LINE_SIZE, "%ld.%06ld %s:%s ", (long)ts.tv_sec,
+                   ts.tv_nsec / 1000, names[i] ? names[i] : "?", name);
+    va_start(args, format);
+    len += vsnprintf(line + len, PROBE_LINE_SIZE - len, format, args);
+    va_end(args);
+    if (len >= PROBE_LINE_SIZE - 1)
+        len = PROBE_LINE_SIZE - 2;
+    line[len++] = '\n';
+    write(STDERR_FILENO, line, len);
+}
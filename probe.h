@@ -0,0 +1,66 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* Subsystems, probe_mask has a bit set for each one traced to stderr */
+#define PR_CONN       0x01  /* connections accepted and closed */
+#define PR_PARSE      0x02  /* request lines, headers and bodies */
+#define PR_SEND       0x04  /* responses going out */
+#define PR_IO         0x08  /* errors in the mio package */
+#define PR_CGI        0x10
+#define PR_PROXY      0x20
+#define PR_LOOP       0x40  /* event loop wakeups */
+#define PR_ALL        0x7f
+#define PR_NAMES      {"conn", "parse", "send", "io", "cgi", "proxy", "loop", \
+                       NULL}
+
+#define PROBE_NAMES_SIZE 64
+
+/* PROBE(subsystem, name, format, args...) marks a point worth tracing.
+ *
+ * Where <sys/sdt.h> is installed each probe is also a USDT probe
+ * lisod:name carrying the args, a nop until bpftrace or perf attaches
+ * to it (doc/probes.txt). Either way, when the bit of the subsystem is
+ * set in probe_mask the format and args are printed to stderr, at the
+ * cost of one predicted branch when it is not. Build with
+ * -DPROBE_DISABLE to compile every probe out.
+ *
+ * The args must be cheap to compute: ints and pointers, no calls,
+ * since a USDT probe evaluates them even when nothing is attached.
+ */
+#if defined(PROBE_DISABLE)
+#define PROBE(sub, name, format, ...) do { \
+        if (0) \
+            probe_printf(sub, #name, format, ##__VA_ARGS__); \
+    } while (0)
+#else
+#if !defined(PROBE_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE_USDT(name, ...) STAP_PROBEV(lisod, name, ##__VA_ARGS__)
+#endif
+#endif
+#ifndef PROBE_USDT
+#define PROBE_USDT(name, ...) do { } while (0)
+#endif
+#define PROBE(sub, name, format, ...) do { \
+        PROBE_USDT(name, ##__VA_ARGS__); \
+        if (__builtin_expect(probe_mask & (sub), 0)) \
+            probe_printf(sub, #name, format, ##__VA_ARGS__); \
+    } while (0)
+#endif
+
+extern unsigned int probe_mask;
+
+
+/* Probe package */
+int probe_parse(char *list, unsigned int *mask);
+void probe_names(unsigned int mask, char *buf, int size);
+void probe_printf(unsigned int sub, const char *name, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#endif
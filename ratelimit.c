@@ -0,0 +1,223 @@
+/** @file ratelimit.c
+ *  @brief Per client limits on open connections, requests and CGI runs
+ *         A client is a source IP on one listener, each listener has
+ *         its own limits (the rate_limit directive). Clients live in a
+ *         fixed table of RL_ENTRIES chained into RL_BUCKETS hash heads
+ *         and kept in least recently seen order. A new client takes a
+ *         free entry, or the least recently seen one without an open
+ *         connection, so the table never grows.
+ *
+ *         Requests and CGI runs each take a token from a bucket that
+ *         fills at the configured rate up to its burst. A client with
+ *         an empty bucket is answered 429 with the seconds until the
+ *         next token as Retry-After.
+ */
+
+#include <string.h>
+
+#include "ratelimit.h"
+#include "conf.h"
+#include "metrics.h"
+
+
+/** @brief A client and its buckets
+ *
+ */
+typedef struct rl_entry {
+    unsigned int ip;      /* network order */
+    int scheme;           /* listener, SCHEME_* */
+    int conns;            /* open connections */
+    double tokens[RL_KINDS]; /* [RL_REQUESTS] and [RL_CGI] */
+    unsigned long long stamp; /* us, buckets filled up to then */
+    int hnext;            /* next in the hash chain, -1 at the end */
+    int prev, next;       /* least recently seen list, -1 at the ends */
+} RlEntry;
+
+RateStats rate_stats;
+
+static RlEntry entries[RL_ENTRIES];
+static int heads[RL_BUCKETS];
+static int oldest = -1, newest = -1;
+
+static unsigned int rl_hash(unsigned int ip, int scheme);
+static int rl_new(unsigned int ip, int scheme);
+static void rl_unlink(int slot);
+static void rl_push(int slot);
+static void rl_fill(RlEntry *e, RateLimit *rl);
+
+
+/** @brief Empty the table
+ *  @return Void
+ */
+void ratelimit_init() {
+    memset(heads, -1, sizeof(heads));
+    memset(&rate_stats, 0, sizeof(rate_stats));
+    oldest = newest = -1;
+}
+
+/** @brief Count a new connection of a client
+ *  @param ip source address, network order
+ *  @param scheme the listener, SCHEME_*
+ *  @return the slot of the client, to give to the other calls
+ *  @return RL_LIMITED if it has as many connections open as allowed
+ *  @return RL_NONE if the listener has no limits
+ */
+int ratelimit_connect(unsigned int ip, int scheme) {
+    RateLimit *rl = &conf.rate_limit[scheme];
+    unsigned int h = rl_hash(ip, scheme);
+    RlEntry *e;
+    int slot;
+
+    if (rl->conns == 0 && rl->rate[0] == 0 && rl->rate[1] == 0)
+        return RL_NONE;
+    for (slot = heads[h]; slot >= 0; slot = entries[slot].hnext)
+        if (entries[slot].ip == ip && entries[slot].scheme == scheme)
+            break;
+    if (slot < 0 && (slot = rl_new(ip, scheme)) < 0)
+        return RL_NONE;
+    e = &entries[slot];
+    rl_unlink(slot);
+    rl_push(slot);
+    if (rl->conns && e->conns >= rl->conns) {
+        rate_stats.limited[RL_CONNS]++;
+        return RL_LIMITED;
+    }
+    e->conns++;
+    return slot;
+}
+
+/** @brief Count a closed connection of a client
+ *  @param slot what ratelimit_connect() gave
+ *  @return Void
+ */
+void ratelimit_disconnect(int slot) {
+    if (slot >= 0 && entries[slot].conns > 0)
+        entries[slot].conns--;
+}
+
+/** @brief Take a token for a request or a CGI run
+ *  @param slot what ratelimit_connect() gave
+ *  @param kind RL_REQUESTS or RL_CGI
+ *  @return 0 if the client may go on
+ *  @return seconds until it may, for Retry-After, if its bucket is empty
+ */
+int ratelimit_take(int slot, int kind) {
+    RlEntry *e;
+    RateLimit *rl;
+    double rate;
+
+    if (slot < 0)
+        return 0;
+    e = &entries[slot];
+    rl = &conf.rate_limit[e->scheme];
+    if ((rate = rl->rate[kind - RL_REQUESTS]) == 0)
+        return 0;
+    rl_fill(e, rl);
+    if (e->tokens[kind] >= 1) {
+        e->tokens[kind] -= 1;
+        return 0;
+    }
+    rate_stats.limited[kind]++;
+    return 1 + (int)((1 - e->tokens[kind]) / rate);
+}
+
+/** @brief Hash chain of a client
+ *  @param ip source address
+ *  @param scheme the listener
+ *  @return index in heads
+ */
+static unsigned int rl_hash(unsigned int ip, int scheme) {
+    return ((ip ^ (unsigned int)scheme) * 2654435761U) >> 19 &
+           (RL_BUCKETS - 1);
+}
+
+/** @brief Take an entry for a client not in the table, with full
+ *         buckets
+ *  @param ip source address
+ *  @param scheme the listener
+ *  @return the slot, -1 if every client has a connection open
+ */
+static int rl_new(unsigned int ip, int scheme) {
+    RateLimit *rl = &conf.rate_limit[scheme];
+    RlEntry *e;
+    int slot, *link;
+
+    if (rate_stats.tracked < RL_ENTRIES) {
+        slot = rate_stats.tracked++;
+    } else {
+        for (slot = oldest; slot >= 0; slot = entries[slot].next)
+            if (entries[slot].conns == 0)
+                break;
+        if (slot < 0)
+            return -1;
+        e = &entries[slot];
+        for (link = &heads[rl_hash(e->ip, e->scheme)]; *link != slot;
+             link = &entries[*link].hnext)
+            ;
+        *link = e->hnext;
+        rl_unlink(slot);
+        rate_stats.evicted++;
+    }
+    e = &entries[slot];
+    e->ip = ip;
+    e->scheme = scheme;
+    e->conns = 0;
+    e->tokens[RL_REQUESTS] = rl->burst[0];
+    e->tokens[RL_CGI] = rl->burst[1];
+    e->stamp = metrics_now();
+    e->hnext = heads[rl_hash(ip, scheme)];
+    heads[rl_hash(ip, scheme)] = slot;
+    e->prev = e->next = -1;
+    rl_push(slot);
+    return slot;
+}
+
+/** @brief Take an entry out of the least recently seen list
+ *  @param slot the entry
+ *  @return Void
+ */
+static void rl_unlink(int slot) {
+    RlEntry *e = &entries[slot];
+
+    if (e->prev >= 0)
+        entries[e->prev].next = e->next;
+    else if (oldest == slot)
+        oldest = e->next;
+    if (e->next >= 0)
+        entries[e->next].prev = e->prev;
+    else if (newest == slot)
+        newest = e->prev;
+    e->prev = e->next = -1;
+}
+
+/** @brief Put an entry at the recent end of the list
+ *  @param slot the entry
+ *  @return Void
+ */
+static void rl_push(int slot) {
+    entries[slot].prev = newest;
+    entries[slot].next = -1;
+    if (newest >= 0)
+        entries[newest].next = slot;
+    else
+        oldest = slot;
+    newest = slot;
+}
+
+/** @brief Add the tokens earned since the buckets were last filled
+ *  @param e the client
+ *  @param rl the limits of its listener
+ *  @return Void
+ */
+static void rl_fill(RlEntry *e, RateLimit *rl) {
+    unsigned long long now = metrics_now();
+    double secs = (now - e->stamp) / 1000000.0;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        e->tokens[RL_REQUESTS + i] += secs * rl->rate[i];
+        if (e->tokens[RL_REQUESTS + i] > rl->burst[i])
+            e->tokens[RL_REQUESTS + i] = rl->burst[i];
+    }
+    e->stamp = now;
+}
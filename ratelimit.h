@@ -0,0 +1,36 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdlib.h>
+
+
+#define RL_ENTRIES         4096  /* clients tracked, more than CONN_MAX */
+#define RL_BUCKETS         8192  /* hash chains, a power of two */
+
+#define RL_CONNS           0     /* what a client ran out of */
+#define RL_REQUESTS        1
+#define RL_CGI             2
+#define RL_KINDS           3
+
+#define RL_LIMITED        -1     /* ratelimit_connect(): too many open */
+#define RL_NONE           -2     /* no limit on this listener */
+
+/** @brief Counters of the per client limits
+ *
+ */
+typedef struct rate_stats {
+    unsigned long limited[RL_KINDS]; /* answered 429, by RL_* */
+    unsigned long evicted;  /* clients dropped from the table for new ones */
+    int tracked;            /* clients in the table */
+} RateStats;
+
+extern RateStats rate_stats;
+
+
+/* Rate limit package */
+void ratelimit_init(void);
+int ratelimit_connect(unsigned int ip, int scheme);
+void ratelimit_disconnect(int slot);
+int ratelimit_take(int slot, int kind);
+
+#endif
@@ -0,0 +1,175 @@
+/** @file reqtrace.c
+ *  @brief Per-request phase breakdowns
+ *         Every request carries a monotonic timestamp per PH_* phase.
+ *         Once its response is sent, a request slower than the
+ *         slow_log threshold is written to the slow log with the time
+ *         spent in each phase. A sample of requests is also written as
+ *         Chrome trace events, which chrome://tracing and Perfetto open.
+ */
+
+#include <time.h>
+#include <sys/stat.h>
+
+#include "reqtrace.h"
+#include "conf.h"
+
+
+/* Span that ends at each phase, from the previous phase recorded */
+static const char *phase_names[PH_MAX] = {
+    "handshake", "headers", "body", "handler",
+    "backend", "wait_write", "send_header", "send_body"
+};
+
+static int slow_fd = -1;
+static int trace_fd = -1;
+static unsigned long traced = 0;
+
+static void slow_write(Buff *b, Requests *req, int status);
+static void trace_write(Buff *b, Requests *req, int status);
+static int trace_len(int len);
+
+
+/** @brief Open the slow log and the trace file of the config
+ *  @return EXIT_FAILURE on fail
+ *  @return EXIT_SUCCESS on success
+ */
+int reqtrace_init() {
+    struct stat st;
+
+    if (conf.slow_log &&
+        (slow_fd = open(conf.slow_log, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,
+                        0640)) < 0) {
+        fprintf(stderr, "Error opening slow log %s.\n", conf.slow_log);
+        return EXIT_FAILURE;
+    }
+    if (conf.trace_log) {
+        if ((trace_fd = open(conf.trace_log,
+                             O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0640)) < 0) {
+            fprintf(stderr, "Error opening trace log %s.\n", conf.trace_log);
+            return EXIT_FAILURE;
+        }
+        /* the closing ] of the JSON array format is optional */
+        if (fstat(trace_fd, &st) == 0 && st.st_size == 0)
+            write(trace_fd, "[\n", 2);
+    }
+    return EXIT_SUCCESS;
+}
+
+/** @brief Report a request whose response has been sent in full
+ *  @param b Buff struct representing a connection
+ *  @param req the request
+ *  @return Void
+ */
+void reqtrace_done(Buff *b, Requests *req) {
+    unsigned long long total;
+    int status = 0;
+
+    if (req->phase[PH_START] == 0)
+        return;
+    if (req->response_len > 12)
+        status = atoi(req->response + 9);
+    total = req->phase[PH_DONE] - req->phase[PH_START];
+
+    if (slow_fd >= 0 && total >= (unsigned long long)conf.slow_ms * 1000)
+        slow_write(b, req, status);
+    if (trace_fd >= 0 && traced++ % conf.trace_sample == 0)
+        trace_write(b, req, status);
+    /* the handshake only delays the first request */
+    b->cold->handshake_us = 0;
+}
+
+/** @brief Write a slow request and where its time went
+ *  @param b Buff struct representing a connection
+ *  @param req the request
+ *  @param status response status
+ *  @return Void
+ */
+static void slow_write(Buff *b, Requests *req, int status) {
+    char line[TRACE_LINE_SIZE], date[64];
+    unsigned long long prev = req->phase[PH_START];
+    time_t t = time(NULL);
+    int i, len;
+
+    strftime(date, sizeof(date), "%a, %d %b %Y %T %Z", localtime(&t));
+    len = trace_len(snprintf(line, TRACE_LINE_SIZE,
+                   "%s [%s] \"%.16s %.1024s %.16s\" "
+                   "%d total=%.3fms", b->cold->addr, date, req->method, req->uri,
+                   req->version, status,
+                   (req->phase[PH_DONE] - req->phase[PH_START]) / 1000.0));
+    if (b->cold->handshake_us)
+        len = trace_len(len + snprintf(line + len, TRACE_LINE_SIZE - len,
+                        " %s=%.3fms",
+                        phase_names[PH_START], b->cold->handshake_us / 1000.0));
+    for (i = PH_START + 1; i < PH_MAX && len < TRACE_LINE_SIZE - 64; i++) {
+        if (req->phase[i] == 0)
+            continue;
+        len = trace_len(len + snprintf(line + len, TRACE_LINE_SIZE - len,
+                        " %s=%.3fms",
+                        phase_names[i], (req->phase[i] - prev) / 1000.0));
+        prev = req->phase[i];
+    }
+    line[len++] = '\n';
+    write(slow_fd, line, len);
+}
+
+/** @brief Write a request as Chrome trace complete events, one for the
+ *         whole request on the track of its connection, then one per phase
+ *  @param b Buff struct representing a connection
+ *  @param req the request
+ *  @param status response status
+ *  @return Void
+ */
+static void trace_write(Buff *b, Requests *req, int status) {
+    char line[TRACE_LINE_SIZE], uri[256];
+    unsigned long long prev = req->phase[PH_START];
+    int i, j, len;
+
+    /* uri as a JSON string */
+    for (i = j = 0; req->uri[i] && j < (int)sizeof(uri) - 7; i++) {
+        if (req->uri[i] == '"' || req->uri[i] == '\\')
+            uri[j++] = '\\';
+        if ((unsigned char)req->uri[i] < 0x20)
+            j += sprintf(uri + j, "\\u%04x", req->uri[i]);
+        else
+            uri[j++] = req->uri[i];
+    }
+    uri[j] = '\0';
+
+    len = trace_len(snprintf(line, TRACE_LINE_SIZE,
+                   "{\"name\":\"%.16s %s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                   "\"ts\":%llu,\"dur\":%llu,"
+                   "\"args\":{\"status\":%d,\"client\":\"%s\"}},\n",
+                   req->method, uri, (int)getpid(), b->fd,
+                   req->phase[PH_START],
+                   req->phase[PH_DONE] - req->phase[PH_START],
+                   status, b->cold->addr));
+    if (b->cold->handshake_us)
+        len = trace_len(len + snprintf(line + len, TRACE_LINE_SIZE - len,
+                        "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                        "\"ts\":%llu,\"dur\":%llu},\n",
+                        phase_names[PH_START], (int)getpid(), b->fd,
+                        req->phase[PH_START] - b->cold->handshake_us,
+                        b->cold->handshake_us));
+    for (i = PH_START + 1; i < PH_MAX && len < TRACE_LINE_SIZE - 160; i++) {
+        if (req->phase[i] == 0)
+            continue;
+        len = trace_len(len + snprintf(line + len, TRACE_LINE_SIZE - len,
+                        "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                        "\"ts\":%llu,\"dur\":%llu},\n",
+                        phase_names[i], (int)getpid(), b->fd,
+                        prev, req->phase[i] - prev));
+        prev = req->phase[i];
+    }
+    write(trace_fd, line, len);
+}
+
+/** @brief Keep the length of a line being built inside its buffer,
+ *         snprintf() returns what it would have written
+ *  @param len the length snprintf() reports
+ *  @return the length of the line in the buffer
+ */
+static int trace_len(int len) {
+    if (len < 0)
+        return 0;
+    return len < TRACE_LINE_SIZE - 1 ? len : TRACE_LINE_SIZE - 1;
+}
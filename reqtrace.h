@@ -0,0 +1,24 @@
+#ifndef REQTRACE_H
+#define REQTRACE_H
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "mio.h"
+#include "metrics.h"
+
+
+#define TRACE_LINE_SIZE   2048
+
+/* Stamp a phase of a request with the monotonic clock */
+#define TRACE_PHASE(req, ph)  ((req)->phase[ph] = metrics_now())
+
+
+/* Request trace package */
+int reqtrace_init(void);
+void reqtrace_done(Buff *b, Requests *req);
+
+#endif
@@ -0,0 +1,251 @@
+/** @file route.c
+ *  @brief The route table, which handler answers a request
+ *         The command line gives the two default routes: files under
+ *         the www folder for every uri, and the CGI script for /cgi/.
+ *         route, proxy and cache_ttl directives add to them. At start
+ *         the rules are compiled into a byte trie of their prefixes,
+ *         and every trie node is given the route applying there: the
+ *         rule ending at it, with the options it leaves out taken from
+ *         the rules of its shorter prefixes. route_match() walks the
+ *         uri down the trie once, so a lookup costs the length of the
+ *         uri and allocates nothing.
+ *
+ *         Rules for an extension, "*.py", go in a second trie built
+ *         from their reversed suffixes, walked back from the end of
+ *         the path. They only apply where the prefix route serves
+ *         files, so a proxied or scripted path keeps its handler.
+ */
+
+#include "route.h"
+#include "upstream.h"
+
+
+#define ROOT            0     /* of the prefix trie */
+#define EXT_ROOT        1     /* of the extension trie */
+
+/** @brief A byte of a prefix, children are kept in a sibling list
+ *
+ */
+typedef struct route_node {
+    unsigned char c;
+    short child;          /* first child, 0 if none */
+    short sibling;        /* next child of the parent, 0 if none */
+    short rule;           /* rule ending here, -1 if none */
+    short route;          /* route applying here, -1 if none */
+} RouteNode;
+
+static ConfRoute rules[ROUTE_MAX];  /* rules of one prefix merged */
+static int n_rules;
+static Route routes[ROUTE_MAX];
+static int n_routes;
+static RouteNode nodes[ROUTE_MAX_NODES];
+static int n_nodes;
+static int n_ext;                   /* extension rules */
+
+static int route_add(ConfRoute *rule);
+static int route_child(int n, unsigned char c);
+static void route_merge(ConfRoute *to, ConfRoute *rule);
+static int route_resolve(int n, int parent, int ext);
+static int route_build(Route *r, Route *parent, ConfRoute *rule, int ext);
+
+
+/** @brief Compile the default and configured routes, once the
+ *         upstream groups are resolved
+ *  @param www the folder of static files
+ *  @param cgi the default CGI script
+ *  @return EXIT_FAILURE if the rules do not fit, EXIT_SUCCESS on success
+ */
+int route_init(char *www, char *cgi) {
+    ConfRoute dflt[2];
+    int i;
+
+    memset(nodes, 0, 2 * sizeof(RouteNode));
+    nodes[ROOT].rule = nodes[ROOT].route = -1;
+    nodes[EXT_ROOT].rule = nodes[EXT_ROOT].route = -1;
+    n_nodes = 2;
+    n_rules = n_routes = n_ext = 0;
+
+    /* the targets of the defaults stay in argv */
+    memset(dflt, 0, sizeof(dflt));
+    dflt[0].handler = ROUTE_STATIC;
+    dflt[0].target = www;
+    strcpy(dflt[1].prefix, "/cgi/");
+    dflt[1].handler = ROUTE_CGI;
+    dflt[1].target = cgi;
+    dflt[0].ttl = dflt[1].ttl = -1;
+
+    for (i = 0; i < 2 + conf.n_routes; i++)
+        if (route_add(i < 2 ? &dflt[i] : &conf.routes[i - 2]) < 0) {
+            fprintf(stderr, "Too many routes.\n");
+            return EXIT_FAILURE;
+        }
+    if (route_resolve(ROOT, -1, 0) == EXIT_FAILURE ||
+        route_resolve(EXT_ROOT, -1, 1) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+/** @brief Find the route of a request
+ *  @param uri the request uri
+ *  @return the route, never NULL
+ */
+Route *route_match(const char *uri) {
+    const unsigned char *s = (const unsigned char *)uri;
+    int n = ROOT, i;
+    Route *r;
+
+    for (; *s; s++) {
+        for (i = nodes[n].child; i && nodes[i].c != *s; i = nodes[i].sibling)
+            ;
+        if (i == 0)
+            break;
+        n = i;
+    }
+    r = &routes[nodes[n].route];
+    if (r->handler != ROUTE_STATIC || n_ext == 0)
+        return r;
+
+    /* an extension under a folder of files picks its own handler, the
+       path ends at the query, or the line of a cache key */
+    s = (const unsigned char *)uri + strcspn(uri, "?\n");
+    for (n = EXT_ROOT; s > (const unsigned char *)uri; n = i) {
+        s--;
+        for (i = nodes[n].child; i && nodes[i].c != *s; i = nodes[i].sibling)
+            ;
+        if (i == 0)
+            break;
+    }
+    return nodes[n].route >= 0 ? &routes[nodes[n].route] : r;
+}
+
+/** @brief Put a rule in the trie of prefixes, or of extensions
+ *  @param rule the rule
+ *  @return 0 on success, -1 if out of nodes or rules
+ */
+static int route_add(ConfRoute *rule) {
+    const char *s = rule->prefix;
+    int len = strlen(s), ext = (s[0] == '*'), n, i;
+
+    /* an extension is walked from its end, down to the '.' */
+    n = ext ? EXT_ROOT : ROOT;
+    for (i = 0; i < len - ext; i++)
+        if ((n = route_child(n, ext ? s[len - 1 - i] : s[i])) < 0)
+            return -1;
+
+    if (nodes[n].rule >= 0) {
+        /* a later rule for the same prefix adds to the one before */
+        route_merge(&rules[nodes[n].rule], rule);
+        return 0;
+    }
+    if (n_rules == ROUTE_MAX)
+        return -1;
+    nodes[n].rule = n_rules;
+    rules[n_rules++] = *rule;
+    n_ext += ext;
+    return 0;
+}
+
+/** @brief Find or add the child of a node for a byte
+ *  @param n the node
+ *  @param c the byte
+ *  @return the child, -1 if out of nodes
+ */
+static int route_child(int n, unsigned char c) {
+    int i;
+
+    for (i = nodes[n].child; i; i = nodes[i].sibling)
+        if (nodes[i].c == c)
+            return i;
+    if (n_nodes == ROUTE_MAX_NODES)
+        return -1;
+    i = n_nodes++;
+    nodes[i].c = c;
+    nodes[i].child = 0;
+    nodes[i].sibling = nodes[n].child;
+    nodes[i].rule = nodes[i].route = -1;
+    nodes[n].child = i;
+    return i;
+}
+
+/** @brief Overlay the options a rule sets on another
+ *  @param to the rule changed
+ *  @param rule the rule whose options win
+ *  @return Void
+ */
+static void route_merge(ConfRoute *to, ConfRoute *rule) {
+    if (rule->handler != ROUTE_NONE) {
+        to->handler = rule->handler;
+        to->target = rule->target;
+    }
+    if (rule->ttl >= 0) {
+        to->ttl = rule->ttl;
+        to->stale = rule->stale;
+    }
+    if (rule->max_body > 0)
+        to->max_body = rule->max_body;
+}
+
+/** @brief Give a node and those under it the routes applying there
+ *  @param n the node
+ *  @param parent the route applying above it, -1 if none
+ *  @param ext 1 in the trie of extensions
+ *  @return EXIT_FAILURE on fail, EXIT_SUCCESS on success
+ */
+static int route_resolve(int n, int parent, int ext) {
+    int i, r = parent;
+
+    if (nodes[n].rule >= 0) {
+        r = n_routes++;
+        if (route_build(&routes[r], parent >= 0 ? &routes[parent] : NULL,
+                        &rules[nodes[n].rule], ext) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    }
+    nodes[n].route = r;
+    for (i = nodes[n].child; i; i = nodes[i].sibling)
+        if (route_resolve(i, r, ext) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+/** @brief Make the route of a rule
+ *  @param r the route
+ *  @param parent the route of the longest shorter prefix, NULL if none
+ *  @param rule the rule
+ *  @param ext 1 if the rule is for an extension
+ *  @return EXIT_FAILURE if the upstream group is unknown
+ *  @return EXIT_SUCCESS on success
+ */
+static int route_build(Route *r, Route *parent, ConfRoute *rule, int ext) {
+    if (parent != NULL) {
+        *r = *parent;
+    } else {
+        memset(r, 0, sizeof(Route));
+        r->ttl = -1;
+    }
+    r->prefix = rule->prefix;
+    if (rule->handler != ROUTE_NONE) {
+        r->handler = rule->handler;
+        r->target = rule->target;
+        r->target_len = rule->target ? strlen(rule->target) : 0;
+        r->upstream = NULL;
+        /* a file extension names no mount, the whole path is the
+           file or script */
+        r->ext = ext;
+        r->mount_len = ext ? 0 : strlen(rule->prefix);
+        r->script_len = r->mount_len;
+        while (r->script_len > 0 && rule->prefix[r->script_len - 1] == '/')
+            r->script_len--;
+        if (r->handler == ROUTE_UPSTREAM &&
+            (r->upstream = upstream_find(rule->target)) == NULL) {
+            fprintf(stderr, "Unknown upstream %s.\n", rule->target);
+            return EXIT_FAILURE;
+        }
+    }
+    if (rule->ttl >= 0) {
+        r->ttl = rule->ttl;
+        r->stale = rule->stale;
+    }
+    if (rule->max_body > 0)
+        r->max_body = rule->max_body;
+    return EXIT_SUCCESS;
+}
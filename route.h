@@ -0,0 +1,36 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include "conf.h"
+
+
+#define ROUTE_MAX          (CONF_MAX_ROUTES + 2) /* and the two defaults */
+#define ROUTE_MAX_NODES    8192  /* trie nodes, one a byte of prefix */
+
+struct upstream;
+
+/** @brief A route as it applies to a request: the options of the
+ *         longest matching rule, those it leaves out taken from the
+ *         rules of the shorter prefixes
+ *
+ */
+typedef struct route {
+    const char *prefix;   /* of the longest matching rule */
+    int ext;              /* matched on the extension of the path */
+    int handler;          /* ROUTE_* */
+    const char *target;   /* folder or script */
+    int target_len;
+    int mount_len;        /* bytes of the uri cut off before the folder */
+    int script_len;       /* bytes of the uri that name the script */
+    struct upstream *upstream;
+    int ttl;              /* seconds fresh, -1 if none */
+    int stale;
+    int max_body;         /* bytes of a post body, 0 if no limit */
+} Route;
+
+
+/* Route package */
+int route_init(char *www, char *cgi);
+Route *route_match(const char *uri);
+
+#endif
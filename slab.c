@@ -0,0 +1,53 @@
+/** @file slab.c
+ *  @brief Pools of fixed-size objects shared by all connections
+ *         Connection buffers are borrowed while a request is being read
+ *         or answered and given back once the connection goes idle, so
+ *         the memory held follows the connections that are busy, not
+ *         all those that are open. The objects come from large mmapped
+ *         slabs, away from the malloc heap, and are handed out LIFO so
+ *         that the most recently used, still cached, one goes first.
+ */
+
+#include <sys/mman.h>
+
+#include "slab.h"
+
+
+/** @brief Take an object from a pool, mapping a new slab if it is empty
+ *  @param s the pool
+ *  @return the object, NULL if out of memory
+ */
+void *slab_get(SlabPool *s) {
+    size_t size = s->obj_size < sizeof(void *) ? sizeof(void *) : s->obj_size;
+    size_t n, i;
+    char *slab;
+    void *obj;
+
+    if (s->free == NULL) {
+        n = SLAB_BYTES / size ? SLAB_BYTES / size : 1;
+        slab = mmap(NULL, n * size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED)
+            return NULL;
+        for (i = n; i > 0; i--) {
+            *(void **)(slab + (i - 1) * size) = s->free;
+            s->free = slab + (i - 1) * size;
+        }
+        s->total += n;
+    }
+    obj = s->free;
+    s->free = *(void **)obj;
+    s->in_use++;
+    return obj;
+}
+
+/** @brief Give an object back to its pool
+ *  @param s the pool
+ *  @param obj the object
+ *  @return Void
+ */
+void slab_put(SlabPool *s, void *obj) {
+    *(void **)obj = s->free;
+    s->free = obj;
+    s->in_use--;
+}
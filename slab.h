@@ -0,0 +1,28 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+
+#define SLAB_BYTES        (256 * 1024)  /* mapped at a time */
+
+/* A pool of objects of one size, for SlabPool p = SLAB_POOL(size); */
+#define SLAB_POOL(size)   { (size), NULL, 0, 0 }
+
+/** @brief Fixed-size objects carved from mmapped slabs
+ *         Freed objects go on a free-list for the next slab_get(),
+ *         slabs are never unmapped
+ */
+typedef struct slab_pool {
+    size_t obj_size;
+    void *free;               /* free objects, linked through first word */
+    unsigned long in_use;
+    unsigned long total;      /* objects in the slabs mapped so far */
+} SlabPool;
+
+
+/* Slab pool package */
+void *slab_get(SlabPool *s);
+void slab_put(SlabPool *s, void *obj);
+
+#endif
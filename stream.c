@@ -0,0 +1,148 @@
+/** @file stream.c
+ *  @brief Static file bodies sent a piece at a time from an open file
+ *         A response keeps only the file descriptor of its body and
+ *         offsets into it, 64 bits wide, so no size of file is too big
+ *         and what a download holds does not grow with the file.
+ *
+ *         Over http the body goes out with sendfile(), the kernel copies
+ *         from the page cache and nothing is mapped. Over https it has
+ *         to pass through SSL_write(), so a window of stream_window
+ *         bytes of the file is mapped at a time and moved along as it
+ *         is sent. Only the response being sent on a connection has a
+ *         window, the ones pipelined after it hold only their fd, so a
+ *         connection never has more than stream_window bytes mapped.
+ *
+ *         The kernel is told the file is read sequentially and asked to
+ *         read the next window while the current one goes out, so the
+ *         event loop rarely waits on the disk for it.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "stream.h"
+#include "conf.h"
+
+
+StreamStats stream_stats;
+
+static void stream_ahead(Requests *req, off_t off);
+static int stream_map(Requests *req, off_t off);
+
+
+/** @brief Stream the body of a response from a file
+ *  @param req the request, takes the file descriptor
+ *  @param file_fd the file, opened for reading
+ *  @param size bytes of the file to send
+ *  @return Void
+ */
+void stream_open(Requests *req, int file_fd, off_t size) {
+    req->body = NULL;
+    req->body_fd = file_fd;
+    req->body_size = size;
+    req->body_off = 0;
+    req->body_len = 0;
+    req->body_ahead = 0;
+    posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    stream_stats.open++;
+}
+
+/** @brief Send what a socket or ssl takes now of a body, without waiting
+ *  @param fd the socket to send to
+ *  @param ssl_context the ssl context to send to, NULL for http
+ *  @param req the request whose body is sent
+ *  @param off the offset in the body to start at
+ *  @param n the most bytes to send
+ *  @return -1 on error
+ *  @return 0 if the socket is full
+ *  @return the number of bytes sent
+ */
+ssize_t stream_send(int fd, SSL *ssl_context, Requests *req, off_t off,
+                    size_t n) {
+    off_t left;
+
+    stream_ahead(req, off);
+    if (ssl_context == NULL)
+        return mio_sendfile(fd, req->body_fd, off, n);
+
+    if (req->body == NULL || off < req->body_off ||
+        off >= req->body_off + (off_t)req->body_len) {
+        if (stream_map(req, off) < 0) {
+            fprintf(stderr, "Error mapping %ld bytes of a body.\n",
+                    conf.stream_window);
+            return -1;
+        }
+    }
+    /* an ssl retry after WANT_WRITE gets the same bytes back, as off
+       has not moved and the window covering it is still mapped */
+    left = req->body_off + req->body_len - off;
+    if ((off_t)n > left)
+        n = left;
+    return mio_send(fd, ssl_context, req->body + (off - req->body_off), n);
+}
+
+/** @brief Release the file and window of a body, if it has them
+ *  @param req the request
+ *  @return Void
+ */
+void stream_close(Requests *req) {
+    if (req->body != NULL) {
+        munmap(req->body, req->body_len);
+        stream_stats.windows--;
+        stream_stats.mapped -= req->body_len;
+        req->body = NULL;
+    }
+    if (req->body_fd >= 0) {
+        close(req->body_fd);
+        stream_stats.open--;
+        req->body_fd = -1;
+    }
+}
+
+/** @brief Keep the file read ahead a window past the one being sent
+ *  @param req the request
+ *  @param off the offset about to be sent
+ *  @return Void
+ */
+static void stream_ahead(Requests *req, off_t off) {
+    off_t window = conf.stream_window;
+
+    while (req->body_ahead < req->body_size &&
+           req->body_ahead < off + 2 * window) {
+        posix_fadvise(req->body_fd, req->body_ahead, window,
+                      POSIX_FADV_WILLNEED);
+        req->body_ahead += window;
+    }
+}
+
+/** @brief Map the window of a body that covers an offset, in place of
+ *         the one mapped
+ *  @param req the request
+ *  @param off the offset in the body
+ *  @return 0 on success, -1 if mmap() fails
+ */
+static int stream_map(Requests *req, off_t off) {
+    long page = sysconf(_SC_PAGESIZE);
+    off_t window = (conf.stream_window + page - 1) / page * page;
+    off_t base = off / window * window;
+    size_t len = req->body_size - base < window ?
+                 req->body_size - base : window;
+    char *map;
+
+    if (req->body != NULL) {
+        munmap(req->body, req->body_len);
+        stream_stats.windows--;
+        stream_stats.mapped -= req->body_len;
+        req->body = NULL;
+    }
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, req->body_fd, base);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, len, MADV_SEQUENTIAL);
+    req->body = map;
+    req->body_off = base;
+    req->body_len = len;
+    stream_stats.windows++;
+    stream_stats.mapped += len;
+    return 0;
+}
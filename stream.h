@@ -0,0 +1,25 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "mio.h"
+
+
+/** @brief Counters of the bodies streamed from files
+ *
+ */
+typedef struct stream_stats {
+    int open;             /* bodies being streamed */
+    int windows;          /* windows mapped */
+    long mapped;          /* bytes in those windows */
+} StreamStats;
+
+extern StreamStats stream_stats;
+
+
+/* Stream package */
+void stream_open(Requests *req, int file_fd, off_t size);
+ssize_t stream_send(int fd, SSL *ssl_context, Requests *req, off_t off,
+                    size_t n);
+void stream_close(Requests *req);
+
+#endif
@@ -0,0 +1,802 @@
+/** @file upstream.c
+ *  @brief Reverse proxy to upstream http servers
+ *         Requests routed to a group are forwarded over HTTP/1.1 to
+ *         one server of an upstream group, picked by least connections
+ *         or by latency. Connections are non-blocking, selected on with
+ *         the clients, and kept alive in a pool per server. Servers that
+ *         keep failing are ejected for a while, and idempotent requests
+ *         fail over to the next server. A response is buffered whole,
+ *         up to upstream_response bytes, beyond that the client gets 502.
+ */
+
+#define _GNU_SOURCE  /* memmem() */
+
+#include <ctype.h>
+#include <strings.h>
+
+#include "upstream.h"
+#include "cgi.h"
+#include "reqtrace.h"
+#include "probe.h"
+#include "conntab.h"
+
+
+/**************** BEGIN CONSTANTS ***************/
+#define BUF_SIZE     8192
+
+/**************** END CONSTANTS ***************/
+
+static Upstream upstreams[CONF_MAX_UPSTREAMS];
+static int n_upstreams = 0;
+static Proxy *proxies = NULL;  /* requests in flight */
+
+static int up_start(Pool *p, Proxy *px);
+static Backend *up_pick(Upstream *up, unsigned int tried);
+static UpConn *up_connect(Pool *p, Backend *be);
+static void up_send(Pool *p, Proxy *px);
+static void up_recv(Pool *p, Proxy *px);
+static int up_parse(Proxy *px);
+static void up_done(Pool *p, Proxy *px);
+static void up_fail(Pool *p, Proxy *px, int timed_out);
+static void up_too_big(Pool *p, Proxy *px);
+static void up_error(Pool *p, Proxy *px, char *errnum, char *shortmsg,
+                     char *longmsg);
+static void up_release(Pool *p, UpConn *c, int keep);
+static void up_close(Pool *p, UpConn *c);
+static void up_free(Proxy *px);
+static int is_hop_header(char *line, int len);
+
+
+/** @brief Resolve the upstream groups of the config
+ *  @param p Pool struct of the server
+ *  @return EXIT_FAILURE on fail
+ *  @return EXIT_SUCCESS on success
+ */
+int upstream_init(Pool *p) {
+    int i, j;
+    char host[CONF_NAME_SIZE], *colon;
+    ConfUpstream *cu;
+    Backend *be;
+
+    for (i = 0; i < conf.n_upstreams; i++) {
+        cu = &conf.upstreams[i];
+        strcpy(upstreams[i].name, cu->name);
+        upstreams[i].balance = cu->balance;
+        upstreams[i].n_backends = 0;
+        for (j = 0; j < cu->n_servers; j++) {
+            be = &upstreams[i].backends[j];
+            memset(be, 0, sizeof(Backend));
+            snprintf(be->name, CONF_NAME_SIZE, "%s", cu->servers[j]);
+            strcpy(host, be->name);
+            if ((colon = strchr(host, ':')) == NULL) {
+                fprintf(stderr, "Bad upstream server %s.\n", be->name);
+                return EXIT_FAILURE;
+            }
+            *colon = '\0';
+            be->addr.sin_family = AF_INET;
+            be->addr.sin_port = htons((unsigned short)atoi(colon + 1));
+            if (inet_pton(AF_INET, host, &be->addr.sin_addr) != 1) {
+                fprintf(stderr, "Bad upstream server %s.\n", be->name);
+                return EXIT_FAILURE;
+            }
+            be->ewma = 1;
+            upstreams[i].n_backends++;
+        }
+    }
+    n_upstreams = conf.n_upstreams;
+    return EXIT_SUCCESS;
+}
+
+/** @brief Find an upstream group by name, for the routes to it
+ *  @param name the name of the group
+ *  @return the group, NULL if not defined
+ */
+Upstream *upstream_find(const char *name) {
+    int i;
+
+    for (i = 0; i < n_upstreams; i++)
+        if (!strcmp(upstreams[i].name, name))
+            return &upstreams[i];
+    return NULL;
+}
+
+/** @brief Forward the current request of a connection
+ *  @param p Pool struct of the server
+ *  @param b Buff struct representing a connection
+ *  @param up the upstream group
+ *  @return EXIT_FAILURE if no server could be reached, the request
+ *          has been answered with an error
+ *  @return EXIT_SUCCESS on success
+ */
+int upstream_serve(Pool *p, Buff *b, Upstream *up) {
+    Requests *req = b->cur_request;
+    Headers *hdr;
+    Proxy *px;
+    int len;
+
+    /* request line, headers, our own, then the body */
+    len = strlen(req->method) + strlen(req->uri) + 16;
+    for (hdr = req->header; hdr; hdr = hdr->next)
+        len += strlen(hdr->key) + strlen(hdr->value) + 4;
+    len += 128 + INET_ADDRSTRLEN + req->post_body_length;
+
+    px = (Proxy *)calloc(1, sizeof(Proxy));
+    px->up = up;
+    px->client = conntab_id(&p->conns, b);
+    px->req = req;
+    px->out = (char *)malloc(len);
+    px->out_len = sprintf(px->out, "%s %s HTTP/1.1\r\n",
+                          req->method, req->uri);
+    for (hdr = req->header; hdr; hdr = hdr->next) {
+        if (is_hop_header(hdr->key, strlen(hdr->key)) ||
+            !strcasecmp(hdr->key, "Expect"))
+            continue;
+        px->out_len += sprintf(px->out + px->out_len, "%s: %s\r\n",
+                               hdr->key, hdr->value);
+    }
+    px->out_len += sprintf(px->out + px->out_len,
+                           "X-Forwarded-For: %s\r\n"
+                           "X-Forwarded-Proto: %s\r\n"
+                           "Connection: keep-alive\r\n\r\n",
+                           b->cold->addr, b->cold->client_context ? "https" : "http");
+    if (req->post_body != NULL) {
+        memcpy(px->out + px->out_len, req->post_body, req->post_body_length);
+        px->out_len += req->post_body_length;
+    }
+
+    px->idempotent = strcasecmp(req->method, "POST") != 0;
+    px->no_body = !strcasecmp(req->method, "HEAD");
+    gettimeofday(&px->start, NULL);
+    px->deadline = time(NULL) + UPSTREAM_TIMEOUT;
+    px->next = proxies;
+    proxies = px;
+
+    req->proxy = px;
+    req->valid = REQ_PIPE;
+
+    return up_start(p, px);
+}
+
+/** @brief Send a proxied request on a connection to the next server
+ *  @param p Pool struct of the server
+ *  @param px the proxied request
+ *  @return EXIT_FAILURE if no server is left, the request
+ *          has been answered with an error and freed
+ *  @return EXIT_SUCCESS on success
+ */
+static int up_start(Pool *p, Proxy *px) {
+    Backend *be;
+    UpConn *c = NULL;
+
+    while (c == NULL) {
+        if (px->attempts > px->up->n_backends ||
+            (be = up_pick(px->up, px->tried)) == NULL) {
+            up_error(p, px, "502", "Bad Gateway",
+                     "Liso could not reach an upstream server");
+            up_free(px);
+            return EXIT_FAILURE;
+        }
+        px->attempts++;
+        if ((c = up_connect(p, be)) == NULL) {
+            be->fails++;
+            if (be->fails >= UPSTREAM_MAX_FAILS)
+                be->down_until = time(NULL) + UPSTREAM_FAIL_TIMEOUT;
+            px->tried |= 1u << (be - px->up->backends);
+        }
+    }
+
+    PROBE(PR_PROXY, forward, "%s %s to %s", px->req->method, px->req->uri,
+          c->be->name);
+    c->px = px;
+    c->be->active++;
+    px->conn = c;
+    px->out_off = 0;
+    px->in_len = 0;
+    px->hdr_len = 0;
+    if (c->state == UP_SENDING)
+        up_send(p, px);
+    else
+        FD_SET(c->fd, &p->write_set);
+    return EXIT_SUCCESS;
+}
+
+/** @brief Pick the server of a group to send the next request to
+ *         Ejected servers are skipped unless nothing else is left
+ *  @param up the upstream group
+ *  @param tried bit per backend not to pick again
+ *  @return the server, NULL if all were tried
+ */
+static Backend *up_pick(Upstream *up, unsigned int tried) {
+    Backend *be, *best = NULL;
+    double score, best_score = 0;
+    time_t now = time(NULL);
+    int i, down, best_down = 1;
+
+    for (i = 0; i < up->n_backends; i++) {
+        if (tried & (1u << i))
+            continue;
+        be = &up->backends[i];
+        down = be->down_until > now;
+        if (up->balance == BALANCE_EWMA)
+            score = be->ewma * (be->active + 1);
+        else
+            score = be->active;
+        if (best == NULL || down < best_down ||
+            (down == best_down && score < best_score)) {
+            best = be;
+            best_score = score;
+            best_down = down;
+        }
+    }
+    return best;
+}
+
+/** @brief Get a connection to a server, reusing an idle one if possible
+ *  @param p Pool struct of the server
+ *  @param be the server
+ *  @return the connection, NULL if the connect failed
+ */
+static UpConn *up_connect(Pool *p, Backend *be) {
+    UpConn *c;
+    int fd;
+    char ch;
+
+    while ((c = be->idle) != NULL) {
+        be->idle = c->next;
+        be->n_idle--;
+        /* the server may have closed it since */
+        if (recv(c->fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            FD_CLR(c->fd, &p->read_set);
+            c->state = UP_SENDING;
+            c->next = NULL;
+            return c;
+        }
+        up_close(p, c);
+    }
+
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     0)) < 0) {
+        fprintf(stderr, "Failed creating upstream socket.\n");
+        return NULL;
+    }
+    if (connect(fd, (struct sockaddr *)&be->addr, sizeof(be->addr)) < 0 &&
+        errno != EINPROGRESS) {
+        PROBE(PR_PROXY, connect_error, "%s, errno %d", be->name, errno);
+        close(fd);
+        return NULL;
+    }
+
+    c = (UpConn *)calloc(1, sizeof(UpConn));
+    c->fd = fd;
+    c->be = be;
+    c->state = UP_CONNECTING;
+    if (fd > p->maxfd)
+        p->maxfd = fd;
+    p->cur_conn += 1;
+    return c;
+}
+
+/** @brief Send what is left of a request
+ *  @param p Pool struct of the server
+ *  @param px the proxied request
+ *  @return Void
+ */
+static void up_send(Pool *p, Proxy *px) {
+    UpConn *c = px->conn;
+    ssize_t sendret;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (c->state == UP_CONNECTING) {
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            PROBE(PR_PROXY, connect_error, "%s, errno %d", c->be->name,
+                  err);
+            up_fail(p, px, 0);
+            return;
+        }
+        c->state = UP_SENDING;
+    }
+
+    while (px->out_off < px->out_len) {
+        sendret = send(c->fd, px->out + px->out_off,
+                       px->out_len - px->out_off, MSG_NOSIGNAL);
+        if (sendret > 0) {
+            px->out_off += sendret;
+        } else if (sendret < 0 && errno == EINTR) {
+            continue;
+        } else if (sendret < 0 && errno == EAGAIN) {
+            FD_SET(c->fd, &p->write_set);
+            return;
+        } else {
+            up_fail(p, px, 0);
+            return;
+        }
+    }
+
+    c->state = UP_READING;
+    FD_CLR(c->fd, &p->write_set);
+    FD_SET(c->fd, &p->read_set);
+}
+
+/** @brief Read what the server has sent so far
+ *  @param p Pool struct of the server
+ *  @param px the proxied request
+ *  @return Void
+ */
+static void up_recv(Pool *p, Proxy *px) {
+    UpConn *c = px->conn;
+    ssize_t readret;
+    int ret, size;
+    char *in;
+
+    while (1) {
+        if (px->in_size - px->in_len < BUF_SIZE) {
+            if (px->in_len >= conf.upstream_response) {
+                up_too_big(p, px);
+                return;
+            }
+            size = px->in_size ? px->in_size * 2 : BUF_SIZE;
+            if ((in = (char *)realloc(px->in, size)) == NULL) {
+                fprintf(stderr, "Error allocating %d bytes of a response.\n",
+                        size);
+                up_too_big(p, px);
+                return;
+            }
+            px->in = in;
+            px->in_size = size;
+        }
+        readret = recv(c->fd, px->in + px->in_len,
+                       px->in_size - px->in_len, 0);
+        if (readret > 0) {
+            px->in_len += readret;
+            if ((ret = up_parse(px)) == 1) {
+                up_done(p, px);
+                return;
+            } else if (ret == -2) {
+                up_too_big(p, px);
+                return;
+            } else if (ret < 0) {
+                up_fail(p, px, 0);
+                return;
+            }
+        } else if (readret < 0 && errno == EINTR) {
+            continue;
+        } else if (readret < 0 && errno == EAGAIN) {
+            return;
+        } else {
+            break;
+        }
+    }
+
+    /* EOF or error, fine only if the body runs until close */
+    if (readret == 0 && px->hdr_len && px->body_len < 0 && !px->chunked) {
+        px->keepalive = 0;
+        up_done(p, px);
+    } else
+        up_fail(p, px, 0);
+}
+
+/** @brief Parse the response read so far
+ *  @param px the proxied request
+ *  @return 1 when the response is complete
+ *  @return 0 when more is to come
+ *  @return -1 if the response is malformed
+ *  @return -2 if the response is larger than upstream_response
+ */
+static int up_parse(Proxy *px) {
+    char *end, *line, *eol, *colon, *p;
+    int minor = 1, line_len;
+    long size;
+
+    if (px->hdr_len == 0) {
+        if ((end = memmem(px->in, px->in_len, "\r\n\r\n", 4)) == NULL)
+            return px->in_len > UPSTREAM_MAX_HDR ? -1 : 0;
+        if (sscanf(px->in, "HTTP/1.%d %d", &minor, &px->status) != 2)
+            return -1;
+        /* skip an interim response */
+        if (px->status >= 100 && px->status < 200) {
+            px->in_len -= end + 4 - px->in;
+            memmove(px->in, end + 4, px->in_len);
+            return up_parse(px);
+        }
+        px->hdr_len = end + 4 - px->in;
+        px->body_len = -1;
+        px->chunked = 0;
+        px->keepalive = minor >= 1;
+        if (px->status == 204 || px->status == 304)
+            px->no_body = 1;
+
+        line = memmem(px->in, px->hdr_len, "\r\n", 2) + 2;
+        while ((eol = memmem(line, end + 2 - line, "\r\n", 2)) != NULL) {
+            *eol = '\0';
+            if ((colon = strchr(line, ':')) != NULL) {
+                *colon = '\0';
+                p = colon + 1;
+                while (*p == ' ' || *p == '\t')
+                    p++;
+                if (!strcasecmp(line, "Content-Length"))
+                    px->body_len = atol(p);
+                else if (!strcasecmp(line, "Transfer-Encoding") &&
+                         strcasestr(p, "chunked"))
+                    px->chunked = 1;
+                else if (!strcasecmp(line, "Connection"))
+                    px->keepalive = strcasestr(p, "close") ? 0 :
+                                    strcasestr(p, "keep-alive") ? 1 :
+                                    px->keepalive;
+                *colon = ':';
+            }
+            *eol = '\r';
+            line = eol + 2;
+        }
+        px->chunk_off = px->hdr_len;
+        if (px->body_len > conf.upstream_response)
+            return -2;
+    }
+
+    if (px->no_body) {
+        px->in_len = px->hdr_len;
+        return 1;
+    }
+    if (px->chunked) {
+        while (1) {
+            line = px->in + px->chunk_off;
+            if ((eol = memmem(line, px->in_len - px->chunk_off,
+                              "\r\n", 2)) == NULL)
+                return 0;
+            line_len = eol + 2 - line;
+            /* hex digits, then maybe extensions after a ';' */
+            if (!isxdigit((unsigned char)*line))
+                return -1;
+            errno = 0;
+            size = strtol(line, &p, 16);
+            if (errno == ERANGE || (*p != '\r' && *p != ';' && *p != ' ' &&
+                                    *p != '\t'))
+                return -1;
+            if (size > conf.upstream_response)
+                return -2;
+            if (size == 0) {
+                /* last chunk, then optional trailers and a blank line */
+                line = eol + 2;
+                if (px->in_len - (line - px->in) >= 2 &&
+                    !memcmp(line, "\r\n", 2)) {
+                    px->in_len = line + 2 - px->in;
+                    return 1;
+                }
+                if ((end = memmem(line, px->in_len - (line - px->in),
+                                  "\r\n\r\n", 4)) == NULL)
+                    return 0;
+                px->in_len = end + 4 - px->in;
+                return 1;
+            }
+            if ((long)px->chunk_off + line_len + size + 2 > px->in_len)
+                return 0;
+            px->chunk_off += line_len + size + 2;
+        }
+    }
+    if (px->body_len >= 0) {
+        if (px->in_len < px->hdr_len + px->body_len)
+            return 0;
+        px->in_len = px->hdr_len + px->body_len;
+        return 1;
+    }
+    return 0;  /* body runs until the server closes */
+}
+
+/** @brief Answer the client with the complete response
+ *  @param p Pool struct of the server
+ *  @param px the proxied request
+ *  @return Void
+ */
+static void up_done(Pool *p, Proxy *px) {
+    UpConn *c = px->conn;
+    Requests *req = px->req;
+    Buff *b = conntab_get(&p->conns, px->client);
+    struct timeval now;
+    double ms;
+    char *line, *eol, *out;
+    int len;
+
+    gettimeofday(&now, NULL);
+    ms = (now.tv_sec - px->start.tv_sec) * 1000.0 +
+         (now.tv_usec - px->start.tv_usec) / 1000.0;
+    c->be->ewma = c->be->ewma * 0.8 + ms * 0.2;
+    c->be->fails = 0;
+    c->be->down_until = 0;
+    up_release(p, c, px->keepalive);
+    px->conn = NULL;
+    if (b == NULL) {
+        up_free(px);
+        return;
+    }
+
+    /* copy the response, our connection headers replace the server's */
+    out = (char *)arena_alloc(&req->arena, px->in_len + 96);
+    eol = memmem(px->in, px->hdr_len, "\r\n", 2);
+    len = eol + 2 - px->in;
+    memcpy(out, px->in, len);
+    for (line = eol + 2; line < px->in + px->hdr_len - 2; line = eol + 2) {
+        eol = memmem(line, px->in + px->hdr_len - line, "\r\n", 2);
+        if (is_hop_header(line, eol - line))
+            continue;
+        memcpy(out + len, line, eol + 2 - line);
+        len += eol + 2 - line;
+    }
+    /* a body that ran until the server closed has no framing, and the
+       client connection may stay open, so give it its length */
+    if (px->body_len < 0 && !px->chunked && !px->no_body)
+        len += sprintf(out + len, "Content-Length: %d\r\n",
+                       px->in_len - px->hdr_len);
+    len += sprintf(out + len, "Connection: %s\r\n\r\n",
+                   b->stage == STAGE_CLOSE ? "Close" : "Keep-Alive");
+    memcpy(out + len, px->in + px->hdr_len, px->in_len - px->hdr_len);
+    len += px->in_len - px->hdr_len;
+
+    req->response = out;
+    req->response_len = len;
+    req->body = NULL;
+    req->valid = REQ_VALID;
+    req->proxy = NULL;
+    TRACE_PHASE(req, PH_READY);
+    FD_SET(b->fd, &p->write_set);
+    up_free(px);
+}
+
+/** @brief Handle a failed exchange with a server
+ *         The request goes to the next server when that is safe
+ *  @param p Pool struct of the server
+ *  @param px the proxied request
+ *  @param timed_out whether the server took too long
+ *  @return Void
+ */
+static void up_fail(Pool *p, Proxy *px, int timed_out) {
+    UpConn *c = px->conn;
+    Backend *be = c->be;
+    int quiet_close, sent;
+
+    /* a pooled connection closed under us is not the server's fault */
+    quiet_close = c->reused && px->in_len == 0 && !timed_out;
+    sent = c->state != UP_CONNECTING;
+    if (!quiet_close) {
+        be->fails++;
+        if (be->fails >= UPSTREAM_MAX_FAILS)
+            be->down_until = time(NULL) + UPSTREAM_FAIL_TIMEOUT;
+        px->tried |= 1u << (be - px->up->backends);
+    }
+    PROBE(PR_PROXY, fail, "%s, %d in a row", be->name, be->fails);
+    up_release(p, c, 0);
+    px->conn = NULL;
+
+    if (timed_out) {
+        up_error(p, px, "504", "Gateway Timeout",
+                 "The upstream server did not answer in time");
+        up_free(px);
+    } else if (px->idempotent || quiet_close || !sent) {
+        if (quiet_close)
+            px->attempts--;
+        up_start(p, px);
+    } else {
+        up_error(p, px, "502", "Bad Gateway",
+                 "The upstream server failed");
+        up_free(px);
+    }
+}
+
+/** @brief Give up on a response too large to buffer, the server is
+ *         not at fault, so it is neither retried nor counted as failing
+ *  @param p Pool struct of the server
+ *  @param px the proxied request
+ *  @return Void
+ */
+static void up_too_big(Pool *p, Proxy *px) {
+    PROBE(PR_PROXY, too_big, "%s, %d bytes", px->conn->be->name, px->in_len);
+    up_release(p, px->conn, 0);
+    px->conn = NULL;
+    up_error(p, px, "502", "Bad Gateway",
+             "The upstream response is too large");
+    up_free(px);
+}
+
+/** @brief Answer the client of a proxied request with an error
+ *  @param p Pool struct of the server
+ *  @param px the proxied request
+ *  @param errnum error status number
+ *  @param shortmsg the string of shortmsg to be sent
+ *  @param longmsg the string of longmsg to be sent
+ *  @return Void
+ */
+static void up_error(Pool *p, Proxy *px, char *errnum, char *shortmsg,
+                     char *longmsg) {
+    Buff *b = conntab_get(&p->conns, px->client);
+
+    px->req->proxy = NULL;
+    if (b == NULL)
+        return;
+    clienterror(px->req, b->cold->addr, "", errnum, shortmsg, longmsg);
+    FD_SET(b->fd, &p->write_set);
+}
+
+/** @brief Move data for the proxied requests whose connections are ready
+ *         and drop idle connections the servers closed
+ *  @param p Pool struct of the server
+ *  @return Void
+ */
+void upstream_poll(Pool *p) {
+    Proxy *px, *next;
+    UpConn *c, **pp;
+    Backend *be;
+    int i, j;
+
+    for (px = proxies; px; px = next) {
+        next = px->next;
+        if ((c = px->conn) == NULL)
+            continue;
+        if (FD_ISSET(c->fd, &p->ready_write)) {
+            p->nready--;
+            FD_CLR(c->fd, &p->ready_write);
+            up_send(p, px);
+        } else if (FD_ISSET(c->fd, &p->ready_read)) {
+            p->nready--;
+            FD_CLR(c->fd, &p->ready_read);
+            up_recv(p, px);
+        }
+    }
+
+    for (i = 0; i < n_upstreams; i++)
+        for (j = 0; j < upstreams[i].n_backends; j++) {
+            be = &upstreams[i].backends[j];
+            for (pp = &be->idle; (c = *pp) != NULL; ) {
+                if (!FD_ISSET(c->fd, &p->ready_read)) {
+                    pp = &c->next;
+                    continue;
+                }
+                p->nready--;
+                *pp = c->next;
+                be->n_idle--;
+                up_close(p, c);
+            }
+        }
+}
+
+/** @brief Time out slow servers and old idle connections
+ *  @param p Pool struct of the server
+ *  @return Void
+ */
+void upstream_expire(Pool *p) {
+    Proxy *px, *next;
+    UpConn *c, **pp;
+    Backend *be;
+    time_t now = time(NULL);
+    int i, j;
+
+    for (px = proxies; px; px = next) {
+        next = px->next;
+        if (px->conn && now > px->deadline)
+            up_fail(p, px, 1);
+    }
+
+    for (i = 0; i < n_upstreams; i++)
+        for (j = 0; j < upstreams[i].n_backends; j++) {
+            be = &upstreams[i].backends[j];
+            for (pp = &be->idle; (c = *pp) != NULL; ) {
+                if (now - c->idle_since <= UPSTREAM_IDLE_TIMEOUT) {
+                    pp = &c->next;
+                    continue;
+                }
+                *pp = c->next;
+                be->n_idle--;
+                up_close(p, c);
+            }
+        }
+}
+
+/** @brief Drop a proxied request when its client goes away
+ *  @param p Pool struct of the server
+ *  @param req the request being freed
+ *  @return Void
+ */
+void upstream_cancel(Pool *p, Requests *req) {
+    Proxy *px = req->proxy;
+
+    if (px == NULL)
+        return;
+    req->proxy = NULL;
+    /* the response is half read, the connection can't be reused */
+    if (px->conn)
+        up_release(p, px->conn, 0);
+    up_free(px);
+}
+
+/** @brief Whether requests are in flight or connections are pooled
+ *         the caller should then wake up periodically for upstream_expire()
+ *  @return 1 on yes 0 on no
+ */
+int upstream_active() {
+    int i, j;
+
+    if (proxies != NULL)
+        return 1;
+    for (i = 0; i < n_upstreams; i++)
+        for (j = 0; j < upstreams[i].n_backends; j++)
+            if (upstreams[i].backends[j].idle)
+                return 1;
+    return 0;
+}
+
+/** @brief Give a connection back after an exchange
+ *  @param p Pool struct of the server
+ *  @param c the connection
+ *  @param keep whether it may carry another request
+ *  @return Void
+ */
+static void up_release(Pool *p, UpConn *c, int keep) {
+    Backend *be = c->be;
+
+    be->active--;
+    c->px = NULL;
+    FD_CLR(c->fd, &p->write_set);
+    if (!keep || be->n_idle >= UPSTREAM_MAX_IDLE) {
+        up_close(p, c);
+        return;
+    }
+    /* stay selected for reading to notice the server closing it */
+    c->state = UP_IDLE;
+    c->reused = 1;
+    c->idle_since = time(NULL);
+    c->next = be->idle;
+    be->idle = c;
+    be->n_idle++;
+    FD_SET(c->fd, &p->read_set);
+}
+
+/** @brief Close a connection to a server
+ *  @param p Pool struct of the server
+ *  @param c the connection, not in any list
+ *  @return Void
+ */
+static void up_close(Pool *p, UpConn *c) {
+    FD_CLR(c->fd, &p->read_set);
+    FD_CLR(c->fd, &p->write_set);
+    close(c->fd);
+    p->cur_conn -= 1;
+    free(c);
+}
+
+/** @brief Unlink a proxied request and free it
+ *  @param px the proxied request, its connection already released
+ *  @return Void
+ */
+static void up_free(Proxy *px) {
+    Proxy **pp;
+
+    for (pp = &proxies; *pp; pp = &(*pp)->next)
+        if (*pp == px) {
+            *pp = px->next;
+            break;
+        }
+    free(px->out);
+    free(px->in);
+    free(px);
+}
+
+/** @brief Whether a header only concerns a single connection
+ *  @param line the header line or name
+ *  @param len length of line
+ *  @return 1 on yes 0 on no
+ */
+static int is_hop_header(char *line, int len) {
+    static char *hop[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate",
+        "Proxy-Authorization", "TE", "Trailer", "Upgrade", NULL
+    };
+    int i, n;
+
+    for (i = 0; hop[i]; i++) {
+        n = strlen(hop[i]);
+        if (len >= n && !strncasecmp(line, hop[i], n) &&
+            (len == n || line[n] == ':'))
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,109 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "mio.h"
+#include "conf.h"
+
+
+#define UPSTREAM_MAX_FAILS     3   /* Failures in a row before ejecting */
+#define UPSTREAM_FAIL_TIMEOUT  10  /* Seconds an ejected server sits out */
+#define UPSTREAM_TIMEOUT       30  /* Seconds to wait for a response */
+#define UPSTREAM_MAX_IDLE      16  /* Idle keep-alive connections kept */
+#define UPSTREAM_IDLE_TIMEOUT  60  /* Seconds an idle connection is kept */
+#define UPSTREAM_MAX_HDR       16384 /* Max length of response headers */
+
+#define UP_CONNECTING          0
+#define UP_SENDING             1
+#define UP_READING             2
+#define UP_IDLE                3
+
+/** @brief A connection to a backend server
+ *
+ */
+typedef struct up_conn {
+    int fd;
+    struct backend *be;
+    int state;
+    int reused;        /* served a request before, the server may close it */
+    time_t idle_since;
+    struct proxy *px;  /* exchange using the connection, NULL when idle */
+    struct up_conn *next;  /* in the idle list of the backend */
+} UpConn;
+
+/** @brief A server of an upstream group and its keep-alive pool
+ *
+ */
+typedef struct backend {
+    char name[CONF_NAME_SIZE];  /* "ip:port" */
+    struct sockaddr_in addr;
+    int active;         /* requests in flight */
+    double ewma;        /* moving average of response time, ms */
+    int fails;          /* failures in a row */
+    time_t down_until;  /* ejected until then by passive health checks */
+    UpConn *idle;       /* idle keep-alive connections */
+    int n_idle;
+} Backend;
+
+/** @brief A group of backends, one of them serves each request
+ *
+ */
+typedef struct upstream {
+    char name[CONF_NAME_SIZE];
+    Backend backends[CONF_MAX_BACKENDS];
+    int n_backends;
+    int balance;
+} Upstream;
+
+/** @brief A request being forwarded to an upstream group
+ *
+ */
+typedef struct proxy {
+    Upstream *up;
+    ConnId client;      /* client connection */
+    Requests *req;
+    UpConn *conn;       /* connection currently carrying the request */
+    char *out;          /* the request as sent to the backend */
+    int out_len;
+    int out_off;
+    char *in;           /* the response read so far */
+    int in_len;
+    int in_size;
+    int hdr_len;        /* length of response headers, 0 until parsed */
+    int status;
+    long body_len;      /* Content-Length, -1 if not given */
+    int chunked;
+    int chunk_off;      /* where the next chunk size line starts */
+    int keepalive;      /* the backend will keep the connection open */
+    int no_body;
+    int idempotent;     /* may be sent again after a failure */
+    unsigned int tried; /* bit per backend already tried */
+    int attempts;
+    struct timeval start;
+    time_t deadline;
+    struct proxy *next;
+} Proxy;
+
+
+/* Upstream package */
+int upstream_init(Pool *p);
+Upstream *upstream_find(const char *name);
+int upstream_serve(Pool *p, Buff *b, Upstream *up);
+void upstream_poll(Pool *p);
+void upstream_expire(Pool *p);
+void upstream_cancel(Pool *p, Requests *req);
+int upstream_active(void);
+
+#endif